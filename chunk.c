@@ -0,0 +1,566 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+
+/*
+ * Content-addressed chunk store.
+ *
+ * Old data that has to be kept verbatim is cut into content-defined chunks
+ * (a gear hash picks the cut points, so an insertion only disturbs the
+ * chunks around it) and every chunk is keyed by its SHA-256.  A chunk is
+ * stored once in the "data" file under .diaryfs/chunks and reference
+ * counted; version records refer to it by key and location.
+ *
+ * The key index lives on disk in the "index" file: a fixed number of page
+ * sized buckets, probed linearly, with one slot per chunk.  Slots whose
+ * count dropped to zero are left as tombstones so probing still finds the
+ * slots behind them.  A new chunk's slot is written as soon as it is
+ * taken, so no other key can probe its way into it.  Memory holds a
+ * bounded cache of index entries on an LRU; later reference count changes
+ * are made there and written back to their slot when the entry is evicted
+ * or the log is flushed, which always happens before the records that
+ * took the references reach disk.
+ */
+
+/* random numbers for the gear hash, fixed so cut points survive remounts */
+static u64 diaryfs_gear[256];
+
+void diaryfs_init_gear(void)
+{
+	u64 x = 0x9e3779b97f4a7c15ULL;
+	unsigned int i;
+
+	/* splitmix64 */
+	for (i = 0; i < ARRAY_SIZE(diaryfs_gear); i++) {
+		u64 z = (x += 0x9e3779b97f4a7c15ULL);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		diaryfs_gear[i] = z ^ (z >> 31);
+	}
+}
+
+/* length of the chunk starting at @buf, at most @len bytes */
+static size_t diaryfs_chunk_cut(const u8 *buf, size_t len)
+{
+	size_t i, max = min_t(size_t, len, DIARYFS_CHUNK_MAX);
+	u64 h = 0;
+
+	if (len <= DIARYFS_CHUNK_MIN)
+		return len;
+	for (i = 0; i < max; i++) {
+		h = (h << 1) + diaryfs_gear[buf[i]];
+		if (i >= DIARYFS_CHUNK_MIN && !(h & DIARYFS_CHUNK_MASK))
+			return i + 1;
+	}
+	return max;
+}
+
+static int diaryfs_chunk_key(struct diaryfs_cstore *cs, const void *buf,
+		size_t len, u8 *key)
+{
+	SHASH_DESC_ON_STACK(desc, cs->sha);
+
+	desc->tfm = cs->sha;
+	desc->flags = 0;
+	return crypto_shash_digest(desc, buf, len, key);
+}
+
+static inline u32 diaryfs_chunk_bucket(const u8 *key)
+{
+	return get_unaligned_le32(key) % DIARYFS_CIDX_BUCKETS;
+}
+
+static struct diaryfs_chunk *diaryfs_chunk_cached(struct diaryfs_cstore *cs,
+		const u8 *key)
+{
+	struct diaryfs_chunk *c;
+
+	hlist_for_each_entry(c, &cs->table[hash_32(get_unaligned_le32(key),
+			DIARYFS_CHUNK_HASH_BITS)], hash)
+		if (!memcmp(c->key, key, DIARYFS_CHUNK_KEY))
+			return c;
+	return NULL;
+}
+
+static void diaryfs_chunk_cache_add(struct diaryfs_cstore *cs,
+		struct diaryfs_chunk *c)
+{
+	hlist_add_head(&c->hash, &cs->table[hash_32(get_unaligned_le32(c->key),
+			DIARYFS_CHUNK_HASH_BITS)]);
+	list_add(&c->lru, &cs->lru);
+	cs->nr_cached++;
+}
+
+/* write @c's slot back to the index file; caller holds cs->lock */
+static int diaryfs_chunk_writeback(struct diaryfs_cstore *cs,
+		struct diaryfs_chunk *c)
+{
+	struct diaryfs_cidx_ent ent;
+	ssize_t ret;
+
+	if (!c->dirty)
+		return 0;
+	memcpy(ent.key, c->key, DIARYFS_CHUNK_KEY);
+	ent.loc = cpu_to_le64(c->loc);
+	ent.len = cpu_to_le32(c->len);
+	ent.refs = cpu_to_le32(c->refs);
+	ret = kernel_write(cs->index, (char *)&ent, sizeof(ent), c->ipos);
+	if (ret != sizeof(ent))
+		return ret < 0 ? ret : -EIO;
+	c->dirty = false;
+	return 0;
+}
+
+/* drop cached entries beyond the limit, oldest first */
+static void diaryfs_chunk_shrink(struct diaryfs_cstore *cs)
+{
+	struct diaryfs_chunk *c;
+
+	while (cs->nr_cached > diaryfs_chunk_cache) {
+		c = list_last_entry(&cs->lru, struct diaryfs_chunk, lru);
+		/* can't drop what didn't make it to disk; try again later */
+		if (diaryfs_chunk_writeback(cs, c))
+			break;
+		hlist_del(&c->hash);
+		list_del(&c->lru);
+		cs->nr_cached--;
+		kfree(c);
+	}
+}
+
+/*
+ * Find @key in the on-disk index.  Returns the entry, filled in and cached,
+ * or NULL with *@free set to the first slot a new entry could take (or -1
+ * if the probe sequence is full).  Caller holds cs->lock.
+ */
+static struct diaryfs_chunk *diaryfs_chunk_lookup(struct diaryfs_cstore *cs,
+		const u8 *key, loff_t *free)
+{
+	struct diaryfs_cidx_ent *ents = cs->bucket;
+	u32 b = diaryfs_chunk_bucket(key);
+	struct diaryfs_chunk *c;
+	unsigned int i, probe;
+	int ret;
+
+	*free = -1;
+	for (probe = 0; probe < DIARYFS_CIDX_PROBE; probe++) {
+		loff_t base = (loff_t)((b + probe) % DIARYFS_CIDX_BUCKETS) <<
+			PAGE_SHIFT;
+
+		ret = kernel_read(cs->index, base, (char *)ents, PAGE_SIZE);
+		if (ret < 0)
+			return ERR_PTR(ret);
+		/* past EOF reads as empty */
+		memset((char *)ents + ret, 0, PAGE_SIZE - ret);
+
+		for (i = 0; i < DIARYFS_CIDX_SLOTS; i++) {
+			loff_t pos = base + i * sizeof(*ents);
+
+			if (!ents[i].loc) {
+				/* an empty slot ends the probe sequence */
+				if (*free < 0)
+					*free = pos;
+				return NULL;
+			}
+			if (!ents[i].refs) {
+				if (*free < 0)
+					*free = pos;
+				continue;
+			}
+			if (memcmp(ents[i].key, key, DIARYFS_CHUNK_KEY))
+				continue;
+
+			c = kzalloc(sizeof(*c), GFP_NOFS);
+			if (!c)
+				return ERR_PTR(-ENOMEM);
+			memcpy(c->key, key, DIARYFS_CHUNK_KEY);
+			c->loc = le64_to_cpu(ents[i].loc);
+			c->len = le32_to_cpu(ents[i].len);
+			c->refs = le32_to_cpu(ents[i].refs);
+			c->ipos = pos;
+			diaryfs_chunk_cache_add(cs, c);
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/* append a new chunk to the data file; caller holds cs->lock */
+static int diaryfs_chunk_write(struct diaryfs_sb_info *sbi,
+		struct diaryfs_chunk *c, const void *buf, size_t len)
+{
+	struct diaryfs_cstore *cs = &sbi->chunks;
+	struct diaryfs_zstrm *zstrm = NULL;
+	struct diaryfs_chunk_hdr hdr;
+	struct kvec vec[2];
+	struct iov_iter iter;
+	unsigned int codec = sbi->codec;
+	size_t stored = len;
+	loff_t pos;
+	ssize_t ret;
+	int err = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (codec != DIARYFS_CODEC_NONE) {
+		zstrm = diaryfs_zstrm_get(codec);
+		if (IS_ERR(zstrm)) {
+			zstrm = NULL;
+		} else {
+			unsigned int clen = diaryfs_compress(zstrm, buf, len);
+
+			if (clen) {
+				hdr.codec = codec;
+				buf = zstrm->buf;
+				stored = clen;
+			}
+		}
+	}
+
+	hdr.magic = cpu_to_le32(DIARYFS_CHUNK_MAGIC);
+	hdr.len = cpu_to_le32(stored);
+	hdr.raw_len = cpu_to_le32(len);
+	hdr.crc = cpu_to_le32(crc32c(~0, buf, stored));
+	memcpy(hdr.key, c->key, DIARYFS_CHUNK_KEY);
+
+	vec[0].iov_base = &hdr;
+	vec[0].iov_len = sizeof(hdr);
+	vec[1].iov_base = (void *)buf;
+	vec[1].iov_len = stored;
+	iov_iter_kvec(&iter, ITER_KVEC | WRITE, vec, 2, sizeof(hdr) + stored);
+
+	pos = cs->tail;
+	file_start_write(cs->data);
+	ret = vfs_iter_write(cs->data, &iter, &pos);
+	file_end_write(cs->data);
+	if (ret != sizeof(hdr) + stored) {
+		err = ret < 0 ? ret : -EIO;
+		goto out;
+	}
+
+	c->loc = cs->tail;
+	c->len = sizeof(hdr) + stored;
+	cs->tail += ALIGN(c->len, 8);
+out:
+	if (zstrm)
+		diaryfs_zstrm_put(codec, zstrm);
+	return err;
+}
+
+/* take a reference on the chunk holding @buf, storing it if it's new */
+static int diaryfs_chunk_get(struct diaryfs_sb_info *sbi, const void *buf,
+		size_t len, struct diaryfs_chunk_ref *ref)
+{
+	struct diaryfs_cstore *cs = &sbi->chunks;
+	struct diaryfs_chunk *c;
+	loff_t free;
+	int err;
+
+	err = diaryfs_chunk_key(cs, buf, len, ref->key);
+	if (err)
+		return err;
+
+	mutex_lock(&cs->lock);
+	c = diaryfs_chunk_cached(cs, ref->key);
+	if (!c)
+		c = diaryfs_chunk_lookup(cs, ref->key, &free);
+	if (IS_ERR(c)) {
+		err = PTR_ERR(c);
+		goto out;
+	}
+	if (c) {
+		c->refs++;
+		c->dirty = true;
+		list_move(&c->lru, &cs->lru);
+		goto found;
+	}
+
+	if (free < 0) {
+		err = -ENOSPC;
+		goto out;
+	}
+	c = kzalloc(sizeof(*c), GFP_NOFS);
+	if (!c) {
+		err = -ENOMEM;
+		goto out;
+	}
+	memcpy(c->key, ref->key, DIARYFS_CHUNK_KEY);
+	c->ipos = free;
+	err = diaryfs_chunk_write(sbi, c, buf, len);
+	if (err) {
+		kfree(c);
+		goto out;
+	}
+	c->refs = 1;
+	c->dirty = true;
+	/*
+	 * Claim the slot on disk right away: until then the next new key
+	 * probing this bucket would find it empty and take it too.
+	 */
+	err = diaryfs_chunk_writeback(cs, c);
+	if (err) {
+		vfs_fallocate(cs->data, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, c->loc, c->len);
+		kfree(c);
+		goto out;
+	}
+	diaryfs_chunk_cache_add(cs, c);
+found:
+	ref->loc = cpu_to_le64(c->loc);
+	ref->len = cpu_to_le32(len);
+	ref->reserved = 0;
+	diaryfs_chunk_shrink(cs);
+out:
+	mutex_unlock(&cs->lock);
+	return err;
+}
+
+/*
+ * diaryfs_chunk_put - drop a reference taken by diaryfs_chunk_store
+ *
+ * The last reference frees the chunk: its slot becomes a tombstone and its
+ * bytes are punched out of the data file.
+ */
+void diaryfs_chunk_put(struct diaryfs_sb_info *sbi,
+		const struct diaryfs_chunk_ref *ref)
+{
+	struct diaryfs_cstore *cs = &sbi->chunks;
+	struct diaryfs_chunk *c;
+	loff_t free;
+
+	mutex_lock(&cs->lock);
+	c = diaryfs_chunk_cached(cs, ref->key);
+	if (!c)
+		c = diaryfs_chunk_lookup(cs, ref->key, &free);
+	/* lost to a crash before its slot was written: nothing to drop */
+	if (IS_ERR_OR_NULL(c) || !c->refs)
+		goto out;
+
+	c->dirty = true;
+	if (--c->refs) {
+		list_move(&c->lru, &cs->lru);
+		goto out;
+	}
+	if (!diaryfs_chunk_writeback(cs, c))
+		vfs_fallocate(cs->data, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, c->loc, c->len);
+	hlist_del(&c->hash);
+	list_del(&c->lru);
+	cs->nr_cached--;
+	kfree(c);
+out:
+	mutex_unlock(&cs->lock);
+}
+
+/*
+ * diaryfs_chunk_store - put @len bytes of @buf in the chunk store
+ *
+ * Fills in up to @max refs, one per chunk, and returns how many were used.
+ * On failure no references are held.
+ */
+int diaryfs_chunk_store(struct diaryfs_sb_info *sbi, const u8 *buf,
+		size_t len, struct diaryfs_chunk_ref *refs, unsigned int max)
+{
+	unsigned int nr = 0;
+	size_t n;
+	int err;
+
+	if (!sbi->chunks.data)
+		return -EOPNOTSUPP;
+
+	while (len) {
+		if (nr == max) {
+			err = -E2BIG;
+			goto out_put;
+		}
+		n = diaryfs_chunk_cut(buf, len);
+		err = diaryfs_chunk_get(sbi, buf, n, &refs[nr]);
+		if (err)
+			goto out_put;
+		nr++;
+		buf += n;
+		len -= n;
+	}
+	return nr;
+
+out_put:
+	while (nr--)
+		diaryfs_chunk_put(sbi, &refs[nr]);
+	return err;
+}
+
+/* read the chunk @ref points at into @out, which has room for ref->len */
+int diaryfs_chunk_read(struct diaryfs_sb_info *sbi,
+		const struct diaryfs_chunk_ref *ref, void *out)
+{
+	struct diaryfs_chunk_hdr *hdr;
+	size_t len = le32_to_cpu(ref->len);
+	size_t stored;
+	char *buf;
+	int ret;
+
+	/* a read-only mount found no store to read from */
+	if (!sbi->chunks.data)
+		return -EUCLEAN;
+	buf = kmalloc(sizeof(*hdr) + DIARYFS_CHUNK_MAX, GFP_NOFS);
+	if (!buf)
+		return -ENOMEM;
+	ret = kernel_read(sbi->chunks.data, le64_to_cpu(ref->loc), buf,
+			sizeof(*hdr) + DIARYFS_CHUNK_MAX);
+	if (ret < (int)sizeof(*hdr)) {
+		ret = ret < 0 ? ret : -EUCLEAN;
+		goto out;
+	}
+	hdr = (struct diaryfs_chunk_hdr *)buf;
+	stored = le32_to_cpu(hdr->len);
+	if (le32_to_cpu(hdr->magic) != DIARYFS_CHUNK_MAGIC ||
+	    memcmp(hdr->key, ref->key, DIARYFS_CHUNK_KEY) ||
+	    le32_to_cpu(hdr->raw_len) != len ||
+	    sizeof(*hdr) + stored > ret ||
+	    crc32c(~0, hdr + 1, stored) != le32_to_cpu(hdr->crc)) {
+		ret = -EUCLEAN;
+		goto out;
+	}
+	ret = diaryfs_decompress(hdr->codec, hdr + 1, stored, out, len);
+out:
+	kfree(buf);
+	return ret;
+}
+
+/* write back every dirty index entry; caller holds neither lock */
+int diaryfs_chunk_flush(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_cstore *cs = &sbi->chunks;
+	struct diaryfs_chunk *c;
+	int err = 0, ret;
+
+	if (!cs->index)
+		return 0;
+	mutex_lock(&cs->lock);
+	list_for_each_entry(c, &cs->lru, lru) {
+		ret = diaryfs_chunk_writeback(cs, c);
+		if (ret && !err)
+			err = ret;
+	}
+	mutex_unlock(&cs->lock);
+	return err;
+}
+
+/* make the chunk store durable, ahead of the log that refers to it */
+int diaryfs_chunk_sync(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_cstore *cs = &sbi->chunks;
+	int err;
+
+	if (!cs->index || sbi->read_only)
+		return 0;
+	err = diaryfs_chunk_flush(sbi);
+	if (!err)
+		err = vfs_fsync(cs->data, 1);
+	if (!err)
+		err = vfs_fsync(cs->index, 1);
+	return err;
+}
+
+int diaryfs_chunk_open(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_cstore *cs = &sbi->chunks;
+	struct path dir;
+	unsigned int i;
+	int flags, err;
+
+	mutex_init(&cs->lock);
+	INIT_LIST_HEAD(&cs->lru);
+
+	cs->table = kcalloc(1U << DIARYFS_CHUNK_HASH_BITS, sizeof(*cs->table),
+			GFP_KERNEL);
+	cs->bucket = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!cs->table || !cs->bucket) {
+		err = -ENOMEM;
+		goto out_err;
+	}
+	for (i = 0; i < 1U << DIARYFS_CHUNK_HASH_BITS; i++)
+		INIT_HLIST_HEAD(&cs->table[i]);
+
+	cs->sha = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(cs->sha)) {
+		err = PTR_ERR(cs->sha);
+		cs->sha = NULL;
+		goto out_err;
+	}
+
+	/* read-only mounts make do with whatever store there is, if any */
+	if (!sbi->meta_path.dentry)
+		return 0;
+	err = diaryfs_meta_mkdir(&sbi->meta_path, DIARYFS_CHUNK_DIR,
+			!sbi->read_only, &dir);
+	if (err == -ENOENT && sbi->read_only)
+		return 0;
+	if (err)
+		goto out_err;
+	flags = sbi->read_only ? O_RDONLY : O_RDWR | O_CREAT;
+	cs->data = diaryfs_meta_open(&dir, "data", flags);
+	if (IS_ERR(cs->data)) {
+		err = PTR_ERR(cs->data);
+		cs->data = NULL;
+		goto out_put;
+	}
+	cs->index = diaryfs_meta_open(&dir, "index", flags);
+	if (IS_ERR(cs->index)) {
+		err = PTR_ERR(cs->index);
+		cs->index = NULL;
+		goto out_put;
+	}
+	path_put(&dir);
+
+	/* offset 0 means "empty slot", so chunks start after the first page */
+	cs->tail = max_t(loff_t, ALIGN(i_size_read(file_inode(cs->data)), 8),
+			PAGE_SIZE);
+	return 0;
+
+out_put:
+	path_put(&dir);
+out_err:
+	diaryfs_chunk_close(sbi);
+	return err;
+}
+
+void diaryfs_chunk_close(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_cstore *cs = &sbi->chunks;
+	struct diaryfs_chunk *c, *n;
+
+	if (cs->data) {
+		diaryfs_chunk_sync(sbi);
+		fput(cs->data);
+		cs->data = NULL;
+	}
+	if (cs->index) {
+		fput(cs->index);
+		cs->index = NULL;
+	}
+	list_for_each_entry_safe(c, n, &cs->lru, lru) {
+		list_del(&c->lru);
+		kfree(c);
+	}
+	cs->nr_cached = 0;
+	if (cs->sha) {
+		crypto_free_shash(cs->sha);
+		cs->sha = NULL;
+	}
+	kfree(cs->table);
+	cs->table = NULL;
+	kfree(cs->bucket);
+	cs->bucket = NULL;
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+
+/*
+ * Record payload compression.
+ *
+ * Payloads are compressed one record at a time through the crypto API, so
+ * every record says for itself how it was encoded and a segment can hold
+ * a mix of codecs (or a mount can switch codecs between mounts).  A crypto
+ * transform keeps its scratch memory in its context and can't be shared
+ * between callers, so each codec has a small pool of streams, a transform
+ * plus an output buffer, handed out to the versioning workers and readers.
+ */
+
+struct diaryfs_zpool {
+	const char *name;		/* crypto API algorithm */
+	spinlock_t lock;		/* protects idle and nr */
+	struct list_head idle;
+	unsigned int nr;		/* streams allocated */
+	wait_queue_head_t wait;
+};
+
+static struct diaryfs_zpool diaryfs_zpools[DIARYFS_CODEC_MAX] = {
+	[DIARYFS_CODEC_LZ4]	= { .name = "lz4" },
+	[DIARYFS_CODEC_ZSTD]	= { .name = "zstd" },
+};
+
+const char *diaryfs_codec_name(unsigned int codec)
+{
+	if (codec >= DIARYFS_CODEC_MAX)
+		return NULL;
+	return codec ? diaryfs_zpools[codec].name : "none";
+}
+
+static void diaryfs_zstrm_free(struct diaryfs_zstrm *zstrm)
+{
+	if (!IS_ERR_OR_NULL(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	vfree(zstrm->buf);
+	kfree(zstrm);
+}
+
+static struct diaryfs_zstrm *diaryfs_zstrm_alloc(struct diaryfs_zpool *pool)
+{
+	struct diaryfs_zstrm *zstrm;
+	int err;
+
+	zstrm = kzalloc(sizeof(*zstrm), GFP_NOFS);
+	if (!zstrm)
+		return ERR_PTR(-ENOMEM);
+	zstrm->tfm = crypto_alloc_comp(pool->name, 0, 0);
+	if (IS_ERR(zstrm->tfm)) {
+		err = PTR_ERR(zstrm->tfm);
+		goto out_free;
+	}
+	zstrm->buf = vmalloc(DIARYFS_ZSTRM_BUF);
+	if (!zstrm->buf) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+	return zstrm;
+
+out_free:
+	diaryfs_zstrm_free(zstrm);
+	return ERR_PTR(err);
+}
+
+/*
+ * diaryfs_zstrm_get - borrow a stream for @codec
+ *
+ * Grows the pool up to one stream per online cpu, then waits for one to be
+ * given back.  Fails only if no stream can be created at all.
+ */
+struct diaryfs_zstrm *diaryfs_zstrm_get(unsigned int codec)
+{
+	struct diaryfs_zpool *pool = &diaryfs_zpools[codec];
+	struct diaryfs_zstrm *zstrm;
+
+	for (;;) {
+		spin_lock(&pool->lock);
+		zstrm = list_first_entry_or_null(&pool->idle,
+				struct diaryfs_zstrm, list);
+		if (zstrm) {
+			list_del(&zstrm->list);
+			spin_unlock(&pool->lock);
+			return zstrm;
+		}
+		if (pool->nr < num_online_cpus()) {
+			pool->nr++;
+			spin_unlock(&pool->lock);
+
+			zstrm = diaryfs_zstrm_alloc(pool);
+			if (!IS_ERR(zstrm))
+				return zstrm;
+
+			spin_lock(&pool->lock);
+			pool->nr--;
+			/* only give up if nobody else holds a stream either */
+			if (!pool->nr) {
+				spin_unlock(&pool->lock);
+				return zstrm;
+			}
+		}
+		spin_unlock(&pool->lock);
+		wait_event(pool->wait, !list_empty_careful(&pool->idle));
+	}
+}
+
+void diaryfs_zstrm_put(unsigned int codec, struct diaryfs_zstrm *zstrm)
+{
+	struct diaryfs_zpool *pool = &diaryfs_zpools[codec];
+
+	spin_lock(&pool->lock);
+	list_add(&zstrm->list, &pool->idle);
+	spin_unlock(&pool->lock);
+	wake_up(&pool->wait);
+}
+
+/* make sure @codec can be used, for mount option checking */
+int diaryfs_codec_probe(unsigned int codec)
+{
+	struct diaryfs_zstrm *zstrm;
+
+	if (codec == DIARYFS_CODEC_NONE)
+		return 0;
+	zstrm = diaryfs_zstrm_get(codec);
+	if (IS_ERR(zstrm))
+		return PTR_ERR(zstrm);
+	diaryfs_zstrm_put(codec, zstrm);
+	return 0;
+}
+
+/* log2(x) in quarter bits: ilog2(x^4) */
+static inline unsigned int diaryfs_ilog2_q(u64 x)
+{
+	return ilog2(x * x * x * x);
+}
+
+/*
+ * Is @buf worth handing to the compressor?  Estimates the Shannon entropy
+ * of an evenly spread sample of the bytes and says no when it is close to
+ * 8 bits per byte, which is what already compressed or encrypted data
+ * looks like.
+ */
+static bool diaryfs_comp_worthwhile(const u8 *buf, size_t len)
+{
+	u16 count[256];
+	size_t step = max_t(size_t, len / DIARYFS_COMP_SAMPLES, 1);
+	unsigned int n = 0, lg_n, i;
+	u64 sum = 0;
+	size_t pos;
+
+	memset(count, 0, sizeof(count));
+	for (pos = 0; pos < len && n < DIARYFS_COMP_SAMPLES; pos += step, n++)
+		count[buf[pos]]++;
+
+	lg_n = diaryfs_ilog2_q(n);
+	for (i = 0; i < 256; i++)
+		if (count[i])
+			sum += count[i] * (lg_n - diaryfs_ilog2_q(count[i]));
+
+	/* sum / n is the entropy in quarter bits per byte */
+	return sum < (u64)n * DIARYFS_COMP_MAX_ENTROPY * 4;
+}
+
+/*
+ * diaryfs_compress - compress @len bytes of @src into @zstrm->buf
+ *
+ * Returns the compressed length, or 0 if the data is not worth compressing
+ * or would not get smaller.
+ */
+unsigned int diaryfs_compress(struct diaryfs_zstrm *zstrm, const void *src,
+		unsigned int len)
+{
+	unsigned int dlen = DIARYFS_ZSTRM_BUF;
+
+	if (len < DIARYFS_COMP_MIN || len > DIARYFS_COMP_MAX ||
+	    !diaryfs_comp_worthwhile(src, len))
+		return 0;
+	if (crypto_comp_compress(zstrm->tfm, src, len, zstrm->buf, &dlen))
+		return 0;
+	return dlen < len ? dlen : 0;
+}
+
+/* decompress @slen bytes of @src, which must come out as exactly @dlen */
+int diaryfs_decompress(unsigned int codec, const void *src, unsigned int slen,
+		void *dst, unsigned int dlen)
+{
+	struct diaryfs_zstrm *zstrm;
+	unsigned int len = dlen;
+	int err;
+
+	if (codec == DIARYFS_CODEC_NONE) {
+		if (slen != dlen)
+			return -EUCLEAN;
+		memcpy(dst, src, slen);
+		return 0;
+	}
+	if (codec >= DIARYFS_CODEC_MAX)
+		return -EUCLEAN;
+
+	zstrm = diaryfs_zstrm_get(codec);
+	if (IS_ERR(zstrm))
+		return PTR_ERR(zstrm);
+	err = crypto_comp_decompress(zstrm->tfm, src, slen, dst, &len);
+	diaryfs_zstrm_put(codec, zstrm);
+	if (err)
+		return err;
+	return len == dlen ? 0 : -EUCLEAN;
+}
+
+/*
+ * diaryfs_rec_payload - the decoded payload of @rec
+ *
+ * @rec is a whole record as read from the log.  Writes its raw_len bytes
+ * of payload to @out, decompressing as the record's codec says.
+ */
+int diaryfs_rec_payload(const struct diaryfs_rec *rec, void *out,
+		size_t out_len)
+{
+	unsigned int dlen = le32_to_cpu(rec->raw_len);
+
+	if (dlen > out_len)
+		return -EINVAL;
+	return diaryfs_decompress(rec->codec, rec + 1,
+			le32_to_cpu(rec->payload_len), out, dlen);
+}
+
+void diaryfs_init_codecs(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < DIARYFS_CODEC_MAX; i++) {
+		spin_lock_init(&diaryfs_zpools[i].lock);
+		INIT_LIST_HEAD(&diaryfs_zpools[i].idle);
+		init_waitqueue_head(&diaryfs_zpools[i].wait);
+	}
+}
+
+/* called once no mount is left, so every stream is idle */
+void diaryfs_destroy_codecs(void)
+{
+	struct diaryfs_zstrm *zstrm, *n;
+	unsigned int i;
+
+	for (i = 0; i < DIARYFS_CODEC_MAX; i++) {
+		list_for_each_entry_safe(zstrm, n, &diaryfs_zpools[i].idle,
+				list) {
+			list_del(&zstrm->list);
+			diaryfs_zstrm_free(zstrm);
+		}
+		diaryfs_zpools[i].nr = 0;
+	}
+}
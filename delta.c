@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+
+/*
+ * Shift-aware delta engine.
+ *
+ * A delta describes a target buffer in terms of a base buffer.  Every
+ * DIARYFS_DELTA_BLOCK sized block of the base is indexed by a rolling hash
+ * (the anchors).  The target is then scanned one byte at a time; whenever
+ * the rolling hash of the current window hits an anchor the match is
+ * verified and extended in both directions and emitted as a COPY op.  The
+ * bytes between two matches are emitted as literals: REPLACE when they
+ * overwrite base content in place, INSERT when they shift it.
+ *
+ * Every op carries its target offset, so a delta can be replayed in full or
+ * only over the byte range a reader is interested in.
+ */
+
+#define DIARYFS_DELTA_PRIME	0x01000193U
+
+static inline u32 diaryfs_delta_hash(const u8 *p)
+{
+	u32 h = 0;
+	int i;
+
+	for (i = 0; i < DIARYFS_DELTA_BLOCK; i++)
+		h = h * DIARYFS_DELTA_PRIME + p[i];
+	return h;
+}
+
+/* DIARYFS_DELTA_PRIME ^ (DIARYFS_DELTA_BLOCK - 1), for rolling out a byte */
+static inline u32 diaryfs_delta_outmul(void)
+{
+	u32 m = 1;
+	int i;
+
+	for (i = 0; i < DIARYFS_DELTA_BLOCK - 1; i++)
+		m *= DIARYFS_DELTA_PRIME;
+	return m;
+}
+
+struct diaryfs_delta_out {
+	u8 *buf;
+	size_t len;
+	size_t pos;
+};
+
+static int diaryfs_delta_emit(struct diaryfs_delta_out *out, u8 type,
+		u32 tgt_off, u32 src_off, u32 len, const u8 *lit)
+{
+	struct diaryfs_delta_op op;
+	size_t need = sizeof(op) + (lit ? len : 0);
+
+	if (!len)
+		return 0;
+	if (out->pos + need > out->len)
+		return -E2BIG;
+
+	op.type = type;
+	memset(op.pad, 0, sizeof(op.pad));
+	op.tgt_off = cpu_to_le32(tgt_off);
+	op.src_off = cpu_to_le32(src_off);
+	op.len = cpu_to_le32(len);
+	memcpy(out->buf + out->pos, &op, sizeof(op));
+	out->pos += sizeof(op);
+	if (lit) {
+		memcpy(out->buf + out->pos, lit, len);
+		out->pos += len;
+	}
+	return 0;
+}
+
+/*
+ * Emit the literal run target[start, end).  It is a REPLACE if the base
+ * still has bytes at the same (shifted) position, i.e. the content around
+ * it did not move; otherwise it is an INSERT.
+ */
+static int diaryfs_delta_literal(struct diaryfs_delta_out *out,
+		const u8 *target, size_t start, size_t end,
+		long prev_shift, long next_shift, size_t base_len)
+{
+	long src = (long)start + prev_shift;
+	u8 type = DIARYFS_DELTA_INSERT;
+
+	if (prev_shift == next_shift && src >= 0 &&
+	    src + (long)(end - start) <= (long)base_len)
+		type = DIARYFS_DELTA_REPLACE;
+
+	return diaryfs_delta_emit(out, type, start, src < 0 ? 0 : src,
+			end - start, target + start);
+}
+
+/*
+ * diaryfs_delta_encode - describe @target in terms of @base
+ *
+ * Writes the encoded delta to @out and returns its length.  Returns -E2BIG
+ * if the delta does not fit in @out_len bytes, in which case the caller is
+ * better off storing @target verbatim.
+ */
+ssize_t diaryfs_delta_encode(const u8 *base, size_t base_len,
+		const u8 *target, size_t tgt_len, u8 *out, size_t out_len)
+{
+	struct diaryfs_delta_out o = { .buf = out, .len = out_len };
+	struct diaryfs_delta_hdr hdr;
+	u32 *anchors = NULL;
+	unsigned int bits = 0;
+	size_t pos = 0, lit = 0;
+	long shift = 0;
+	u32 outmul, h = 0;
+	int err;
+
+	if (out_len < sizeof(hdr))
+		return -E2BIG;
+	hdr.magic = cpu_to_le32(DIARYFS_DELTA_MAGIC);
+	hdr.base_len = cpu_to_le32(base_len);
+	hdr.tgt_len = cpu_to_le32(tgt_len);
+	memcpy(out, &hdr, sizeof(hdr));
+	o.pos = sizeof(hdr);
+
+	if (base_len < DIARYFS_DELTA_BLOCK || tgt_len < DIARYFS_DELTA_BLOCK)
+		goto tail;
+
+	/* one anchor per base block, table sized to the next power of two */
+	bits = ilog2(roundup_pow_of_two(base_len / DIARYFS_DELTA_BLOCK));
+	if (bits < 4)
+		bits = 4;
+	anchors = kcalloc(1U << bits, sizeof(*anchors), GFP_NOFS);
+	if (!anchors)
+		return -ENOMEM;
+
+	for (pos = 0; pos + DIARYFS_DELTA_BLOCK <= base_len;
+	     pos += DIARYFS_DELTA_BLOCK) {
+		u32 slot = hash_32(diaryfs_delta_hash(base + pos), bits);
+
+		/* keep the first anchor: 0 means empty, so store offset + 1 */
+		if (!anchors[slot])
+			anchors[slot] = pos + 1;
+	}
+
+	outmul = diaryfs_delta_outmul();
+	pos = 0;
+	h = diaryfs_delta_hash(target);
+	while (pos + DIARYFS_DELTA_BLOCK <= tgt_len) {
+		u32 slot = anchors[hash_32(h, bits)];
+
+		if (slot && !memcmp(base + slot - 1, target + pos,
+				    DIARYFS_DELTA_BLOCK)) {
+			size_t s = slot - 1;
+			size_t n = DIARYFS_DELTA_BLOCK;
+
+			/* extend backwards into the pending literal */
+			while (pos > lit && s > 0 && base[s - 1] == target[pos - 1]) {
+				pos--;
+				s--;
+				n++;
+			}
+			/* and forwards as far as the buffers agree */
+			while (pos + n < tgt_len && s + n < base_len &&
+			       base[s + n] == target[pos + n])
+				n++;
+
+			err = diaryfs_delta_literal(&o, target, lit, pos, shift,
+					(long)s - (long)pos, base_len);
+			if (err)
+				goto out;
+			err = diaryfs_delta_emit(&o, DIARYFS_DELTA_COPY, pos, s,
+					n, NULL);
+			if (err)
+				goto out;
+
+			shift = (long)s - (long)pos;
+			pos += n;
+			lit = pos;
+			if (pos + DIARYFS_DELTA_BLOCK <= tgt_len)
+				h = diaryfs_delta_hash(target + pos);
+			continue;
+		}
+
+		if (pos + DIARYFS_DELTA_BLOCK < tgt_len)
+			h = (h - target[pos] * outmul) * DIARYFS_DELTA_PRIME +
+				target[pos + DIARYFS_DELTA_BLOCK];
+		pos++;
+	}
+
+tail:
+	err = diaryfs_delta_literal(&o, target, lit, tgt_len, shift, shift,
+			base_len);
+out:
+	kfree(anchors);
+	return err ? err : o.pos;
+}
+
+/* length of the buffer a delta reconstructs, or -EINVAL if it is corrupt */
+ssize_t diaryfs_delta_target_len(const u8 *delta, size_t delta_len)
+{
+	struct diaryfs_delta_hdr hdr;
+
+	if (delta_len < sizeof(hdr))
+		return -EINVAL;
+	memcpy(&hdr, delta, sizeof(hdr));
+	if (le32_to_cpu(hdr.magic) != DIARYFS_DELTA_MAGIC)
+		return -EINVAL;
+	return le32_to_cpu(hdr.tgt_len);
+}
+
+/*
+ * diaryfs_delta_apply - replay a delta over part of its target
+ *
+ * Reconstructs target bytes [@off, @off + @len) into @out.  Only the ops
+ * that overlap the requested range are copied; the rest are skipped over.
+ */
+int diaryfs_delta_apply(const u8 *base, size_t base_len,
+		const u8 *delta, size_t delta_len,
+		u8 *out, size_t off, size_t len)
+{
+	struct diaryfs_delta_hdr hdr;
+	size_t pos = sizeof(hdr);
+	size_t end = off + len;
+
+	if (delta_len < sizeof(hdr))
+		return -EINVAL;
+	memcpy(&hdr, delta, sizeof(hdr));
+	if (le32_to_cpu(hdr.magic) != DIARYFS_DELTA_MAGIC ||
+	    le32_to_cpu(hdr.base_len) != base_len ||
+	    end > le32_to_cpu(hdr.tgt_len))
+		return -EINVAL;
+
+	while (pos + sizeof(struct diaryfs_delta_op) <= delta_len) {
+		struct diaryfs_delta_op op;
+		size_t t, s, n, lo, hi;
+
+		memcpy(&op, delta + pos, sizeof(op));
+		pos += sizeof(op);
+		t = le32_to_cpu(op.tgt_off);
+		s = le32_to_cpu(op.src_off);
+		n = le32_to_cpu(op.len);
+
+		if (t + n > le32_to_cpu(hdr.tgt_len))
+			return -EINVAL;
+
+		lo = max(t, off);
+		hi = min(t + n, end);
+
+		switch (op.type) {
+		case DIARYFS_DELTA_COPY:
+			if (s + n > base_len)
+				return -EINVAL;
+			if (lo < hi)
+				memcpy(out + lo - off, base + s + lo - t, hi - lo);
+			break;
+		case DIARYFS_DELTA_INSERT:
+		case DIARYFS_DELTA_REPLACE:
+			if (pos + n > delta_len)
+				return -EINVAL;
+			if (lo < hi)
+				memcpy(out + lo - off, delta + pos + lo - t, hi - lo);
+			pos += n;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return pos == delta_len ? 0 : -EINVAL;
+}
@@ -13,6 +13,28 @@
 
 #include "diaryfs.h"
 
+/*
+ * RCU-walk: no references, no locks.  The dentry, its private data and the
+ * lower dentry are all freed a grace period after they go, so they can be
+ * looked at; anything that looks like it's changing under us is left to
+ * ref-walk.
+ */
+static int diaryfs_d_revalidate_rcu(struct dentry *dentry, unsigned int flags)
+{
+	struct diaryfs_dentry_info *info = READ_ONCE(dentry->d_fsdata);
+	struct dentry *lower_dentry;
+
+	if (!info)
+		return -ECHILD;
+	lower_dentry = READ_ONCE(info->lower_path.dentry);
+	if (!lower_dentry || d_unhashed(lower_dentry))
+		return -ECHILD;
+	if (!(READ_ONCE(lower_dentry->d_flags) & DCACHE_OP_REVALIDATE))
+		return 1;
+	/* the lower file system says -ECHILD itself if it can't */
+	return lower_dentry->d_op->d_revalidate(lower_dentry, flags);
+}
+
 /*
  * returns: -ERRNO if error (returned to user)
  *          0: tell VFS to invalidate dentry
@@ -25,15 +47,12 @@ static int diaryfs_d_revalidate(struct dentry *dentry, unsigned int flags)
 	int err = 1;
 
 	if (flags & LOOKUP_RCU)
-		return -ECHILD;
+		return diaryfs_d_revalidate_rcu(dentry, flags);
 
-	diaryfs_get_lower_path(dentry, &lower_path);
+	diaryfs_peek_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
-	if (!(lower_dentry->d_flags & DCACHE_OP_REVALIDATE))
-		goto out;
-	err = lower_dentry->d_op->d_revalidate(lower_dentry, flags);
-out:
-	diaryfs_put_lower_path(dentry, &lower_path);
+	if (lower_dentry->d_flags & DCACHE_OP_REVALIDATE)
+		err = lower_dentry->d_op->d_revalidate(lower_dentry, flags);
 	return err;
 }
 
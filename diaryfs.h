@@ -31,6 +31,24 @@
 #include <linux/mm.h>
 #include <linux/hash.h>
 #include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/radix-tree.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/highmem.h>
+#include <linux/crc32c.h>
+#include <linux/vmalloc.h>
+#include <linux/mempool.h>
+#include <linux/crypto.h>
+#include <linux/parser.h>
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <crypto/hash.h>
+#include <asm/unaligned.h>
+
+#include "diaryfs_ioctl.h"
 
 // This is for vfs_path_lookup
 extern int vfs_path_lookup(struct dentry * dentry, struct vfsmount *mnt, const char * name, unsigned int flags, struct path *path);
@@ -44,9 +62,32 @@ extern int vfs_path_lookup(struct dentry * dentry, struct vfsmount *mnt, const c
 /* diaryfs magic cookie */
 #define DIARYFS_SUPER_MAGIC	0xdeadbeef
 
+/* hidden directory in the lower root that holds diaryfs's own files */
+#define DIARYFS_META_DIR ".diaryfs"
+#define DIARYFS_JOURNAL_DIR "segments"
+
+/*
+ * Read-only snapshots of the mount live under this name in the root, as
+ * DIARYFS_SNAP_DIR/@<seconds since the epoch>/...
+ */
+#define DIARYFS_SNAP_DIR ".diary"
+#define DIARYFS_SNAP_TOP	(~0ULL)	/* snap_time of DIARYFS_SNAP_DIR */
+
 /* useful for tracking code reachability */
 #define UDBG printk(KERN_DEFAULT "DBG:%s:%s:%d\n", __FILE__, __func__, __LINE__)
 
+/*
+ * Debug output, on the hot paths too: a patched-out branch unless the
+ * debug module parameter (main.c) is set.
+ */
+DECLARE_STATIC_KEY_FALSE(diaryfs_debug_key);
+
+#define diaryfs_debug(fmt, ...)						\
+	do {								\
+		if (static_branch_unlikely(&diaryfs_debug_key))		\
+			printk(KERN_DEBUG "diaryfs: " fmt, ##__VA_ARGS__); \
+	} while (0)
+
 /* operations vectors defined in specific files */
 extern const struct file_operations diaryfs_main_fops;
 extern const struct file_operations diaryfs_dir_fops;
@@ -62,6 +103,8 @@ extern int diaryfs_init_inode_cache(void);
 extern void diaryfs_destroy_inode_cache(void);
 extern int diaryfs_init_dentry_cache(void);
 extern void diaryfs_destroy_dentry_cache(void);
+extern int diaryfs_init_hash_cache(void);
+extern void diaryfs_destroy_hash_cache(void);
 extern int new_dentry_private_data(struct dentry *dentry);
 extern void free_dentry_private_data(struct dentry *dentry);
 extern struct dentry *diaryfs_lookup(struct inode *dir, struct dentry *dentry,
@@ -69,28 +112,731 @@ extern struct dentry *diaryfs_lookup(struct inode *dir, struct dentry *dentry,
 extern struct inode *diaryfs_iget(struct super_block *sb,
 		struct inode *lower_inode);
 extern int diaryfs_interpose(struct dentry *dentry, struct super_block *sb, struct path *lower_path);
+extern int diaryfs_open(struct inode *inode, struct file *file);
+extern int diaryfs_file_release(struct inode *inode, struct file *file);
+
+/*
+ * Delta encoding (see delta.c).  A delta is a diaryfs_delta_hdr followed by
+ * a sequence of ops; INSERT and REPLACE ops are followed by their literal
+ * bytes.  All fields are little-endian.
+ */
+#define DIARYFS_DELTA_MAGIC	0x444c5441	/* "DLTA" */
+#define DIARYFS_DELTA_BLOCK	16	/* anchor granularity in bytes */
+
+enum {
+	DIARYFS_DELTA_COPY = 1,		/* copy len bytes from base at src_off */
+	DIARYFS_DELTA_INSERT,		/* literal bytes that shift the base */
+	DIARYFS_DELTA_REPLACE,		/* literal bytes overwriting the base */
+};
+
+struct diaryfs_delta_hdr {
+	__le32 magic;
+	__le32 base_len;
+	__le32 tgt_len;
+} __packed;
+
+struct diaryfs_delta_op {
+	__u8 type;
+	__u8 pad[3];
+	__le32 tgt_off;
+	__le32 src_off;
+	__le32 len;
+} __packed;
+
+extern ssize_t diaryfs_delta_encode(const u8 *base, size_t base_len,
+		const u8 *target, size_t tgt_len, u8 *out, size_t out_len);
+extern ssize_t diaryfs_delta_target_len(const u8 *delta, size_t delta_len);
+extern int diaryfs_delta_apply(const u8 *base, size_t base_len,
+		const u8 *delta, size_t delta_len,
+		u8 *out, size_t off, size_t len);
+
+/* page-hash index (pagehash.c) */
+struct diaryfs_inode_info;
+extern void diaryfs_hash_init(struct diaryfs_inode_info *info);
+extern void diaryfs_hash_clear(struct inode *inode);
+extern void diaryfs_hash_invalidate(struct inode *inode, loff_t start,
+		loff_t end);
+extern bool diaryfs_hash_unchanged(struct inode *inode, pgoff_t index,
+		unsigned int off, unsigned int len, u32 hash);
+extern void diaryfs_hash_update(struct inode *inode, pgoff_t index,
+		unsigned int off, unsigned int len, u32 hash, u64 seq);
+extern void diaryfs_hash_fill(struct inode *inode, pgoff_t index, u64 seq,
+		const void *page);
+extern void diaryfs_hash_stamp(struct inode *inode);
+extern bool diaryfs_hash_chain(struct inode *inode, pgoff_t index,
+		u32 bytes, u32 *chain, u32 *chain_bytes);
+extern void diaryfs_hash_chain_reset(struct inode *inode, pgoff_t index);
+
+/* one page worth of a write, captured before it reaches the lower file */
+struct diaryfs_vpage {
+	struct list_head list;
+	pgoff_t index;
+	unsigned int off;		/* where the write starts within the page */
+	unsigned int len;		/* and how many bytes it covers */
+	int old_len;			/* valid bytes in @old */
+	u32 hash;			/* of the new bytes */
+	struct page *old;		/* page contents before the write */
+	struct page *new;		/* new bytes, at @off */
+};
+
+/* everything diaryfs_version_begin captured for one write (version.c) */
+struct diaryfs_wver {
+	struct list_head list;		/* on a queue lane */
+	struct inode *inode;
+	u64 seq;			/* write sequence, see diaryfs_sb_info */
+	bool busy;			/* queued, but the write hasn't landed */
+	unsigned int nr_pages;
+	loff_t pos;
+	size_t count;
+	loff_t old_size;		/* file size before the write */
+	struct timespec time;
+	struct list_head pages;
+};
+
+/*
+ * Large writes are captured and versioned in windows of this many pages;
+ * the page pool keeps enough in reserve for a few windows, old and new
+ * copy of every page, so a window can always be captured.
+ */
+#define DIARYFS_WINDOW_PAGES	16
+#define DIARYFS_WINDOW_BYTES	(DIARYFS_WINDOW_PAGES * PAGE_SIZE)
+#define DIARYFS_POOL_PAGES	(4 * 2 * DIARYFS_WINDOW_PAGES)
+
+/* most chunk refs one page of old data can need */
+#define DIARYFS_VERSION_REFS	(PAGE_SIZE / DIARYFS_CHUNK_MIN)
+
+/*
+ * Checkpoints: a page is logged whole once rebuilding it from further back
+ * gets too costly.  Undoing a record is reckoned at DIARYFS_CKPT_REC_COST
+ * bytes plus its payload, and a checkpoint is worth it once the work it
+ * saves comes to DIARYFS_CKPT_SPACE pages (less for files whose history
+ * is read often).  diaryfs_ckpt_chain caps the records between two
+ * checkpoints of a page regardless.
+ */
+#define DIARYFS_CKPT_REC_COST	256
+#define DIARYFS_CKPT_SPACE	8
+
+extern unsigned int diaryfs_ckpt_chain;
+
+extern int diaryfs_version_begin(struct file *file, loff_t pos,
+		struct iov_iter *iter, struct diaryfs_wver **wverp, u64 *seq);
+extern void diaryfs_version_end(struct diaryfs_wver *wver, ssize_t written);
+extern int diaryfs_version_mkwrite(struct inode *inode, struct page *page);
+extern int diaryfs_version_truncate(struct dentry *dentry, loff_t size);
+extern void diaryfs_version_process(struct diaryfs_wver *wver);
+extern void diaryfs_version_free(struct diaryfs_wver *wver);
+
+/* async versioning queue (queue.c) */
+struct diaryfs_sb_info;
+extern unsigned int diaryfs_queue_depth;
+extern int diaryfs_vq_init(struct diaryfs_sb_info *sbi);
+extern void diaryfs_vq_destroy(struct diaryfs_sb_info *sbi);
+extern void diaryfs_vq_queue(struct diaryfs_wver *wver);
+extern void diaryfs_vq_reserve(struct diaryfs_wver *wver);
+extern void diaryfs_vq_ready(struct diaryfs_wver *wver);
+extern int diaryfs_vq_throttle(struct diaryfs_sb_info *sbi);
+extern void diaryfs_vq_flush(struct diaryfs_sb_info *sbi);
+extern int diaryfs_vq_flush_inode(struct inode *inode);
+
+/* version log (log.c) */
+struct diaryfs_rec;
+struct diaryfs_cursor;
+extern int diaryfs_meta_mkdir(const struct path *parent, const char *name,
+		bool create, struct path *path);
+extern struct file *diaryfs_meta_open(const struct path *dir,
+		const char *name, int flags);
+extern int diaryfs_log_open(struct diaryfs_sb_info *sbi,
+		const struct path *lower_root);
+extern void diaryfs_log_close(struct diaryfs_sb_info *sbi);
+extern int diaryfs_log_append(struct diaryfs_sb_info *sbi,
+		struct diaryfs_rec *rec, const void *payload, size_t payload_len,
+		u64 *lsn);
+extern int diaryfs_log_flush(struct diaryfs_sb_info *sbi);
+extern int diaryfs_log_sync(struct diaryfs_sb_info *sbi);
+extern u64 diaryfs_log_lsn(struct diaryfs_sb_info *sbi);
+extern int diaryfs_log_read(struct file *file, loff_t pos, void *buf,
+		size_t len);
+extern int diaryfs_meta_unlink(const struct path *dir, const char *name);
+extern void diaryfs_seg_name(char *name, u64 seq);
+extern struct file *diaryfs_seg_open(struct diaryfs_sb_info *sbi, u64 seq,
+		int flags);
+struct diaryfs_seg;
+extern int diaryfs_seg_write_hdr(struct file *file, struct diaryfs_seg *seg);
+extern int diaryfs_cursor_init(struct diaryfs_cursor *cur, struct file *file,
+		loff_t pos, loff_t end);
+extern struct diaryfs_rec *diaryfs_cursor_next(struct diaryfs_cursor *cur,
+		loff_t *rec_pos);
+extern void diaryfs_cursor_release(struct diaryfs_cursor *cur);
+
+/*
+ * Record payload codecs (compress.c).  The codec a record was written with
+ * is stored in its header; the mount option only picks the one used for
+ * new records.
+ */
+enum {
+	DIARYFS_CODEC_NONE = 0,
+	DIARYFS_CODEC_LZ4,
+	DIARYFS_CODEC_ZSTD,
+	DIARYFS_CODEC_MAX,
+};
+
+#define DIARYFS_COMP_MIN	128	/* smaller payloads are stored as is */
+#define DIARYFS_COMP_MAX	(64 << 10)
+#define DIARYFS_COMP_SAMPLES	2048	/* bytes looked at by the entropy check */
+#define DIARYFS_COMP_MAX_ENTROPY 7	/* bits per byte; above this, don't try */
+#define DIARYFS_ZSTRM_BUF	(2 * DIARYFS_COMP_MAX)
+
+struct diaryfs_zstrm {
+	struct list_head list;		/* on the pool's idle list */
+	struct crypto_comp *tfm;
+	u8 *buf;			/* compressed output */
+};
+
+extern void diaryfs_init_codecs(void);
+extern void diaryfs_destroy_codecs(void);
+extern const char *diaryfs_codec_name(unsigned int codec);
+extern int diaryfs_codec_probe(unsigned int codec);
+extern struct diaryfs_zstrm *diaryfs_zstrm_get(unsigned int codec);
+extern void diaryfs_zstrm_put(unsigned int codec, struct diaryfs_zstrm *zstrm);
+extern unsigned int diaryfs_compress(struct diaryfs_zstrm *zstrm,
+		const void *src, unsigned int len);
+extern int diaryfs_decompress(unsigned int codec, const void *src,
+		unsigned int slen, void *dst, unsigned int dlen);
+extern int diaryfs_rec_payload(const struct diaryfs_rec *rec, void *out,
+		size_t out_len);
+
+/*
+ * Chunk store (chunk.c).  Chunks are cut at content-defined points between
+ * DIARYFS_CHUNK_MIN and DIARYFS_CHUNK_MAX bytes, DIARYFS_CHUNK_MASK picking
+ * an average of about 2KB.
+ */
+#define DIARYFS_CHUNK_DIR	"chunks"
+#define DIARYFS_CHUNK_MAGIC	0x4b484344	/* "DCHK" */
+#define DIARYFS_CHUNK_KEY	32		/* SHA-256 */
+#define DIARYFS_CHUNK_MIN	512
+#define DIARYFS_CHUNK_MAX	8192
+#define DIARYFS_CHUNK_MASK	((1ULL << 11) - 1)
+#define DIARYFS_CHUNK_HASH_BITS	12		/* in-memory index buckets */
+
+/* on-disk chunk: this header, then len bytes of (maybe compressed) data */
+struct diaryfs_chunk_hdr {
+	__le32 magic;
+	__le32 crc;		/* crc32c of the stored data */
+	__le32 len;		/* as stored */
+	__le32 raw_len;		/* once decoded by codec */
+	__u8 codec;
+	__u8 pad[7];
+	__u8 key[DIARYFS_CHUNK_KEY];
+} __packed;
+
+/* a version record's reference to a chunk */
+struct diaryfs_chunk_ref {
+	__le64 loc;		/* of the chunk header in the data file */
+	__le32 len;		/* bytes of old data the chunk holds */
+	__le32 reserved;
+	__u8 key[DIARYFS_CHUNK_KEY];
+} __packed;
+
+/* on-disk index: DIARYFS_CIDX_BUCKETS pages of slots */
+struct diaryfs_cidx_ent {
+	__u8 key[DIARYFS_CHUNK_KEY];
+	__le64 loc;		/* 0 for a never used slot */
+	__le32 len;		/* chunk header and data */
+	__le32 refs;		/* 0 for a freed slot */
+} __packed;
+
+#define DIARYFS_CIDX_BUCKETS	65536
+#define DIARYFS_CIDX_SLOTS	(PAGE_SIZE / sizeof(struct diaryfs_cidx_ent))
+#define DIARYFS_CIDX_PROBE	16	/* buckets tried before giving up */
+
+/* in-memory copy of an index entry */
+struct diaryfs_chunk {
+	struct hlist_node hash;
+	struct list_head lru;
+	u8 key[DIARYFS_CHUNK_KEY];
+	u64 loc;
+	u32 len;
+	u32 refs;
+	loff_t ipos;			/* of the slot in the index file */
+	bool dirty;			/* refs differ from the slot */
+};
+
+struct diaryfs_cstore {
+	struct mutex lock;		/* protects everything below */
+	struct file *data;
+	struct file *index;
+	loff_t tail;			/* where the next chunk goes */
+	struct hlist_head *table;
+	struct list_head lru;
+	unsigned long nr_cached;
+	struct crypto_shash *sha;
+	void *bucket;			/* one index page */
+};
+
+struct diaryfs_sb_info;
+extern unsigned int diaryfs_chunk_cache;
+extern void diaryfs_init_gear(void);
+extern int diaryfs_chunk_open(struct diaryfs_sb_info *sbi);
+extern void diaryfs_chunk_close(struct diaryfs_sb_info *sbi);
+extern int diaryfs_chunk_store(struct diaryfs_sb_info *sbi, const u8 *buf,
+		size_t len, struct diaryfs_chunk_ref *refs, unsigned int max);
+extern void diaryfs_chunk_put(struct diaryfs_sb_info *sbi,
+		const struct diaryfs_chunk_ref *ref);
+extern int diaryfs_chunk_read(struct diaryfs_sb_info *sbi,
+		const struct diaryfs_chunk_ref *ref, void *out);
+extern int diaryfs_chunk_flush(struct diaryfs_sb_info *sbi);
+extern int diaryfs_chunk_sync(struct diaryfs_sb_info *sbi);
+
+/* retention (gc.c) */
+#define DIARYFS_RETENTION_DEFAULT	(5 * 24 * 60 * 60)	/* seconds */
+#define DIARYFS_GC_INTERVAL		(60 * HZ)
+#define DIARYFS_SEG_SPAN_MIN		(60 * NSEC_PER_SEC)
+
+extern int diaryfs_gc_start(struct diaryfs_sb_info *sbi);
+extern void diaryfs_gc_stop(struct diaryfs_sb_info *sbi);
+
+/* point-in-time reads (history.c) */
+#define DIARYFS_HISTORY_MAX	(1 << 20)	/* bytes per read */
+#define DIARYFS_HISTORY_PAGES	((DIARYFS_HISTORY_MAX >> PAGE_SHIFT) + 1)
+
+/* a point in a file's history: a time in ns, or with @seq, a version */
+struct diaryfs_when {
+	u64 time;
+	u64 seq;
+};
+
+static inline bool diaryfs_hist_after(const struct diaryfs_when *when,
+		u64 time, u64 seq)
+{
+	return when->seq ? seq > when->seq : time > when->time;
+}
+
+/* a record a point-in-time read has to undo, and where it applies */
+struct diaryfs_hist_ent {
+	u64 lsn;
+	loff_t off;
+};
+
+/* the records a point-in-time read has to undo */
+struct diaryfs_hist {
+	struct diaryfs_hist_ent *ents;
+	unsigned int nr;
+	unsigned int max;
+	bool sized;		/* @size is the size before the oldest */
+	loff_t size;
+	loff_t lo;		/* start of the window read */
+	const struct diaryfs_when *until;	/* if set, ignore writes after */
+	/* pages of the window with a checkpoint, so nothing newer matters */
+	DECLARE_BITMAP(sealed, DIARYFS_HISTORY_PAGES);
+	/* pages of the window with anything to undo */
+	DECLARE_BITMAP(changed, DIARYFS_HISTORY_PAGES);
+};
+
+static inline bool diaryfs_hist_wanted(const struct diaryfs_hist *hist,
+		u64 time, u64 seq)
+{
+	return !hist->until || !diaryfs_hist_after(hist->until, time, seq);
+}
+
+extern int diaryfs_hist_add(struct diaryfs_hist *hist, u64 lsn, loff_t off,
+		bool ckpt);
+extern void diaryfs_hist_sort_off(struct diaryfs_hist *hist);
+extern unsigned int diaryfs_hist_run(const struct diaryfs_hist *hist,
+		unsigned int i, loff_t *start, loff_t *end);
+extern ssize_t diaryfs_history_read(struct inode *inode,
+		struct file *lower_file, const struct diaryfs_when *when,
+		loff_t off, size_t len, void *buf, loff_t *sizep);
+extern int diaryfs_history_changes(struct inode *inode,
+		const struct diaryfs_when *when, const struct diaryfs_when *until,
+		struct diaryfs_hist *hist);
+extern bool diaryfs_hist_expired(struct diaryfs_sb_info *sbi,
+		const struct diaryfs_when *when);
+
+/* rollback (rollback.c) */
+extern int diaryfs_rollback(struct file *file,
+		const struct diaryfs_when *when);
+
+/* diffs between versions (diff.c) */
+extern int diaryfs_diff(struct file *file, const struct diaryfs_when *from,
+		const struct diaryfs_when *to, struct diaryfs_diff *d);
+
+/* exporting a tree as of some point (export.c) */
+#define DIARYFS_EXPORT_WORKERS	16	/* at most, per export */
+
+extern int diaryfs_export(struct file *file, const struct diaryfs_when *when,
+		struct file *dest, struct diaryfs_export *ex);
+
+/*
+ * Per-file version index (index.c).  Every file with history has an index
+ * file named by its lower inode number under DIARYFS_INDEX_DIR: a header
+ * page, then pages of entries, one per version record, in write order.
+ * Each entry page starts with a summary of the entries in it.  All fields
+ * are little-endian.
+ */
+#define DIARYFS_INDEX_DIR	"index"
+#define DIARYFS_INDEX_BASE	"base"	/* LSN the indexes start at */
+#define DIARYFS_INDEX_MAGIC	0x58444956	/* "VIDX" */
+#define DIARYFS_INDEX_VERSION	2
+
+struct diaryfs_vidx_hdr {
+	__le32 magic;
+	__le32 version;
+	__le64 ino;
+	__le32 generation;
+	__le32 crc;		/* crc32c of the header with crc zeroed */
+	__le64 base;		/* records from here on are all indexed */
+	__le64 since;		/* older records are an earlier file's */
+} __packed;
+
+struct diaryfs_vidx_page {
+	__le32 magic;
+	__le32 nr;		/* entries in use */
+	__le64 max_seq;		/* newest write with an entry here */
+	__le64 max_time;
+	__le64 min_off;		/* file range the entries cover */
+	__le64 max_end;
+	__u8 pad[24];
+} __packed;
+
+struct diaryfs_vidx_ent {
+	__le64 lsn;
+	__le64 seq;
+	__le64 time;
+	__le64 offset;
+	__le64 old_size;
+	__le32 length;
+	__le32 flags;
+} __packed;
+
+#define DIARYFS_VIDX_CKPT	0x1	/* entry is for a checkpoint */
+#define DIARYFS_VIDX_WHOLE	0x2	/* undoing it restores the whole page */
+
+#define DIARYFS_INDEX_ENTS	((PAGE_SIZE - sizeof(struct diaryfs_vidx_page)) / \
+				 sizeof(struct diaryfs_vidx_ent))
+
+/* an index written to since the last sync; holds a reference to it */
+struct diaryfs_vidx_dirty {
+	struct list_head list;
+	struct file *file;
+	struct diaryfs_inode_info *info;	/* NULL once evicted */
+};
+
+extern int diaryfs_index_open(struct diaryfs_sb_info *sbi);
+extern void diaryfs_index_close(struct diaryfs_sb_info *sbi);
+extern void diaryfs_index_release(struct inode *inode);
+extern int diaryfs_index_sync(struct diaryfs_sb_info *sbi);
+extern int diaryfs_index_prune(struct diaryfs_sb_info *sbi, u64 oldest);
+extern void diaryfs_index_append(struct inode *inode,
+		const struct diaryfs_vidx_ent *ents, unsigned int nr);
+extern u64 diaryfs_index_unindexed(struct inode *inode, u64 *since);
+extern ssize_t diaryfs_index_versions(struct inode *inode, void *buf,
+		size_t size);
+extern int diaryfs_index_lookup(struct inode *inode,
+		const struct diaryfs_when *when, u64 limit, loff_t lo, loff_t hi,
+		struct diaryfs_hist *hist);
+
+/* cache of rebuilt historical pages (hcache.c) */
+#define DIARYFS_HCACHE_BITS	10
+
+struct diaryfs_hpage {
+	struct hlist_node hash;
+	struct list_head lru;
+	unsigned long ino;		/* of the lower inode */
+	u32 generation;
+	u64 time;			/* the point in history, as asked for */
+	u64 seq;
+	pgoff_t index;
+	loff_t size;			/* the file had then */
+	struct page *page;
+};
+
+struct diaryfs_hcache {
+	spinlock_t lock;		/* protects everything below */
+	struct hlist_head *table;
+	struct list_head lru;
+	unsigned long nr;
+	u64 hits;
+	u64 misses;
+	struct shrinker shrinker;
+};
+
+extern unsigned int diaryfs_hist_cache;
+extern int diaryfs_init_hpage_cache(void);
+extern void diaryfs_destroy_hpage_cache(void);
+extern int diaryfs_hcache_init(struct diaryfs_sb_info *sbi);
+extern void diaryfs_hcache_destroy(struct diaryfs_sb_info *sbi);
+extern void diaryfs_hcache_clear(struct diaryfs_sb_info *sbi);
+extern bool diaryfs_hcache_get(struct diaryfs_sb_info *sbi,
+		struct inode *lower_inode, const struct diaryfs_when *when,
+		pgoff_t index, void *buf, unsigned int from, unsigned int len,
+		loff_t *sizep);
+extern void diaryfs_hcache_put(struct diaryfs_sb_info *sbi,
+		struct inode *lower_inode, const struct diaryfs_when *when,
+		pgoff_t index, const void *data, loff_t size);
+
+/*
+ * Per-mount statistics (stats.c), counted per CPU and summed when read
+ * through /sys/fs/diaryfs/<major>:<minor>/.
+ */
+enum {
+	DIARYFS_STAT_WRITTEN,		/* bytes written through the mount */
+	DIARYFS_STAT_VERSIONED,		/* of those, bytes that changed */
+	DIARYFS_STAT_LOGGED,		/* bytes of records appended */
+	DIARYFS_STAT_HASH_HITS,		/* writes the page hashes proved */
+	DIARYFS_STAT_HASH_MISSES,
+	DIARYFS_NR_STATS,
+};
+
+enum {
+	DIARYFS_LAT_READ,
+	DIARYFS_LAT_WRITE,
+	DIARYFS_LAT_APPEND,
+	DIARYFS_NR_LATS,
+};
+
+/* latency buckets: bucket n counts operations of [2^n, 2^(n+1)) ns */
+#define DIARYFS_LAT_BUCKETS	32
+
+struct diaryfs_stats {
+	u64 count[DIARYFS_NR_STATS];
+	u64 lat[DIARYFS_NR_LATS][DIARYFS_LAT_BUCKETS];
+};
+
+extern int diaryfs_init_sysfs(void);
+extern void diaryfs_destroy_sysfs(void);
+extern int diaryfs_stats_init(struct diaryfs_sb_info *sbi);
+extern void diaryfs_stats_destroy(struct diaryfs_sb_info *sbi);
+extern int diaryfs_sysfs_register(struct super_block *sb);
+extern void diaryfs_sysfs_unregister(struct super_block *sb);
+
+/* snapshot namespace (snapshot.c) */
+extern int diaryfs_snap_lookup_top(struct dentry *dentry,
+		struct path *lower_parent_path);
 
 /* file private data */
 struct diaryfs_file_info {
 	struct file * lower_file;
-//	struct file * log_file;
 	const struct vm_operations_struct * lower_vm_ops;
 };
 
+/* page-hash index entry, one per page we have seen written (pagehash.c) */
+struct diaryfs_page_hash {
+	pgoff_t index;
+	u64 seq;		/* write that last touched the page */
+	unsigned int flags;
+	u32 page_hash;		/* whole page, valid with DIARYFS_PH_FULL */
+	u32 sub_hash;		/* last range written, valid with DIARYFS_PH_SUB */
+	unsigned int sub_off;
+	unsigned int sub_len;
+	u32 chain;		/* records logged since the last checkpoint */
+	u32 chain_bytes;	/* and their payload */
+};
+
+#define DIARYFS_PH_FULL		0x1
+#define DIARYFS_PH_SUB		0x2
+
+/* cap on index entries per inode, so a huge file can't pin much memory */
+#define DIARYFS_HASH_MAX_PAGES	16384
+
 /* diaryfs inode data in memory */
 struct diaryfs_inode_info {
 	struct inode *lower_inode;
+
+	spinlock_t hash_lock;		/* protects the page-hash index */
+	struct radix_tree_root page_hashes;
+	unsigned long nr_hashes;
+	struct timespec hash_mtime;	/* lower mtime the index is valid for */
+	loff_t hash_size;		/* lower size the index is valid for */
+
+	struct mutex vlock;		/* numbers captures in write order */
+	atomic_t vq_pending;		/* captures queued, not yet versioned */
+	wait_queue_head_t vq_wait;	/* woken as they are */
+	u64 snap_time;			/* ns the snapshot shows, 0 if live */
+	struct file *vindex;		/* version index, once opened */
+	struct diaryfs_vidx_dirty *vdirty; /* if it needs syncing */
+	atomic_t hist_reads;		/* point-in-time reads rebuilt */
+
 	struct inode vfs_inode;
 };
 
 /* diaryfs dentry data in memory */
 struct diaryfs_dentry_info {
-	spinlock_t lock; /* protects lower path */
+	spinlock_t lock; /* serialises changes to lower path */
+	seqcount_t seq; /* lets readers see lower path whole, locklessly */
 	struct path lower_path;
+	struct rcu_head rcu; /* RCU-walk may still be looking at us */
+};
+
+/*
+ * On-disk version record (log.c).  All fields are little-endian.  The
+ * record describes what the byte range [offset, offset + length) of lower
+ * inode @ino held before write @seq, and the size the file had then; a
+ * checkpoint instead holds the whole page as write @seq left it.  It is
+ * followed by payload_len bytes of payload and padded to 8 bytes; crc is a
+ * crc32c over the header (with crc zeroed) and the payload.
+ */
+#define DIARYFS_REC_MAGIC	0x59524944	/* "DIRY" */
+
+enum {
+	DIARYFS_REC_PAD = 1,	/* filler up to the end of a batch */
+	DIARYFS_REC_DATA,	/* payload is the old bytes, clipped to old_size */
+	DIARYFS_REC_DELTA,	/* payload is a delta from the new bytes to them */
+	DIARYFS_REC_CHUNKS,	/* payload is diaryfs_chunk_refs to the old bytes */
+	DIARYFS_REC_CKPT,	/* payload is the page, clipped to the file */
+};
+
+struct diaryfs_rec {
+	__le32 magic;
+	__le16 type;
+	__u8 codec;		/* payload encoding, 0 for none */
+	__u8 flags;
+	__le32 rec_len;		/* header, payload and padding */
+	__le32 crc;
+	__le64 ino;
+	__le64 seq;
+	__le64 time;		/* ns since the epoch */
+	__le64 offset;
+	__le32 length;
+	__le32 payload_len;	/* as stored */
+	__le32 raw_len;		/* once decoded by codec */
+	__le32 reserved;
+	__le64 old_size;
+} __packed;
+
+/* records are packed into batches of this many pages before hitting disk */
+#define DIARYFS_LOG_BATCH_PAGES	16
+
+/*
+ * The journal is split into segment files of DIARYFS_SEG_SIZE bytes, named
+ * by their sequence number in hex.  The first page of a segment holds a
+ * diaryfs_seg_hdr; records follow from the second page on.  A record is
+ * addressed by its LSN: segment sequence number and offset within it.
+ */
+#define DIARYFS_SEG_MAGIC	0x47455344	/* "DSEG" */
+#define DIARYFS_SEG_VERSION	1
+#define DIARYFS_SEG_SIZE	(16 << 20)
+#define DIARYFS_SEG_NAME_LEN	17		/* 16 hex digits and a NUL */
+#define DIARYFS_SEG_SEALED	0x1		/* full, no more appends */
+#define DIARYFS_SEG_CHUNKS	0x2		/* holds chunk references */
+
+#define DIARYFS_LSN(seq, off)	(((u64)(seq) << 32) | (u32)(off))
+#define DIARYFS_LSN_SEQ(lsn)	((lsn) >> 32)
+#define DIARYFS_LSN_OFF(lsn)	((u32)(lsn))
+
+struct diaryfs_seg_hdr {
+	__le32 magic;
+	__le32 version;
+	__le64 seq;
+	__le64 created;		/* ns since the epoch */
+	__le64 min_time;	/* time range of the records inside */
+	__le64 max_time;
+	__le64 max_seq;		/* newest write with records inside */
+	__le64 size;		/* bytes in use, header page included */
+	__le64 start;		/* first live record; less is expired */
+	__le32 flags;
+	__le32 crc;		/* crc32c of the header with crc zeroed */
+} __packed;
+
+/* in-memory summary of one segment, kept for every segment of the mount */
+struct diaryfs_seg {
+	struct list_head list;		/* on diaryfs_log.segs, oldest first */
+	u64 seq;
+	u64 created;
+	u64 min_time;
+	u64 max_time;
+	u64 max_seq;
+	loff_t size;
+	loff_t start;
+	unsigned int flags;
+};
+
+struct diaryfs_log {
+	struct mutex lock;		/* serializes appends and flushes */
+	struct path dir;		/* lower DIARYFS_JOURNAL_DIR */
+	struct file *file;		/* the active segment */
+	struct diaryfs_seg *active;
+	loff_t tail;			/* where the next batch goes */
+	size_t used;			/* bytes filled in the batch */
+	struct page *batch[DIARYFS_LOG_BATCH_PAGES];
+	int err;			/* why appends stopped, if they did */
+
+	spinlock_t seg_lock;		/* protects segs and their summaries */
+	struct list_head segs;
+};
+
+/* sequential reader over the records of a segment (log.c) */
+#define DIARYFS_CURSOR_BUF	(2 * DIARYFS_LOG_BATCH_PAGES * PAGE_SIZE)
+
+struct diaryfs_cursor {
+	struct file *file;
+	loff_t pos;			/* next record */
+	loff_t end;
+	char *buf;
+	loff_t buf_pos;			/* file offset of buf */
+	size_t buf_len;
 };
 
+/* one ordered stream of captured writes waiting to be versioned (queue.c) */
+struct diaryfs_lane {
+	spinlock_t lock;		/* protects queue */
+	struct list_head queue;
+	struct work_struct work;
+	struct diaryfs_sb_info *sbi;
+};
+
+#define DIARYFS_MAX_LANES	16
+
 struct diaryfs_sb_info {
 	struct super_block *lower_sb;
+
+	/* async versioning queue */
+	struct workqueue_struct *vq_wq;
+	struct diaryfs_lane *lanes;
+	unsigned int nr_lanes;
+	atomic_t vq_depth;		/* captured pages not yet versioned */
+	wait_queue_head_t vq_wait;
+	mempool_t *page_pool;		/* capture and scratch pages */
+
+	/*
+	 * Writes are numbered across the mount, and across remounts: the
+	 * count resumes from the newest record in the journal.  A file's
+	 * version N is its contents right after write N.
+	 */
+	atomic64_t wseq;
+
+	struct path meta_path;		/* lower DIARYFS_META_DIR */
+	struct diaryfs_log log;
+	struct diaryfs_cstore chunks;
+	struct path index_dir;		/* lower DIARYFS_INDEX_DIR */
+	u64 index_base;			/* LSN indexing started at */
+	spinlock_t index_lock;		/* protects index_dirty, ->vdirty */
+	struct list_head index_dirty;	/* indexes to sync */
+	struct diaryfs_hcache hcache;
+
+	struct task_struct *gc_task;
+
+	struct diaryfs_stats __percpu *stats;
+	struct kobject kobj;		/* /sys/fs/diaryfs/<dev> */
+	struct completion kobj_unregister;
+
+	/*
+	 * Mounted read-only, or over something read-only: the metadata is
+	 * only opened for reading, if it is there at all, and stays that way
+	 * until unmount.
+	 */
+	bool read_only;
+
+	/* mount options */
+	unsigned int codec;		/* for new records */
+	u64 retention;			/* seconds of history, 0 for all */
+	u64 seg_span;			/* ns of history per segment */
+};
+
+/* what diaryfs_mount hands to diaryfs_read_super */
+struct diaryfs_mount_data {
+	const char *dev_name;
+	char *options;			/* parsed in place */
+	char *options_orig;		/* for show_options */
 };
 
 /* 
@@ -111,6 +857,22 @@ static inline struct diaryfs_inode_info *DIARYFS_I(const struct inode *inode)
 /* superblock to private data */
 #define DIARYFS_SB(super) ((struct diaryfs_sb_info*)(super)->s_fs_info)
 
+static inline void diaryfs_stat_add(struct diaryfs_sb_info *sbi, int stat,
+		u64 n)
+{
+	this_cpu_add(sbi->stats->count[stat], n);
+}
+
+/* count an operation of type @lat that started at @start ns */
+static inline void diaryfs_stat_lat(struct diaryfs_sb_info *sbi, int lat,
+		u64 start)
+{
+	u64 ns = ktime_get_ns() - start;
+
+	this_cpu_inc(sbi->stats->lat[lat][min_t(int, ilog2(ns | 1),
+			DIARYFS_LAT_BUCKETS - 1)]);
+}
+
 /* file to private data */
 #define DIARYFS_F(file) ((struct diaryfs_file_info*)((file)->private_data))
 
@@ -149,33 +911,31 @@ static inline void pathcpy(struct path *dst, const struct path *src) {
 	dst->mnt = src->mnt;
 }
 
+/*
+ * The lower path of @dent, without taking references: it stays valid for
+ * as long as the caller holds @dent, since it is only ever set before
+ * the dentry is in use and dropped once nobody holds it any more.
+ */
+static inline void diaryfs_peek_lower_path(const struct dentry *dent,
+		struct path *lower_path) {
+	struct diaryfs_dentry_info *info = DIARYFS_D(dent);
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&info->seq);
+		pathcpy(lower_path, &info->lower_path);
+	} while (read_seqcount_retry(&info->seq, seq));
+}
+
 /* Returns struct path. Caller must path_put it */
 static inline void diaryfs_get_lower_path(const struct dentry *dent,
 		struct path *lower_path) {
-	spin_lock(&DIARYFS_D(dent)->lock);
-	pathcpy(lower_path, &DIARYFS_D(dent)->lower_path);
+	diaryfs_peek_lower_path(dent, lower_path);
 	path_get(lower_path);
-	spin_unlock(&DIARYFS_D(dent)->lock);
 	return;
 }
 
 
-/* Returns struct path based on the lower_path of file. 
- * Caller must path_put it */
-static inline void diaryfs_get_log_path(const struct path *lower_path,
-		struct path *log_path) {
-	char new_name[256];
-	log_path = kzalloc(sizeof(struct path), GFP_KERNEL);
-	memcpy(log_path, lower_path, sizeof(struct path)); // copy all attrs of lower_path
-	dentry_path_raw(lower_path->dentry, new_name, 128);
-	new_name[129] = '.';
-	new_name[130] = 'l';
-	new_name[131] = 'o';
-	new_name[132] = 'g';
-	memcpy(log_path->dentry->d_iname, new_name, 256);
-	return;
-}
-
 static inline void diaryfs_put_lower_path(const struct dentry *dent,
 			struct path *lower_path) {
 	path_put(lower_path);
@@ -185,15 +945,19 @@ static inline void diaryfs_put_lower_path(const struct dentry *dent,
 static inline void diaryfs_set_lower_path(const struct dentry *dent,
 			struct path *lower_path) {
 	spin_lock(&DIARYFS_D(dent)->lock);
+	write_seqcount_begin(&DIARYFS_D(dent)->seq);
 	pathcpy(&DIARYFS_D(dent)->lower_path, lower_path);
+	write_seqcount_end(&DIARYFS_D(dent)->seq);
 	spin_unlock(&DIARYFS_D(dent)->lock);
 	return;
 }
 
 static inline void diaryfs_reset_lower_path(const struct dentry *dent) {
 	spin_lock(&DIARYFS_D(dent)->lock);
+	write_seqcount_begin(&DIARYFS_D(dent)->seq);
 	DIARYFS_D(dent)->lower_path.dentry = NULL;
 	DIARYFS_D(dent)->lower_path.mnt = NULL;
+	write_seqcount_end(&DIARYFS_D(dent)->seq);
 	spin_unlock(&DIARYFS_D(dent)->lock);
 	return;
 }
@@ -201,15 +965,37 @@ static inline void diaryfs_reset_lower_path(const struct dentry *dent) {
 static inline void diaryfs_put_reset_lower_path(const struct dentry *dent) {
 	struct path lower_path;
 	spin_lock(&DIARYFS_D(dent)->lock);
+	write_seqcount_begin(&DIARYFS_D(dent)->seq);
 	pathcpy(&lower_path, &DIARYFS_D(dent)->lower_path);
 	DIARYFS_D(dent)->lower_path.dentry = NULL;
 	DIARYFS_D(dent)->lower_path.mnt = NULL;
+	write_seqcount_end(&DIARYFS_D(dent)->seq);
 	spin_unlock(&DIARYFS_D(dent)->lock);
 	path_put(&lower_path);
 	return;
 }
 
 
+/* is @name in directory @parent diaryfs's own hidden directory? */
+static inline bool diaryfs_is_meta_name(const struct dentry *parent,
+		const char *name, int len) {
+	return IS_ROOT(parent) && len == sizeof(DIARYFS_META_DIR) - 1 &&
+		!memcmp(name, DIARYFS_META_DIR, len);
+}
+
+/* is @name in directory @parent the snapshot namespace? */
+static inline bool diaryfs_is_snap_name(const struct dentry *parent,
+		const char *name, int len) {
+	return IS_ROOT(parent) && len == sizeof(DIARYFS_SNAP_DIR) - 1 &&
+		!memcmp(name, DIARYFS_SNAP_DIR, len);
+}
+
+/* is @lower_dentry the root of the lower file system we're stacked on? */
+static inline bool diaryfs_is_lower_root(const struct super_block *sb,
+		const struct dentry *lower_dentry) {
+	return lower_dentry == DIARYFS_D(sb->s_root)->lower_path.dentry;
+}
+
 /* locking helpers */
 static inline struct dentry *lock_parent (struct dentry *dentry) {
 	struct dentry *dir = dget_parent(dentry);
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ */
+
+#ifndef __DIARYFS_IOCTL_H_
+#define __DIARYFS_IOCTL_H_
+
+/*
+ * The diaryfs ioctl interface, shared with userspace tools.  All structures
+ * have the same layout for 32 and 64 bit callers.
+ *
+ * A point in a file's history is given as a time, in ns since the epoch
+ * (the file as it was then), or with DIARYFS_AT_VERSION as a write number
+ * (the file as it was right after that write).
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define DIARYFS_IOC_MAGIC	0xdf
+
+#define DIARYFS_AT_VERSION	0x1	/* @when is a version, not a time */
+
+/* read @len bytes at @offset of the file as of @when into @buf */
+struct diaryfs_read_at {
+	__u64 when;
+	__u64 offset;
+	__u64 buf;		/* user pointer */
+	__u64 len;
+	__u32 flags;
+	__u32 pad;
+	__u64 size;		/* out: file size as of @when */
+};
+
+#define DIARYFS_IOC_READ_AT	_IOWR(DIARYFS_IOC_MAGIC, 1, struct diaryfs_read_at)
+
+/* roll the file, open for reading and writing, back to how it was at @when */
+struct diaryfs_rollback {
+	__u64 when;
+	__u32 flags;
+	__u32 pad;
+};
+
+#define DIARYFS_IOC_ROLLBACK	_IOW(DIARYFS_IOC_MAGIC, 2, struct diaryfs_rollback)
+
+/* a byte range of a file */
+struct diaryfs_extent {
+	__u64 offset;
+	__u64 len;
+};
+
+#define DIARYFS_DIFF_DATA	0x2	/* also return the bytes as of @to */
+
+/*
+ * List the extents that differ between the file as of @from and as of @to
+ * (both times, or with DIARYFS_AT_VERSION both versions), in file order,
+ * starting at @offset.  With DIARYFS_DIFF_DATA, @buf is filled with the
+ * bytes of those extents as of @to, back to back; there are none for the
+ * part of an extent past @to_size.  When @extents or @buf fill up, @offset
+ * is set to where the next call should go on; otherwise to the larger of
+ * the two sizes.
+ */
+struct diaryfs_diff {
+	__u64 from;
+	__u64 to;
+	__u32 flags;
+	__u32 nr;		/* in: room in @extents, out: extents filled */
+	__u64 extents;		/* user pointer to struct diaryfs_extent */
+	__u64 buf;		/* user pointer */
+	__u64 buf_len;		/* in: room in @buf, out: bytes filled */
+	__u64 offset;
+	__u64 from_size;	/* out */
+	__u64 to_size;		/* out */
+};
+
+#define DIARYFS_IOC_DIFF	_IOWR(DIARYFS_IOC_MAGIC, 3, struct diaryfs_diff)
+
+/*
+ * Copy the directory, and everything below it, into the directory open as
+ * @dest_fd, with file contents as of @when; names and symlinks are the
+ * current ones.  @workers files are filled in at once, or with 0 one per
+ * CPU.  The rest is filled in with what was copied; devices, fifos and
+ * sockets are skipped.
+ */
+struct diaryfs_export {
+	__u64 when;
+	__u32 flags;
+	__s32 dest_fd;
+	__u32 workers;
+	__u32 pad;
+	__u64 files;		/* out */
+	__u64 dirs;		/* out */
+	__u64 symlinks;		/* out */
+	__u64 skipped;		/* out */
+	__u64 bytes;		/* out */
+};
+
+#define DIARYFS_IOC_EXPORT	_IOWR(DIARYFS_IOC_MAGIC, 4, struct diaryfs_export)
+
+/*
+ * Reading this xattr of a regular file lists its versions, oldest first,
+ * as an array of struct diaryfs_version: as many of the newest as fit in
+ * an xattr value.  The name is reserved; it can't be set or removed.
+ */
+#define DIARYFS_XATTR_VERSIONS	"user.diaryfs.versions"
+
+struct diaryfs_version {
+	__u64 version;		/* the write that made it */
+	__u64 time;		/* of the write, ns since the epoch */
+	__u64 bytes;		/* changed by the write */
+};
+
+#endif	/* not __DIARYFS_IOCTL_H_ */
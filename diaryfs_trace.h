@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ */
+
+/*
+ * Tracepoints, under events/diaryfs/ in tracefs.  They cost a patched-out
+ * branch while disabled.  Latencies are in ns; those the statistics in
+ * stats.c don't need anyway are only measured while the event is enabled.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM diaryfs
+
+#if !defined(_DIARYFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DIARYFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* start timing an event, if anyone is looking */
+#define diaryfs_trace_start(event) \
+	(trace_##event##_enabled() ? ktime_get_ns() : 0)
+
+DECLARE_EVENT_CLASS(diaryfs_rw,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret,
+		 u64 start),
+	TP_ARGS(inode, pos, len, ret, start),
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(loff_t,		pos)
+		__field(size_t,		len)
+		__field(ssize_t,	ret)
+		__field(u64,		ns)
+	),
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->pos	= pos;
+		__entry->len	= len;
+		__entry->ret	= ret;
+		__entry->ns	= ktime_get_ns() - start;
+	),
+	TP_printk("dev %d,%d ino %lu pos %lld len %zu ret %zd ns %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->pos, __entry->len, __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(diaryfs_rw, diaryfs_read,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret,
+		 u64 start),
+	TP_ARGS(inode, pos, len, ret, start)
+);
+
+DEFINE_EVENT(diaryfs_rw, diaryfs_write,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret,
+		 u64 start),
+	TP_ARGS(inode, pos, len, ret, start)
+);
+
+/* a point-in-time read */
+TRACE_EVENT(diaryfs_history_read,
+	TP_PROTO(struct inode *inode, const struct diaryfs_when *when,
+		 loff_t pos, size_t len, unsigned int nr_recs, ssize_t ret,
+		 u64 start),
+	TP_ARGS(inode, when, pos, len, nr_recs, ret, start),
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(u64,		time)
+		__field(u64,		seq)
+		__field(loff_t,		pos)
+		__field(size_t,		len)
+		__field(unsigned int,	nr_recs)
+		__field(ssize_t,	ret)
+		__field(u64,		ns)
+	),
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->time	= when->time;
+		__entry->seq	= when->seq;
+		__entry->pos	= pos;
+		__entry->len	= len;
+		__entry->nr_recs = nr_recs;
+		__entry->ret	= ret;
+		__entry->ns	= ktime_get_ns() - start;
+	),
+	TP_printk("dev %d,%d ino %lu time %llu seq %llu pos %lld len %zu "
+		  "records %u ret %zd ns %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->time, __entry->seq, __entry->pos, __entry->len,
+		  __entry->nr_recs, __entry->ret, __entry->ns)
+);
+
+/* a captured page diffed into a version record */
+TRACE_EVENT(diaryfs_diff,
+	TP_PROTO(struct inode *inode, u64 seq, pgoff_t index,
+		 unsigned int off, unsigned int len, int type, u32 bytes,
+		 u64 start),
+	TP_ARGS(inode, seq, index, off, len, type, bytes, start),
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(u64,		seq)
+		__field(pgoff_t,	index)
+		__field(unsigned int,	off)
+		__field(unsigned int,	len)
+		__field(int,		type)
+		__field(u32,		bytes)
+		__field(u64,		ns)
+	),
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->seq	= seq;
+		__entry->index	= index;
+		__entry->off	= off;
+		__entry->len	= len;
+		__entry->type	= type;
+		__entry->bytes	= bytes;
+		__entry->ns	= ktime_get_ns() - start;
+	),
+	TP_printk("dev %d,%d ino %lu seq %llu page %lu off %u len %u "
+		  "type %s bytes %u ns %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->seq, __entry->index, __entry->off, __entry->len,
+		  __print_symbolic(__entry->type,
+			{ 0,			"none" },
+			{ DIARYFS_REC_DATA,	"data" },
+			{ DIARYFS_REC_DELTA,	"delta" },
+			{ DIARYFS_REC_CHUNKS,	"chunks" }),
+		  __entry->bytes, __entry->ns)
+);
+
+/* a write checked against the page hashes */
+TRACE_EVENT(diaryfs_hash,
+	TP_PROTO(struct inode *inode, pgoff_t index, unsigned int off,
+		 unsigned int len, bool unchanged),
+	TP_ARGS(inode, index, off, len, unchanged),
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(pgoff_t,	index)
+		__field(unsigned int,	off)
+		__field(unsigned int,	len)
+		__field(bool,		unchanged)
+	),
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->index	= index;
+		__entry->off	= off;
+		__entry->len	= len;
+		__entry->unchanged = unchanged;
+	),
+	TP_printk("dev %d,%d ino %lu page %lu off %u len %u %s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->index, __entry->off, __entry->len,
+		  __entry->unchanged ? "unchanged" : "changed")
+);
+
+/* a record appended to the version log of the mount over @lower_sb */
+TRACE_EVENT(diaryfs_log_append,
+	TP_PROTO(struct super_block *lower_sb, const struct diaryfs_rec *rec,
+		 u64 lsn, int err, u64 start),
+	TP_ARGS(lower_sb, rec, lsn, err, start),
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(u64,		ino)
+		__field(u64,		seq)
+		__field(u16,		type)
+		__field(u8,		codec)
+		__field(u32,		raw_len)
+		__field(u32,		rec_len)
+		__field(u64,		lsn)
+		__field(int,		err)
+		__field(u64,		ns)
+	),
+	TP_fast_assign(
+		__entry->dev	= lower_sb->s_dev;
+		__entry->ino	= le64_to_cpu(rec->ino);
+		__entry->seq	= le64_to_cpu(rec->seq);
+		__entry->type	= le16_to_cpu(rec->type);
+		__entry->codec	= rec->codec;
+		__entry->raw_len = le32_to_cpu(rec->raw_len);
+		__entry->rec_len = le32_to_cpu(rec->rec_len);
+		__entry->lsn	= lsn;
+		__entry->err	= err;
+		__entry->ns	= ktime_get_ns() - start;
+	),
+	TP_printk("lower dev %d,%d ino %llu seq %llu type %u codec %u "
+		  "raw %u len %u lsn %llu:%llu err %d ns %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->seq, __entry->type, __entry->codec,
+		  __entry->raw_len, __entry->rec_len,
+		  DIARYFS_LSN_SEQ(__entry->lsn), DIARYFS_LSN_OFF(__entry->lsn),
+		  __entry->err, __entry->ns)
+);
+
+TRACE_EVENT(diaryfs_lookup,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, int err, u64 start),
+	TP_ARGS(dir, dentry, err, start),
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	dir)
+		__string(name,		dentry->d_name.name)
+		__field(unsigned long,	ino)
+		__field(int,		err)
+		__field(u64,		ns)
+	),
+	TP_fast_assign(
+		__entry->dev	= dir->i_sb->s_dev;
+		__entry->dir	= dir->i_ino;
+		__assign_str(name, dentry->d_name.name);
+		__entry->ino	= d_really_is_positive(dentry) ?
+				  d_inode(dentry)->i_ino : 0;
+		__entry->err	= err;
+		__entry->ns	= ktime_get_ns() - start;
+	),
+	TP_printk("dev %d,%d dir %lu name %s ino %lu err %d ns %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->ino, __entry->err, __entry->ns)
+);
+
+#endif /* _DIARYFS_TRACE_H */
+
+/* built out of tree, so tell define_trace.h where we are */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE diaryfs_trace
+#include <trace/define_trace.h>
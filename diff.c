@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+
+/*
+ * Diffs between two versions of a file.
+ *
+ * Between two points in a file's history only the pages written in
+ * between can differ, and the version records say which those are.  Only
+ * they are rebuilt, as of both points, and compared; the cost goes with
+ * the size of the change, not of the file.  Past the smaller of the two
+ * sizes everything counts as changed and nothing needs comparing.
+ */
+
+struct diaryfs_diff_ctx {
+	struct diaryfs_diff *d;
+	struct diaryfs_extent cur;	/* being built, not yet handed out */
+	u32 nr;				/* extents handed out */
+	u64 data_len;			/* bytes handed out */
+};
+
+/* hand out the extent being built, if any */
+static int diaryfs_diff_flush(struct diaryfs_diff_ctx *dc)
+{
+	struct diaryfs_extent __user *ext =
+		(void __user *)(unsigned long)dc->d->extents;
+
+	if (!dc->cur.len)
+		return 0;
+	if (copy_to_user(&ext[dc->nr], &dc->cur, sizeof(dc->cur)))
+		return -EFAULT;
+	dc->nr++;
+	dc->cur.len = 0;
+	return 0;
+}
+
+/*
+ * Add [@off, @off + @len) to the diff, @data being its bytes as of the
+ * "to" point.  Returns 1, with d->offset set to where to go on, once
+ * there is no more room.
+ */
+static int diaryfs_diff_add(struct diaryfs_diff_ctx *dc, loff_t off,
+		loff_t len, const u8 *data)
+{
+	struct diaryfs_diff *d = dc->d;
+	u8 __user *buf = (void __user *)(unsigned long)d->buf;
+	loff_t dlen, room, want = len;
+	int err;
+
+	if (!dc->cur.len || dc->cur.offset + dc->cur.len != off) {
+		err = diaryfs_diff_flush(dc);
+		if (err)
+			return err;
+		if (dc->nr == d->nr) {
+			d->offset = off;
+			return 1;
+		}
+		dc->cur.offset = off;
+	}
+
+	if (d->flags & DIARYFS_DIFF_DATA) {
+		dlen = clamp_t(loff_t, (loff_t)d->to_size - off, 0, len);
+		room = d->buf_len - dc->data_len;
+		/* as much as fits, the rest next time */
+		if (dlen > room)
+			len = dlen = room;
+		if (dlen && copy_to_user(buf + dc->data_len, data, dlen))
+			return -EFAULT;
+		dc->data_len += dlen;
+	}
+	dc->cur.len += len;
+	if (len < want) {
+		d->offset = off + len;
+		return 1;
+	}
+	return 0;
+}
+
+/* add the bytes that differ between @a and @b, @n bytes of file at @off */
+static int diaryfs_diff_cmp(struct diaryfs_diff_ctx *dc, loff_t off,
+		const u8 *a, const u8 *b, size_t n)
+{
+	size_t i = 0, j;
+	int ret;
+
+	while (i < n) {
+		if (!(i & ~PAGE_MASK) && n - i >= PAGE_SIZE &&
+		    !memcmp(a + i, b + i, PAGE_SIZE)) {
+			i += PAGE_SIZE;
+			continue;
+		}
+		if (a[i] == b[i]) {
+			i++;
+			continue;
+		}
+		for (j = i + 1; j < n && a[j] != b[j]; j++)
+			;
+		ret = diaryfs_diff_add(dc, off + i, j - i, b + i);
+		if (ret)
+			return ret;
+		i = j;
+	}
+	return 0;
+}
+
+/*
+ * diaryfs_diff - the DIARYFS_IOC_DIFF of @file
+ *
+ * @from and @to have been parsed out of @d, which is filled in as the
+ * ioctl describes.  Returns -ENODATA if retention has dropped the history
+ * needed.
+ */
+int diaryfs_diff(struct file *file, const struct diaryfs_when *from,
+		const struct diaryfs_when *to, struct diaryfs_diff *d)
+{
+	struct inode *inode = file_inode(file);
+	struct file *lower_file = diaryfs_lower_file(file);
+	const struct diaryfs_when *first = from, *last = to;
+	struct diaryfs_diff_ctx dc = { .d = d };
+	struct diaryfs_hist hist = { NULL };
+	loff_t start, end, small, big, size, pos = d->offset;
+	u8 *a = NULL, *b = NULL;
+	unsigned int i;
+	ssize_t n;
+	int ret;
+
+	ret = diaryfs_history_read(inode, NULL, from, 0, 0, NULL, &size);
+	if (ret)
+		goto out;
+	d->from_size = size;
+	ret = diaryfs_history_read(inode, NULL, to, 0, 0, NULL, &size);
+	if (ret)
+		goto out;
+	d->to_size = size;
+	small = min(d->from_size, d->to_size);
+	big = max(d->from_size, d->to_size);
+
+	/* what was written between the two, whichever way round they are */
+	if (!diaryfs_hist_after(from, to->time, to->seq)) {
+		first = to;
+		last = from;
+	}
+	ret = diaryfs_history_changes(inode, first, last, &hist);
+	if (ret)
+		goto out;
+
+	a = vmalloc(DIARYFS_HISTORY_MAX);
+	b = vmalloc(DIARYFS_HISTORY_MAX);
+	if (!a || !b) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	diaryfs_hist_sort_off(&hist);
+	for (i = 0; i < hist.nr; ) {
+		i = diaryfs_hist_run(&hist, i, &start, &end);
+		start = max(start, pos);
+		end = min(end, small);
+		if (start >= small)
+			break;
+		if (start >= end)
+			continue;
+
+		n = diaryfs_history_read(inode, lower_file, from, start,
+				end - start, a, &size);
+		if (n >= 0)
+			n = diaryfs_history_read(inode, lower_file, to, start,
+					end - start, b, &size);
+		if (n < 0) {
+			ret = n;
+			goto out;
+		}
+		ret = diaryfs_diff_cmp(&dc, start, a, b, end - start);
+		if (ret)
+			goto out;
+		cond_resched();
+	}
+
+	/* past the smaller size, there is nothing to compare against */
+	for (start = max(pos, small); start < big; start += n) {
+		n = min_t(loff_t, big - start, DIARYFS_HISTORY_MAX);
+		if ((d->flags & DIARYFS_DIFF_DATA) && start < d->to_size) {
+			ret = diaryfs_history_read(inode, lower_file, to,
+					start, n, b, &size);
+			if (ret < 0)
+				goto out;
+		}
+		ret = diaryfs_diff_add(&dc, start, n, b);
+		if (ret)
+			goto out;
+		cond_resched();
+	}
+	d->offset = big;
+out:
+	if (ret >= 0)
+		ret = diaryfs_diff_flush(&dc);
+	d->nr = dc.nr;
+	d->buf_len = dc.data_len;
+	vfree(b);
+	vfree(a);
+	kfree(hist.ents);
+	return ret;
+}
@@ -0,0 +1,501 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+#include <linux/sort.h>
+#include <linux/cred.h>
+
+/*
+ * Exporting a tree as it was at some point.
+ *
+ * DIARYFS_IOC_EXPORT copies a directory of the mount, and everything below
+ * it, into a directory elsewhere, with file contents as of a point in
+ * history: what a copy of the matching snapshot directory would give,
+ * without the round trip through user space.  The tree is walked first,
+ * making directories, symlinks and empty files in the destination as it
+ * goes.  Then the files are filled in by a pool of workers, in lower inode
+ * order, which on most file systems is close to the order their data sits
+ * on disk.  Each file is read front to back.  The workers never see the
+ * caller's signals; a fatal one is passed on to them as the export error.
+ *
+ * As with snapshots, names and links are the current ones; only contents
+ * are versioned.  Everything is created with the caller's credentials.
+ */
+
+struct diaryfs_export_file {
+	struct path lower;		/* to read */
+	struct path dest;		/* created empty, to fill in */
+};
+
+/* a directory still to be walked */
+struct diaryfs_export_dir {
+	struct list_head list;
+	struct path lower;
+	struct path dest;
+};
+
+/* a name found in a lower directory */
+struct diaryfs_export_name {
+	struct list_head list;
+	unsigned int len;
+	char name[];
+};
+
+struct diaryfs_export_ctx {
+	struct super_block *sb;
+	struct diaryfs_when when;
+	const struct cred *cred;
+	struct diaryfs_export *ex;	/* counts, under lock */
+	spinlock_t lock;
+	int err;			/* first worker error */
+
+	struct list_head dirs;
+	struct diaryfs_export_file *files;	/* vmalloc'ed */
+	unsigned int nr_files;
+	unsigned int max_files;
+	atomic_t next;			/* next file for a worker */
+	atomic_t running;		/* workers not done yet */
+	wait_queue_head_t wait;		/* for running to drop to 0 */
+};
+
+struct diaryfs_export_worker {
+	struct work_struct work;
+	struct diaryfs_export_ctx *ctx;
+};
+
+/* collects the names in a lower directory */
+struct diaryfs_export_readdir {
+	struct dir_context ctx;
+	struct list_head names;
+	bool lower_root;
+	int err;
+};
+
+static int diaryfs_export_filldir(struct dir_context *ctx, const char *name,
+		int namelen, loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct diaryfs_export_readdir *rd =
+		container_of(ctx, struct diaryfs_export_readdir, ctx);
+	struct diaryfs_export_name *n;
+
+	if ((namelen == 1 && name[0] == '.') ||
+	    (namelen == 2 && name[0] == '.' && name[1] == '.'))
+		return 0;
+	if (rd->lower_root && namelen == sizeof(DIARYFS_META_DIR) - 1 &&
+	    !memcmp(name, DIARYFS_META_DIR, namelen))
+		return 0;
+
+	n = kmalloc(sizeof(*n) + namelen + 1, GFP_KERNEL);
+	if (!n) {
+		rd->err = -ENOMEM;
+		return -ENOMEM;
+	}
+	n->len = namelen;
+	memcpy(n->name, name, namelen);
+	n->name[namelen] = '\0';
+	list_add_tail(&n->list, &rd->names);
+	return 0;
+}
+
+static void diaryfs_export_free_names(struct list_head *names)
+{
+	struct diaryfs_export_name *n, *tmp;
+
+	list_for_each_entry_safe(n, tmp, names, list) {
+		list_del(&n->list);
+		kfree(n);
+	}
+}
+
+static int diaryfs_export_add_dir(struct diaryfs_export_ctx *ctx,
+		struct path *lower, struct path *dest)
+{
+	struct diaryfs_export_dir *d = kmalloc(sizeof(*d), GFP_KERNEL);
+
+	if (!d)
+		return -ENOMEM;
+	path_get(lower);
+	path_get(dest);
+	d->lower = *lower;
+	d->dest = *dest;
+	list_add_tail(&d->list, &ctx->dirs);
+	return 0;
+}
+
+static int diaryfs_export_add_file(struct diaryfs_export_ctx *ctx,
+		struct path *lower, struct path *dest)
+{
+	struct diaryfs_export_file *f;
+
+	if (ctx->nr_files == ctx->max_files) {
+		unsigned int max = max(2 * ctx->max_files, 64U);
+
+		/* big trees outgrow what kmalloc can hand out */
+		if (max > INT_MAX / sizeof(*f))
+			return -ENOMEM;
+		f = vmalloc(max * sizeof(*f));
+		if (!f)
+			return -ENOMEM;
+		if (ctx->nr_files)
+			memcpy(f, ctx->files, ctx->nr_files * sizeof(*f));
+		vfree(ctx->files);
+		ctx->files = f;
+		ctx->max_files = max;
+	}
+	f = &ctx->files[ctx->nr_files++];
+	path_get(lower);
+	path_get(dest);
+	f->lower = *lower;
+	f->dest = *dest;
+	return 0;
+}
+
+/* the link @lower points to, made again as @dentry in @dir */
+static int diaryfs_export_symlink(struct inode *dir, struct dentry *dentry,
+		struct dentry *lower)
+{
+	struct inode *inode = lower->d_inode;
+	const char *link = inode->i_link;
+	void *cookie = NULL;
+	int err;
+
+	if (!link) {
+		link = inode->i_op->follow_link(lower, &cookie);
+		if (IS_ERR(link))
+			return PTR_ERR(link);
+		/* a magic link, that only means something where it is */
+		if (!link)
+			return -EINVAL;
+	}
+	err = vfs_symlink(dir, dentry, link);
+	if (inode->i_op->put_link)
+		inode->i_op->put_link(inode, cookie);
+	return err;
+}
+
+/* copy one entry of a walked directory; directories are walked later */
+static int diaryfs_export_entry(struct diaryfs_export_ctx *ctx,
+		struct diaryfs_export_dir *d, struct diaryfs_export_name *n)
+{
+	struct inode *lower_dir = d->lower.dentry->d_inode;
+	struct inode *dest_dir = d->dest.dentry->d_inode;
+	struct path lower = { .mnt = d->lower.mnt };
+	struct path dest = { .mnt = d->dest.mnt };
+	umode_t mode;
+	int err;
+
+	mutex_lock(&lower_dir->i_mutex);
+	lower.dentry = lookup_one_len(n->name, d->lower.dentry, n->len);
+	mutex_unlock(&lower_dir->i_mutex);
+	if (IS_ERR(lower.dentry))
+		return PTR_ERR(lower.dentry);
+	/* gone since we listed it */
+	if (d_is_negative(lower.dentry)) {
+		dput(lower.dentry);
+		return 0;
+	}
+	mode = lower.dentry->d_inode->i_mode;
+	if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode)) {
+		spin_lock(&ctx->lock);
+		ctx->ex->skipped++;
+		spin_unlock(&ctx->lock);
+		err = 0;
+		goto out_lower;
+	}
+	/* only what the caller could read through the mount */
+	err = inode_permission(lower.dentry->d_inode,
+			S_ISDIR(mode) ? MAY_READ | MAY_EXEC : MAY_READ);
+	if (err && !S_ISLNK(mode))
+		goto out_lower;
+
+	mutex_lock_nested(&dest_dir->i_mutex, I_MUTEX_PARENT);
+	dest.dentry = lookup_one_len(n->name, d->dest.dentry, n->len);
+	if (IS_ERR(dest.dentry)) {
+		err = PTR_ERR(dest.dentry);
+		mutex_unlock(&dest_dir->i_mutex);
+		goto out_lower;
+	}
+	if (S_ISDIR(mode))
+		err = vfs_mkdir(dest_dir, dest.dentry, mode & S_IALLUGO);
+	else if (S_ISREG(mode))
+		err = vfs_create(dest_dir, dest.dentry, mode & S_IALLUGO, true);
+	else
+		err = diaryfs_export_symlink(dest_dir, dest.dentry,
+				lower.dentry);
+	mutex_unlock(&dest_dir->i_mutex);
+	if (err)
+		goto out_dest;
+
+	if (S_ISDIR(mode)) {
+		err = diaryfs_export_add_dir(ctx, &lower, &dest);
+		ctx->ex->dirs++;
+	} else if (S_ISREG(mode)) {
+		err = diaryfs_export_add_file(ctx, &lower, &dest);
+	} else {
+		ctx->ex->symlinks++;
+	}
+out_dest:
+	dput(dest.dentry);
+out_lower:
+	dput(lower.dentry);
+	return err;
+}
+
+/* copy the entries of @d, queueing its subdirectories */
+static int diaryfs_export_walk(struct diaryfs_export_ctx *ctx,
+		struct diaryfs_export_dir *d)
+{
+	struct diaryfs_export_readdir rd = {
+		.ctx.actor = diaryfs_export_filldir,
+		.names = LIST_HEAD_INIT(rd.names),
+	};
+	struct diaryfs_export_name *n;
+	struct file *file;
+	int err;
+
+	file = dentry_open(&d->lower, O_RDONLY | O_DIRECTORY, ctx->cred);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	rd.lower_root = diaryfs_is_lower_root(ctx->sb, d->lower.dentry);
+	err = iterate_dir(file, &rd.ctx);
+	fput(file);
+	if (!err)
+		err = rd.err;
+
+	list_for_each_entry(n, &rd.names, list) {
+		if (err)
+			break;
+		err = diaryfs_export_entry(ctx, d, n);
+		if (fatal_signal_pending(current))
+			err = -EINTR;
+		cond_resched();
+	}
+	diaryfs_export_free_names(&rd.names);
+	return err;
+}
+
+/* fill in one exported file from history */
+static int diaryfs_export_fill(struct diaryfs_export_ctx *ctx,
+		struct diaryfs_export_file *f, void *buf)
+{
+	struct file *lower_file, *dest;
+	struct inode *live;
+	loff_t pos = 0, size = 0;
+	ssize_t n, ret;
+	int err = 0;
+
+	live = diaryfs_iget(ctx->sb, f->lower.dentry->d_inode);
+	if (IS_ERR(live))
+		return PTR_ERR(live);
+	lower_file = dentry_open(&f->lower, O_RDONLY | O_LARGEFILE, ctx->cred);
+	if (IS_ERR(lower_file)) {
+		err = PTR_ERR(lower_file);
+		goto out_iput;
+	}
+	dest = dentry_open(&f->dest, O_WRONLY | O_LARGEFILE, ctx->cred);
+	if (IS_ERR(dest)) {
+		err = PTR_ERR(dest);
+		goto out_lower;
+	}
+
+	do {
+		n = diaryfs_history_read(live, lower_file, &ctx->when, pos,
+				DIARYFS_HISTORY_MAX, buf, &size);
+		if (n <= 0) {
+			err = n;
+			break;
+		}
+		ret = kernel_write(dest, buf, n, pos);
+		if (ret != n) {
+			err = ret < 0 ? ret : -EIO;
+			break;
+		}
+		pos += n;
+		if (READ_ONCE(ctx->err)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+	} while (pos < size);
+
+	spin_lock(&ctx->lock);
+	if (!err) {
+		ctx->ex->files++;
+		ctx->ex->bytes += pos;
+	}
+	spin_unlock(&ctx->lock);
+
+	fput(dest);
+out_lower:
+	fput(lower_file);
+out_iput:
+	iput(live);
+	return err;
+}
+
+static void diaryfs_export_fail(struct diaryfs_export_ctx *ctx, int err)
+{
+	spin_lock(&ctx->lock);
+	if (!ctx->err)
+		ctx->err = err;
+	spin_unlock(&ctx->lock);
+}
+
+static void diaryfs_export_work(struct work_struct *work)
+{
+	struct diaryfs_export_worker *w =
+		container_of(work, struct diaryfs_export_worker, work);
+	struct diaryfs_export_ctx *ctx = w->ctx;
+	const struct cred *old;
+	unsigned int i;
+	void *buf;
+	int err = 0;
+
+	buf = vmalloc(DIARYFS_HISTORY_MAX);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+	old = override_creds(ctx->cred);
+	/* files go out in order; stop taking more once one fails */
+	while ((i = atomic_inc_return(&ctx->next) - 1) < ctx->nr_files) {
+		if (READ_ONCE(ctx->err))
+			break;
+		err = diaryfs_export_fill(ctx, &ctx->files[i], buf);
+		if (err)
+			break;
+	}
+	revert_creds(old);
+	vfree(buf);
+out:
+	if (err)
+		diaryfs_export_fail(ctx, err);
+	if (atomic_dec_and_test(&ctx->running))
+		wake_up(&ctx->wait);
+}
+
+static int diaryfs_export_ino_cmp(const void *a, const void *b)
+{
+	unsigned long x = ((const struct diaryfs_export_file *)a)->
+		lower.dentry->d_inode->i_ino;
+	unsigned long y = ((const struct diaryfs_export_file *)b)->
+		lower.dentry->d_inode->i_ino;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* fill in every file found, with @nr workers */
+static int diaryfs_export_files(struct diaryfs_export_ctx *ctx,
+		unsigned int nr)
+{
+	struct diaryfs_export_worker *workers;
+	unsigned int i;
+
+	sort(ctx->files, ctx->nr_files, sizeof(*ctx->files),
+			diaryfs_export_ino_cmp, NULL);
+
+	nr = clamp_t(unsigned int, nr ? nr : num_online_cpus(), 1,
+			DIARYFS_EXPORT_WORKERS);
+	nr = min(nr, max(ctx->nr_files, 1U));
+	workers = kcalloc(nr, sizeof(*workers), GFP_KERNEL);
+	if (!workers)
+		return -ENOMEM;
+	atomic_set(&ctx->running, nr);
+	for (i = 0; i < nr; i++) {
+		workers[i].ctx = ctx;
+		INIT_WORK(&workers[i].work, diaryfs_export_work);
+		queue_work(system_unbound_wq, &workers[i].work);
+	}
+	/* on a kill, stop the workers and wait for the files they are on */
+	if (wait_event_killable(ctx->wait, !atomic_read(&ctx->running)))
+		diaryfs_export_fail(ctx, -EINTR);
+	for (i = 0; i < nr; i++)
+		flush_work(&workers[i].work);
+	kfree(workers);
+	return ctx->err;
+}
+
+/*
+ * diaryfs_export - copy directory @file, as of @when, into @dest
+ *
+ * Fills in the counts of @ex.  Returns -ENODATA if retention has dropped
+ * the history needed, and -EINVAL if @dest is inside what is exported.
+ */
+int diaryfs_export(struct file *file, const struct diaryfs_when *when,
+		struct file *dest, struct diaryfs_export *ex)
+{
+	struct diaryfs_export_ctx ctx = {
+		.sb = file_inode(file)->i_sb,
+		.when = *when,
+		.ex = ex,
+		.lock = __SPIN_LOCK_UNLOCKED(ctx.lock),
+		.dirs = LIST_HEAD_INIT(ctx.dirs),
+		.wait = __WAIT_QUEUE_HEAD_INITIALIZER(ctx.wait),
+	};
+	struct diaryfs_export_dir *d;
+	struct dentry *dest_dentry = dest->f_path.dentry;
+	struct path lower, dest_lower;
+	unsigned int i;
+	int err;
+
+	/* rather than find out one file at a time */
+	if (diaryfs_hist_expired(DIARYFS_SB(ctx.sb), when))
+		return -ENODATA;
+	err = mnt_want_write(dest->f_path.mnt);
+	if (err)
+		return err;
+
+	/* don't export into the tree being exported */
+	diaryfs_get_lower_path(file->f_path.dentry, &lower);
+	if (dest_dentry->d_sb == ctx.sb) {
+		diaryfs_peek_lower_path(dest_dentry, &dest_lower);
+		dest_dentry = dest_lower.dentry;
+	}
+	if (is_subdir(dest_dentry, lower.dentry)) {
+		err = -EINVAL;
+		goto out_put;
+	}
+
+	ctx.cred = get_current_cred();
+	err = diaryfs_export_add_dir(&ctx, &lower, &dest->f_path);
+	while (!err && !list_empty(&ctx.dirs)) {
+		d = list_first_entry(&ctx.dirs, struct diaryfs_export_dir,
+				list);
+		err = diaryfs_export_walk(&ctx, d);
+		list_del(&d->list);
+		path_put(&d->lower);
+		path_put(&d->dest);
+		kfree(d);
+	}
+	if (!err)
+		err = diaryfs_export_files(&ctx, ex->workers);
+
+	while (!list_empty(&ctx.dirs)) {
+		d = list_first_entry(&ctx.dirs, struct diaryfs_export_dir,
+				list);
+		list_del(&d->list);
+		path_put(&d->lower);
+		path_put(&d->dest);
+		kfree(d);
+	}
+	for (i = 0; i < ctx.nr_files; i++) {
+		path_put(&ctx.files[i].lower);
+		path_put(&ctx.files[i].dest);
+	}
+	vfree(ctx.files);
+	put_cred(ctx.cred);
+out_put:
+	diaryfs_put_lower_path(file->f_path.dentry, &lower);
+	mnt_drop_write(dest->f_path.mnt);
+	return err;
+}
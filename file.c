@@ -12,115 +12,177 @@
  */ 
 
 #include "diaryfs.h"
+#include "diaryfs_trace.h"
+#include <linux/compat.h>
+
+/* passes lower directory entries up, minus the ones diaryfs keeps hidden */
+struct diaryfs_readdir_ctx {
+	struct dir_context ctx;
+	struct dir_context * caller;
+	struct dentry * dir;
+	bool lower_root;	/* listing the lower root, live or not */
+};
+
+static int diaryfs_filldir(struct dir_context * ctx, const char * name,
+		int namelen, loff_t offset, u64 ino, unsigned int d_type) {
+	struct diaryfs_readdir_ctx * buf =
+		container_of(ctx, struct diaryfs_readdir_ctx, ctx);
+
+	if (buf->lower_root && namelen == sizeof(DIARYFS_META_DIR) - 1 &&
+	    !memcmp(name, DIARYFS_META_DIR, namelen))
+		return 0;
+	if (diaryfs_is_snap_name(buf->dir, name, namelen))
+		return 0;
+	return buf->caller->actor(buf->caller, name, namelen, offset, ino,
+			d_type);
+}
+
+static int diaryfs_readdir(struct file *file, struct dir_context *ctx) {
 
-static ssize_t diaryfs_read(struct file *file, char __user *buf,
-		size_t count, loff_t *ppos)
-{
 	int err;
-	struct file * lower_file;
+	struct file * lower_file = NULL;
 	struct dentry * dentry = file->f_path.dentry;
-
-	printk("DiaryFS [Read] File: %s\n", file->f_path.dentry->d_iname);
-	printk("DiaryFS [Read] Count: %llu\n", count);
-	printk("DiaryFS [Read] ppos: %llu\n", ppos);
+	struct diaryfs_readdir_ctx buf = {
+		.ctx.actor = diaryfs_filldir,
+		.caller = ctx,
+		.dir = dentry,
+	};
 
 	lower_file = diaryfs_lower_file(file);
-	err = vfs_read(lower_file, buf, count, ppos);
-
-	/* update our inode atime upon a successful lower read */
-	if (err >= 0)
+	buf.lower_root = diaryfs_is_lower_root(dentry->d_sb,
+			lower_file->f_path.dentry);
+	err = iterate_dir(lower_file, &buf.ctx);
+	ctx->pos = buf.ctx.pos;
+	file->f_pos = lower_file->f_pos;
+	if (err >= 0) 
 		fsstack_copy_attr_atime(dentry->d_inode, file_inode(lower_file));
-
 	return err;
 }
 
-static uint32_t diaryfs_compute_hash(struct file * file, char * buf, loff_t * ppos) {
-	ssize_t read_size = diaryfs_read(file, buf, 4096, ppos);
-//	printk("DiaryFS: [hash] buf: %s\n", buf);
-	return jhash(buf, 4096, 0);
+/* turn an ioctl's @when and @flags into a point in history */
+static int diaryfs_ioctl_when(u64 when, u32 flags, struct diaryfs_when *w) {
+	if (flags & ~DIARYFS_AT_VERSION)
+		return -EINVAL;
+	/* writes are numbered from 1 */
+	if ((flags & DIARYFS_AT_VERSION) && !when)
+		return -EINVAL;
+	w->time = flags & DIARYFS_AT_VERSION ? 0 : when;
+	w->seq = flags & DIARYFS_AT_VERSION ? when : 0;
+	return 0;
 }
 
-void diaryfs_diff_gen(char * buf1, char * buf2, size_t bsize_1, size_t bsize_2, char * diff_buf) {
-	int size = bsize_1 < bsize_2 ? bsize_1 : bsize_2;
-	int i;
-	int diff_offset = 0;
-	printk("DiaryFS: [DiffGen] size: %llu\n", size);
-
-	for(i = 0; i < size; i++) {
-		if (buf1[i] != buf2[i]) {
-			diff_buf[diff_offset++] = buf2[i];
-		}
+/* DIARYFS_IOC_READ_AT: read a range of the file as it was at some point */
+static long diaryfs_ioctl_read_at(struct file * file, void __user * arg) {
+	struct diaryfs_read_at ra;
+	struct diaryfs_when when;
+	loff_t size = 0;
+	ssize_t ret;
+	void * buf;
+
+	if (!S_ISREG(file_inode(file)->i_mode))
+		return -ENOTTY;
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (copy_from_user(&ra, arg, sizeof(ra)))
+		return -EFAULT;
+	if (ra.pad || ra.offset > LLONG_MAX ||
+	    diaryfs_ioctl_when(ra.when, ra.flags, &when))
+		return -EINVAL;
+
+	ra.len = min_t(u64, ra.len, DIARYFS_HISTORY_MAX);
+	buf = vmalloc(max_t(u64, ra.len, 1));
+	if (!buf)
+		return -ENOMEM;
+	ret = diaryfs_history_read(file_inode(file), diaryfs_lower_file(file),
+			&when, ra.offset, ra.len, buf, &size);
+	if (ret < 0)
+		goto out;
+	if (copy_to_user((void __user *)(unsigned long)ra.buf, buf, ret)) {
+		ret = -EFAULT;
+		goto out;
 	}
-	printk("DiaryFS: [DiffGen] diff: %s\n", diff_buf);
+	ra.size = size;
+	if (copy_to_user(arg, &ra, sizeof(ra)))
+		ret = -EFAULT;
+out:
+	vfree(buf);
+	return ret;
 }
 
-static ssize_t diaryfs_write(struct file * file, const char __user * buf, 
-							size_t count, loff_t *ppos) {
-
-	int err;
-	int i;
-
-	struct file * lower_file;
-	struct file * log_file;
-	struct dentry * dentry = file->f_path.dentry;
-	char __user * diffs[(count / 8000) + (count % 8000 != 0)]; // saves pointers to blocks to save
-	uint32_t diff_count = 0;
-
-	char __user * buf_old; // 8KB block of old file
-	char __user * buf_new; // 8KB block of new file
-
-	uint32_t hash_old = 0; // Hash of the old file block
-	uint32_t hash_new = 0; // Hash of the new file block
-
-	size_t hashed = 0;
-	size_t tohash;
-
-	char * test_str = "logging test";
-
-	char diff_buf[8192];
-	char old_buf[8192]; // TODO: Fix these hardcoded sizes
-
-	uint32_t hash = jhash(buf, count, 0);
-	uint32_t old_hash = diaryfs_compute_hash(file, old_buf, ppos);
-
-	if (hash != old_hash) {
-		diaryfs_diff_gen(buf, old_buf, count, count, diff_buf);
-	}
-
-
-	printk("DiaryFS: [Write] File: %s\n", file->f_path.dentry->d_iname);
-	printk("DiaryFS: [Write] Buf: %s\n", buf);
-	printk("DiaryFS: [Write] old_buf: %s\n", old_buf);
-	printk("DiaryFS: [Write] diff: %s\n", diff_buf);
-	printk("DiaryFS: [Write] Count: %llu\n", count);
-	printk("DiaryFS: [Write] ppos: %llu\n", ppos);
-	printk("DiaryFS: [Write] new_hash: %llu\n", hash);
-	printk("DiaryFS: [Write] old_hash: %llu\n", old_hash);
-
-	lower_file = diaryfs_lower_file(file);
-
-	err = vfs_write(lower_file, buf, count, ppos);
-
-	if (err >= 0) {
-		fsstack_copy_attr_times(dentry->d_inode, file_inode(lower_file));
-		fsstack_copy_inode_size(dentry->d_inode, file_inode(lower_file));
-	}
-
-	printk("DiaryFS: Finished writing!!\n");
-	return err;
+static long diaryfs_ioctl_rollback(struct file * file, void __user * arg) {
+	struct diaryfs_rollback rb;
+	struct diaryfs_when when;
+
+	if (!S_ISREG(file_inode(file)->i_mode))
+		return -ENOTTY;
+	/* old contents are read back through the lower file */
+	if ((file->f_mode & (FMODE_READ | FMODE_WRITE)) !=
+	    (FMODE_READ | FMODE_WRITE))
+		return -EBADF;
+	if (file->f_flags & O_APPEND)
+		return -EINVAL;
+	if (copy_from_user(&rb, arg, sizeof(rb)))
+		return -EFAULT;
+	if (rb.pad || diaryfs_ioctl_when(rb.when, rb.flags, &when))
+		return -EINVAL;
+	return diaryfs_rollback(file, &when);
 }
 
-static int diaryfs_readdir(struct file *file, struct dir_context *ctx) {
-
-	int err;
-	struct file * lower_file = NULL;
-	struct dentry * dentry = file->f_path.dentry;
+static long diaryfs_ioctl_diff(struct file * file, void __user * arg) {
+	struct diaryfs_diff d;
+	struct diaryfs_when from, to;
+	long err;
+
+	if (!S_ISREG(file_inode(file)->i_mode))
+		return -ENOTTY;
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (copy_from_user(&d, arg, sizeof(d)))
+		return -EFAULT;
+	if ((d.flags & ~(DIARYFS_AT_VERSION | DIARYFS_DIFF_DATA)) ||
+	    d.offset > LLONG_MAX ||
+	    diaryfs_ioctl_when(d.from, d.flags & DIARYFS_AT_VERSION, &from) ||
+	    diaryfs_ioctl_when(d.to, d.flags & DIARYFS_AT_VERSION, &to))
+		return -EINVAL;
+
+	err = diaryfs_diff(file, &from, &to, &d);
+	if (err)
+		return err;
+	if (copy_to_user(arg, &d, sizeof(d)))
+		return -EFAULT;
+	return 0;
+}
 
-	lower_file = diaryfs_lower_file(file);
-	err = iterate_dir(lower_file, ctx);
-	file->f_pos = lower_file->f_pos;
-	if (err >= 0) 
-		fsstack_copy_attr_atime(dentry->d_inode, file_inode(lower_file));
+static long diaryfs_ioctl_export(struct file * file, void __user * arg) {
+	struct diaryfs_export ex;
+	struct diaryfs_when when;
+	struct fd dest;
+	long err;
+
+	if (!S_ISDIR(file_inode(file)->i_mode))
+		return -ENOTTY;
+	/* a snapshot is already a tree as of some point */
+	if (DIARYFS_I(file_inode(file))->snap_time)
+		return -EINVAL;
+	if (copy_from_user(&ex, arg, sizeof(ex)))
+		return -EFAULT;
+	if (ex.pad || diaryfs_ioctl_when(ex.when, ex.flags, &when))
+		return -EINVAL;
+
+	dest = fdget(ex.dest_fd);
+	if (!dest.file)
+		return -EBADF;
+	if (!S_ISDIR(file_inode(dest.file)->i_mode)) {
+		err = -ENOTDIR;
+		goto out;
+	}
+	ex.files = ex.dirs = ex.symlinks = ex.skipped = ex.bytes = 0;
+	err = diaryfs_export(file, &when, dest.file, &ex);
+	/* report what got copied even if not all of it did */
+	if (copy_to_user(arg, &ex, sizeof(ex)))
+		err = -EFAULT;
+out:
+	fdput(dest);
 	return err;
 }
 
@@ -129,6 +191,21 @@ static long diaryfs_unlocked_ioctl(struct file * file, unsigned int cmd,
 	long err = -ENOTTY;
 	struct file * lower_file = diaryfs_lower_file(file);
 
+	switch (cmd) {
+	case DIARYFS_IOC_READ_AT:
+		return diaryfs_ioctl_read_at(file, (void __user *)arg);
+	case DIARYFS_IOC_ROLLBACK:
+		return diaryfs_ioctl_rollback(file, (void __user *)arg);
+	case DIARYFS_IOC_DIFF:
+		return diaryfs_ioctl_diff(file, (void __user *)arg);
+	case DIARYFS_IOC_EXPORT:
+		return diaryfs_ioctl_export(file, (void __user *)arg);
+	}
+
+	/* snapshots are read-only: nothing goes through to the lower file */
+	if (DIARYFS_I(file_inode(file))->snap_time)
+		return -ENOTTY;
+
 	/* use vfs_ioctl when vfs exports it */
 	if (!lower_file || !lower_file->f_op) {
 		goto out;
@@ -150,6 +227,21 @@ static long diaryfs_compat_ioctl(struct file * file, unsigned int cmd,
 	int err = -ENOTTY;
 	struct file * lower_file;
 
+	switch (cmd) {
+	case DIARYFS_IOC_READ_AT:
+		return diaryfs_ioctl_read_at(file, compat_ptr(arg));
+	case DIARYFS_IOC_ROLLBACK:
+		return diaryfs_ioctl_rollback(file, compat_ptr(arg));
+	case DIARYFS_IOC_DIFF:
+		return diaryfs_ioctl_diff(file, compat_ptr(arg));
+	case DIARYFS_IOC_EXPORT:
+		return diaryfs_ioctl_export(file, compat_ptr(arg));
+	}
+
+	/* snapshots are read-only: nothing goes through to the lower file */
+	if (DIARYFS_I(file_inode(file))->snap_time)
+		return -ENOTTY;
+
 	lower_file = diaryfs_lower_file(file);
 
 	/* use vfs_ioctl when vfs exports it */
@@ -171,7 +263,6 @@ static int diaryfs_mmap(struct file * file, struct vm_area_struct *vma) {
 	int err = 0;
 	bool willwrite;
 	struct file * lower_file;
-	const struct vm_operations_struct * saved_vm_ops = NULL;
 
 	willwrite = ((vma->vm_flags | VM_SHARED | VM_WRITE) == vma->vm_flags);
 
@@ -190,38 +281,41 @@ static int diaryfs_mmap(struct file * file, struct vm_area_struct *vma) {
 		printk(KERN_ERR "diaryfs: Lower file system doesnt support writable mmap\n");
 		goto out;
 	}
-	/*
-	 * find and save lower vm_ops.
-	 *
-	 * the VFS should have a cleaner way of finding the lower vm_ops
-	 */
-	if (!DIARYFS_F(file)->lower_vm_ops) {
-		err = lower_file->f_op->mmap(lower_file, vma);
-		if (err) {
-			printk(KERN_ERR "diaryfs: lower mmap failed %d\n", err);
-			goto out;
-		}
-
-		saved_vm_ops = vma->vm_ops; /* save from lower -mmap */
+	err = lower_file->f_op->mmap(lower_file, vma);
+	if (err) {
+		printk(KERN_ERR "diaryfs: lower mmap failed %d\n", err);
+		goto out;
 	}
+	/* we need vm_private_data for ourselves */
+	if (vma->vm_private_data) {
+		if (vma->vm_ops && vma->vm_ops->close)
+			vma->vm_ops->close(vma);
+		printk(KERN_ERR "diaryfs: lower mmap uses vm_private_data\n");
+		err = -EINVAL;
+		goto out;
+	}
+	DIARYFS_F(file)->lower_vm_ops = vma->vm_ops; /* save for our ->fault */
 
 	file_accessed(file);
 	vma->vm_ops = &diaryfs_vm_ops;
 
+	/*
+	 * Map the lower file, so faults can go straight to the lower vm_ops.
+	 * The reference mmap took on us moves to vm_private_data.
+	 */
+	vma->vm_private_data = file;
+	vma->vm_file = get_file(lower_file);
+
 	file->f_mapping->a_ops = &diaryfs_aops; /* set our aops */
-	if (!DIARYFS_F(file)->lower_vm_ops) /* save for our -> fault */ 
-		DIARYFS_F(file)->lower_vm_ops = saved_vm_ops;
 
 out:
 	return err;
 }
 
-static int diaryfs_open(struct inode * inode, struct file * file) {
+int diaryfs_open(struct inode * inode, struct file * file) {
 	int err = 0;
 	struct file * lower_file = NULL;
-	struct file * log_file = NULL;
 	struct path lower_path;
-	struct path log_path;
 
 	/* don't open unhashed or deleted files */
 	if (d_unhashed(file->f_path.dentry)) {
@@ -237,11 +331,8 @@ static int diaryfs_open(struct inode * inode, struct file * file) {
 
 	/* open lower object and link diaryfs's file struct to lower's */
 	diaryfs_get_lower_path(file->f_path.dentry, &lower_path);
-//	diaryfs_get_log_path(&lower_path, &log_path);
 	lower_file = dentry_open(&lower_path, file->f_flags, current_cred());
-	//lower_file = dentry_open(&log_path, file->f_flags, current_cred());
 	path_put(&lower_path);
-	//path_put(&log_path);
 
 	if (IS_ERR(lower_file)) {
 		err = PTR_ERR(lower_file);
@@ -276,7 +367,7 @@ static int diaryfs_flush(struct file * file, fl_owner_t id) {
 }
 
 /* release all lower object ref and free file info structure */
-static int diaryfs_file_release(struct inode * inode, struct file * file ) {
+int diaryfs_file_release(struct inode * inode, struct file * file ) {
 	struct file * lower_file;
 	lower_file = diaryfs_lower_file(file);
 	
@@ -291,16 +382,12 @@ static int diaryfs_file_release(struct inode * inode, struct file * file ) {
 static int diaryfs_fsync(struct file * file, loff_t start, loff_t end, int datasync) {
 	int err;
 	struct file * lower_file;
-	struct path lower_path;
-	struct dentry * dentry = file->f_path.dentry;
 
 	err = __generic_file_fsync(file, start, end, datasync);
 	if (err)
 		goto out;
 	lower_file = diaryfs_lower_file(file);
-	diaryfs_get_lower_path(dentry, &lower_path);
 	err = vfs_fsync_range(lower_file, start, end, datasync);
-	diaryfs_put_lower_path(dentry, &lower_path);
 out:
 	return err;
 }
@@ -346,6 +433,9 @@ ssize_t diaryfs_read_iter(struct kiocb * iocb, struct iov_iter *iter) {
 	int err;
 	struct file * file;
 	struct file * lower_file;
+	u64 start = ktime_get_ns();
+	loff_t pos = iocb->ki_pos;
+	size_t count = iov_iter_count(iter);
 
    	file = iocb->ki_filp;
 	lower_file = diaryfs_lower_file(file);
@@ -358,36 +448,214 @@ ssize_t diaryfs_read_iter(struct kiocb * iocb, struct iov_iter *iter) {
 	iocb->ki_filp = lower_file;
 	err = lower_file->f_op->read_iter(iocb, iter);
 	iocb->ki_filp = file;
-	if (err >= 0 || err == EIOCBQUEUED) {
+	fput(lower_file);
+	if (err >= 0 || err == -EIOCBQUEUED) {
 		fsstack_copy_attr_atime(file->f_path.dentry->d_inode, file_inode(lower_file));
 	}
 out:
+	diaryfs_stat_lat(DIARYFS_SB(file_inode(file)->i_sb), DIARYFS_LAT_READ,
+			start);
+	trace_diaryfs_read(file_inode(file), pos, count, err, start);
+	diaryfs_debug("read ino %lu pos %lld len %zu: %d\n",
+			file_inode(file)->i_ino, pos, count, err);
 	return err;
 }
 
+/*
+ * An async write handed to the lower file.  The lower file gets its own
+ * kiocb so that we hear about completion and can version the write before
+ * passing the result on to the caller's kiocb.
+ */
+struct diaryfs_aio_req {
+	struct kiocb iocb;
+	struct kiocb * orig;
+	struct diaryfs_wver * wver;
+	struct work_struct work;
+	long res;
+	long res2;
+};
+
+/* update upper inode times/sizes and finish versioning a write */
+static void diaryfs_write_done(struct file * file, struct diaryfs_wver * wver,
+							ssize_t res) {
+	struct file * lower_file = diaryfs_lower_file(file);
+
+	if (res > 0)
+		diaryfs_stat_add(DIARYFS_SB(file_inode(file)->i_sb),
+				DIARYFS_STAT_WRITTEN, res);
+	if (res >= 0) {
+		fsstack_copy_inode_size(file->f_path.dentry->d_inode,
+				file_inode(lower_file));
+		fsstack_copy_attr_times(file->f_path.dentry->d_inode,
+				file_inode(lower_file));
+	}
+	diaryfs_version_end(wver, res);
+}
+
+static void diaryfs_aio_work(struct work_struct * work) {
+	struct diaryfs_aio_req * req = container_of(work, struct diaryfs_aio_req, work);
+	struct kiocb * orig = req->orig;
+	struct inode * inode = file_inode(orig->ki_filp);
+
+	diaryfs_write_done(orig->ki_filp, req->wver, req->res);
+	inode_dio_end(inode);
+	file_end_write(req->iocb.ki_filp);
+	fput(req->iocb.ki_filp);
+
+	orig->ki_pos = req->iocb.ki_pos;
+	orig->ki_complete(orig, req->res, req->res2);
+	kfree(req);
+}
+
+/*
+ * Lower completion may run in interrupt context, while versioning has to
+ * read pages and allocate memory.  Punt the rest of the work to process
+ * context.
+ */
+static void diaryfs_aio_complete(struct kiocb * iocb, long res, long res2) {
+	struct diaryfs_aio_req * req = container_of(iocb, struct diaryfs_aio_req, iocb);
+
+	req->res = res;
+	req->res2 = res2;
+	INIT_WORK(&req->work, diaryfs_aio_work);
+	queue_work(system_unbound_wq, &req->work);
+}
+
+/*
+ * Write @iter through @iocb (a synchronous one) one window at a time.  Each
+ * window is captured, written to the lower file and queued for versioning
+ * before the next one is looked at, so a write of any size holds no more
+ * than a window's worth of captured pages, and waits for the versioning
+ * queue between windows rather than up front.  All the windows share one
+ * sequence number, so the write is still a single version.
+ */
+static ssize_t diaryfs_write_windows(struct file * file, struct kiocb * iocb,
+							struct iov_iter * iter) {
+	struct file * lower_file = diaryfs_lower_file(file);
+	struct inode * lower_inode = file_inode(lower_file);
+	struct diaryfs_wver * wver;
+	ssize_t written = 0, ret = 0;
+	u64 seq = 0;
+
+	while (iov_iter_count(iter)) {
+		struct iov_iter win = *iter;
+		loff_t pos = iocb->ki_pos;
+		size_t len;
+
+		if (iocb->ki_flags & IOCB_APPEND)
+			pos = i_size_read(lower_inode);
+		/* windows end on page boundaries */
+		len = DIARYFS_WINDOW_BYTES - (pos & (PAGE_SIZE - 1));
+		len = min(len, iov_iter_count(iter));
+		iov_iter_truncate(&win, len);
+
+		ret = diaryfs_version_begin(file, pos, &win, &wver, &seq);
+		if (ret)
+			break;
+		iocb->ki_filp = lower_file;
+		file_start_write(lower_file);
+		ret = lower_file->f_op->write_iter(iocb, &win);
+		file_end_write(lower_file);
+		iocb->ki_filp = file;
+		diaryfs_write_done(file, wver, ret);
+		if (ret <= 0)
+			break;
+
+		written += ret;
+		iov_iter_advance(iter, ret);
+		if (ret < len)
+			break;
+	}
+	return written ? written : ret;
+}
+
+/*
+ * diaryfs write_iter: the one write path.  write(2), pwritev(2) and AIO all
+ * come through here.  The old data is captured under the upper i_mutex
+ * before the lower write is issued; async writes that are still in flight
+ * are waited for first, so every capture sees the result of the write
+ * before it.  Async writes larger than a window are done synchronously, in
+ * windows, to keep memory bounded.
+ */
 ssize_t diaryfs_write_iter(struct kiocb * iocb, struct iov_iter *iter) {
-	int err;
+	ssize_t err;
 	struct file * file = iocb->ki_filp;
+	struct inode * inode = file_inode(file);
 	struct file * lower_file = diaryfs_lower_file(file);
+	struct diaryfs_aio_req * req;
+	struct diaryfs_wver * wver;
+	struct kiocb kiocb;
+	u64 start = ktime_get_ns();
+	size_t count = iov_iter_count(iter);
+	loff_t pos = iocb->ki_pos;
 
 	if (!lower_file->f_op->write_iter) {
 		err = -EINVAL;
 		goto out;
 	}
+
+	mutex_lock(&inode->i_mutex);
+	inode_dio_wait(inode);
+
 	get_file(lower_file); /* prevent lower file from being released */
-	iocb->ki_filp = lower_file;
-	err = lower_file->f_op->write_iter(iocb, iter);
-	iocb->ki_filp = file;
-	fput(lower_file);
 
-	/* update upper inode times/sizes as needed */
-	if (err >= 0 || err == -EIOCBQUEUED) {
-		fsstack_copy_inode_size(file->f_path.dentry->d_inode,
-				file_inode(lower_file));
-		fsstack_copy_attr_times(file->f_path.dentry->d_inode,
-				file_inode(lower_file));
+	if (is_sync_kiocb(iocb)) {
+		err = diaryfs_write_windows(file, iocb, iter);
+		fput(lower_file);
+		goto out_unlock;
+	}
+	if (iov_iter_count(iter) > DIARYFS_WINDOW_BYTES) {
+		init_sync_kiocb(&kiocb, file);
+		kiocb.ki_pos = iocb->ki_pos;
+		kiocb.ki_flags = iocb->ki_flags;
+		err = diaryfs_write_windows(file, &kiocb, iter);
+		iocb->ki_pos = kiocb.ki_pos;
+		fput(lower_file);
+		goto out_unlock;
+	}
+
+	if (iocb->ki_flags & IOCB_APPEND)
+		pos = i_size_read(diaryfs_lower_inode(inode));
+	err = diaryfs_version_begin(file, pos, iter, &wver, NULL);
+	if (err) {
+		fput(lower_file);
+		goto out_unlock;
+	}
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (!req) {
+		fput(lower_file);
+		diaryfs_version_end(wver, -ENOMEM);
+		err = -ENOMEM;
+		goto out_unlock;
+	}
+	req->iocb = *iocb;
+	req->iocb.ki_filp = lower_file;
+	req->iocb.ki_complete = diaryfs_aio_complete;
+	req->orig = iocb;
+	req->wver = wver;
+
+	/* held until completion, which ends it in diaryfs_aio_work */
+	inode_dio_begin(inode);
+	file_start_write(lower_file);
+	err = lower_file->f_op->write_iter(&req->iocb, iter);
+	if (err != -EIOCBQUEUED) {
+		/* completed (or failed) without going async */
+		iocb->ki_pos = req->iocb.ki_pos;
+		diaryfs_write_done(file, wver, err);
+		inode_dio_end(inode);
+		file_end_write(lower_file);
+		fput(lower_file);
+		kfree(req);
 	}
+
+out_unlock:
+	mutex_unlock(&inode->i_mutex);
 out:
+	diaryfs_stat_lat(DIARYFS_SB(inode->i_sb), DIARYFS_LAT_WRITE, start);
+	trace_diaryfs_write(inode, pos, count, err, start);
+	diaryfs_debug("write ino %lu pos %lld len %zu: %zd\n", inode->i_ino,
+			pos, count, err);
 	return err;
 }
 
@@ -397,8 +665,6 @@ out:
  */
 const struct file_operations diaryfs_main_fops = { 
 	.llseek 	 		= generic_file_llseek,
-	.read				= diaryfs_read,
-	.write				= diaryfs_write,
 	.unlocked_ioctl 	= diaryfs_unlocked_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl		= diaryfs_compat_ioctl,
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+#include <linux/kthread.h>
+#include <linux/ioprio.h>
+
+/*
+ * Retention.
+ *
+ * A kthread per mount, running at idle I/O priority, drops history older
+ * than the retention window.  Segments cover a bounded stretch of time
+ * (see diaryfs_log_append), so most of the time a whole segment has
+ * expired and goes with a single unlink.  A segment that is only partly
+ * expired has its expired prefix punched out instead.  Either way the
+ * chunk references held by the dropped records are given back, and the
+ * per-file indexes lose the entries that pointed at them.
+ *
+ * The collector never touches the active segment and only holds
+ * log->seg_lock long enough to pick a segment, so writers never wait
+ * for it.  A segment's header is updated (and synced) before any chunk
+ * reference is dropped, so a crash can leak chunks but never drop a
+ * reference twice.
+ */
+
+/* give back the chunk references of records in [start, end) of @file */
+static int diaryfs_gc_put_refs(struct diaryfs_sb_info *sbi, struct file *file,
+		loff_t start, loff_t end)
+{
+	struct diaryfs_cursor cur;
+	struct diaryfs_rec *rec;
+	loff_t pos;
+	int err;
+
+	err = diaryfs_cursor_init(&cur, file, start, end);
+	if (err)
+		return err;
+	while ((rec = diaryfs_cursor_next(&cur, &pos)) && !IS_ERR(rec)) {
+		struct diaryfs_chunk_ref refs[DIARYFS_VERSION_REFS];
+		unsigned int i, nr;
+
+		if (le16_to_cpu(rec->type) != DIARYFS_REC_CHUNKS ||
+		    diaryfs_rec_payload(rec, refs, sizeof(refs)))
+			continue;
+		nr = le32_to_cpu(rec->raw_len) / sizeof(refs[0]);
+		for (i = 0; i < nr; i++)
+			diaryfs_chunk_put(sbi, &refs[i]);
+		cond_resched();
+	}
+	diaryfs_cursor_release(&cur);
+	return PTR_ERR_OR_ZERO(rec);
+}
+
+/*
+ * Find where the expired prefix of @file ends: the end of the last record
+ * before the first one at or after @cutoff.  Records are appended in
+ * nearly, not strictly, time order, so this stops early rather than skip
+ * over a live record.  Also reports the time of the first record kept.
+ */
+static int diaryfs_gc_find_cut(struct file *file, struct diaryfs_seg *seg,
+		u64 cutoff, loff_t *cut, u64 *min_time)
+{
+	struct diaryfs_cursor cur;
+	struct diaryfs_rec *rec;
+	loff_t pos;
+	int err;
+
+	*cut = seg->start;
+	*min_time = seg->min_time;
+	err = diaryfs_cursor_init(&cur, file, seg->start, seg->size);
+	if (err)
+		return err;
+	while ((rec = diaryfs_cursor_next(&cur, &pos)) && !IS_ERR(rec)) {
+		if (le64_to_cpu(rec->time) >= cutoff) {
+			*min_time = le64_to_cpu(rec->time);
+			break;
+		}
+		*cut = pos + le32_to_cpu(rec->rec_len);
+	}
+	diaryfs_cursor_release(&cur);
+	return PTR_ERR_OR_ZERO(rec);
+}
+
+/*
+ * Drop the records of @seg older than @cutoff.  Returns 1 if none could
+ * be dropped after all.
+ */
+static int diaryfs_gc_segment(struct diaryfs_sb_info *sbi,
+		struct diaryfs_seg *seg, u64 cutoff)
+{
+	struct diaryfs_log *log = &sbi->log;
+	char name[DIARYFS_SEG_NAME_LEN];
+	struct diaryfs_seg new;
+	struct file *file;
+	loff_t start = seg->start;
+	bool whole = seg->max_time < cutoff;
+	int err;
+
+	file = diaryfs_seg_open(sbi, seg->seq, O_RDWR);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	/* the collector owns the summaries of segments that aren't active */
+	new = *seg;
+	if (whole) {
+		new.start = seg->size;
+	} else {
+		err = diaryfs_gc_find_cut(file, seg, cutoff, &new.start,
+				&new.min_time);
+		if (err)
+			goto out;
+		if (new.start == start) {
+			/* a live record comes first; don't pick this again */
+			spin_lock(&log->seg_lock);
+			seg->min_time = new.min_time;
+			spin_unlock(&log->seg_lock);
+			err = 1;
+			goto out;
+		}
+	}
+
+	err = diaryfs_seg_write_hdr(file, &new);
+	if (!err)
+		err = vfs_fsync(file, 1);
+	if (err)
+		goto out;
+	spin_lock(&log->seg_lock);
+	seg->start = new.start;
+	seg->min_time = new.min_time;
+	spin_unlock(&log->seg_lock);
+
+	if (seg->flags & DIARYFS_SEG_CHUNKS)
+		diaryfs_gc_put_refs(sbi, file, start, new.start);
+
+	if (whole) {
+		fput(file);
+		file = NULL;
+		diaryfs_seg_name(name, seg->seq);
+		err = diaryfs_meta_unlink(&log->dir, name);
+		if (err && err != -ENOENT)
+			goto out;
+		spin_lock(&log->seg_lock);
+		list_del(&seg->list);
+		spin_unlock(&log->seg_lock);
+		kfree(seg);
+		err = 0;
+	} else {
+		/* whole pages below the cut hold nothing live any more */
+		loff_t lo = round_down(start, PAGE_SIZE);
+		loff_t hi = round_down(new.start, PAGE_SIZE);
+
+		if (hi > lo)
+			vfs_fallocate(file, FALLOC_FL_PUNCH_HOLE |
+					FALLOC_FL_KEEP_SIZE, lo, hi - lo);
+	}
+out:
+	if (file)
+		fput(file);
+	return err;
+}
+
+/* pick the next segment with something to expire, NULL if none */
+static struct diaryfs_seg *diaryfs_gc_next(struct diaryfs_sb_info *sbi,
+		u64 cutoff, u64 after)
+{
+	struct diaryfs_log *log = &sbi->log;
+	struct diaryfs_seg *seg, *found = NULL;
+
+	spin_lock(&log->seg_lock);
+	list_for_each_entry(seg, &log->segs, list) {
+		/* the newest segment is the active one */
+		if (list_is_last(&seg->list, &log->segs))
+			break;
+		if (seg->seq <= after)
+			continue;
+		if (seg->min_time < cutoff && seg->start < seg->size) {
+			found = seg;
+			break;
+		}
+		if (seg->start >= seg->size) {
+			found = seg;
+			break;
+		}
+	}
+	spin_unlock(&log->seg_lock);
+	return found;
+}
+
+/* the LSN of the oldest record still in the log */
+static u64 diaryfs_gc_oldest(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_log *log = &sbi->log;
+	struct diaryfs_seg *seg;
+	u64 lsn = 0;
+
+	spin_lock(&log->seg_lock);
+	seg = list_first_entry_or_null(&log->segs, struct diaryfs_seg, list);
+	if (seg)
+		lsn = DIARYFS_LSN(seg->seq, seg->start);
+	spin_unlock(&log->seg_lock);
+	return lsn;
+}
+
+static void diaryfs_gc_run(struct diaryfs_sb_info *sbi)
+{
+	u64 now = ktime_get_real_ns();
+	u64 cutoff, after = 0;
+	struct diaryfs_seg *seg;
+	bool dropped = false;
+	int err;
+
+	if (!sbi->retention || now < sbi->retention * NSEC_PER_SEC)
+		return;
+	cutoff = now - sbi->retention * NSEC_PER_SEC;
+
+	while (!kthread_should_stop() &&
+	       (seg = diaryfs_gc_next(sbi, cutoff, after))) {
+		after = seg->seq;
+		err = diaryfs_gc_segment(sbi, seg, cutoff);
+		/* cached versions may rest on what was dropped */
+		if (!err) {
+			diaryfs_hcache_clear(sbi);
+			dropped = true;
+		}
+		if (err < 0)
+			printk_ratelimited(KERN_WARNING "diaryfs: retention "
+					"failed on segment %016llx: %d\n",
+					after, err);
+		cond_resched();
+	}
+
+	if (dropped && !kthread_should_stop()) {
+		err = diaryfs_index_prune(sbi, diaryfs_gc_oldest(sbi));
+		if (err)
+			printk_ratelimited(KERN_WARNING "diaryfs: retention "
+					"failed on indexes: %d\n", err);
+	}
+}
+
+static int diaryfs_gc_thread(void *data)
+{
+	struct diaryfs_sb_info *sbi = data;
+
+	set_task_ioprio(current, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+	set_user_nice(current, MAX_NICE);
+
+	while (!kthread_should_stop()) {
+		diaryfs_gc_run(sbi);
+		schedule_timeout_interruptible(DIARYFS_GC_INTERVAL);
+	}
+	return 0;
+}
+
+int diaryfs_gc_start(struct diaryfs_sb_info *sbi)
+{
+	struct task_struct *task;
+
+	/* nothing can be dropped from a read-only mount */
+	if (sbi->read_only)
+		return 0;
+	task = kthread_run(diaryfs_gc_thread, sbi, "diaryfs-gc");
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+	sbi->gc_task = task;
+	return 0;
+}
+
+void diaryfs_gc_stop(struct diaryfs_sb_info *sbi)
+{
+	if (sbi->gc_task) {
+		kthread_stop(sbi->gc_task);
+		sbi->gc_task = NULL;
+	}
+}
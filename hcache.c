@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+
+/*
+ * Cache of rebuilt historical pages.
+ *
+ * Rebuilding a page of an old version means reading and undoing every
+ * record of it since, so pages that have been rebuilt once are kept,
+ * looked up by lower inode, point in history and page index.  A page is
+ * only cached once the read that built it found a write after its point
+ * in history: from then on that version can't change any more.  Entries
+ * live on an LRU list, capped per mount and given back to the VM by a
+ * shrinker under memory pressure.
+ */
+
+static struct kmem_cache *diaryfs_hpage_cachep;
+
+int diaryfs_init_hpage_cache(void)
+{
+	diaryfs_hpage_cachep =
+		kmem_cache_create("diaryfs_hist_page",
+				  sizeof(struct diaryfs_hpage),
+				  0, SLAB_RECLAIM_ACCOUNT, NULL);
+
+	return diaryfs_hpage_cachep ? 0 : -ENOMEM;
+}
+
+void diaryfs_destroy_hpage_cache(void)
+{
+	if (diaryfs_hpage_cachep)
+		kmem_cache_destroy(diaryfs_hpage_cachep);
+}
+
+static inline struct hlist_head *diaryfs_hcache_bucket(
+		struct diaryfs_hcache *hc, unsigned long ino,
+		const struct diaryfs_when *when, pgoff_t index)
+{
+	u64 h = ino;
+
+	h = h * 31 + when->time;
+	h = h * 31 + when->seq;
+	h = h * 31 + index;
+	return &hc->table[hash_64(h, DIARYFS_HCACHE_BITS)];
+}
+
+/* caller holds hc->lock */
+static struct diaryfs_hpage *diaryfs_hcache_find(struct diaryfs_hcache *hc,
+		struct inode *lower_inode, const struct diaryfs_when *when,
+		pgoff_t index)
+{
+	struct diaryfs_hpage *hp;
+
+	hlist_for_each_entry(hp, diaryfs_hcache_bucket(hc, lower_inode->i_ino,
+			when, index), hash) {
+		if (hp->ino == lower_inode->i_ino &&
+		    hp->generation == lower_inode->i_generation &&
+		    hp->time == when->time && hp->seq == when->seq &&
+		    hp->index == index)
+			return hp;
+	}
+	return NULL;
+}
+
+/* caller holds hc->lock */
+static void diaryfs_hcache_drop(struct diaryfs_hcache *hc,
+		struct diaryfs_hpage *hp)
+{
+	hlist_del(&hp->hash);
+	list_del(&hp->lru);
+	hc->nr--;
+	__free_page(hp->page);
+	kmem_cache_free(diaryfs_hpage_cachep, hp);
+}
+
+/* drop up to @nr entries, oldest first; caller holds hc->lock */
+static unsigned long diaryfs_hcache_trim(struct diaryfs_hcache *hc,
+		unsigned long nr)
+{
+	unsigned long freed = 0;
+
+	while (freed < nr && !list_empty(&hc->lru)) {
+		diaryfs_hcache_drop(hc, list_last_entry(&hc->lru,
+				struct diaryfs_hpage, lru));
+		freed++;
+	}
+	return freed;
+}
+
+/*
+ * diaryfs_hcache_get - read part of a cached historical page
+ *
+ * Copies @len bytes from @from within page @index of @lower_inode as of
+ * @when into @buf and sets *@sizep to the file's size then.  Returns
+ * false, having touched nothing, if the page isn't cached.
+ */
+bool diaryfs_hcache_get(struct diaryfs_sb_info *sbi,
+		struct inode *lower_inode, const struct diaryfs_when *when,
+		pgoff_t index, void *buf, unsigned int from, unsigned int len,
+		loff_t *sizep)
+{
+	struct diaryfs_hcache *hc = &sbi->hcache;
+	struct diaryfs_hpage *hp;
+
+	spin_lock(&hc->lock);
+	hp = diaryfs_hcache_find(hc, lower_inode, when, index);
+	if (!hp) {
+		hc->misses++;
+		spin_unlock(&hc->lock);
+		return false;
+	}
+	hc->hits++;
+	list_move(&hp->lru, &hc->lru);
+	memcpy(buf, page_address(hp->page) + from, len);
+	*sizep = hp->size;
+	spin_unlock(&hc->lock);
+	return true;
+}
+
+/* remember page @index of @lower_inode as of @when, in a file of @size */
+void diaryfs_hcache_put(struct diaryfs_sb_info *sbi,
+		struct inode *lower_inode, const struct diaryfs_when *when,
+		pgoff_t index, const void *data, loff_t size)
+{
+	struct diaryfs_hcache *hc = &sbi->hcache;
+	struct diaryfs_hpage *hp;
+
+	if (!diaryfs_hist_cache)
+		return;
+
+	/* the cache is only worth so much; don't try hard */
+	hp = kmem_cache_alloc(diaryfs_hpage_cachep, GFP_NOFS | __GFP_NOWARN);
+	if (!hp)
+		return;
+	hp->page = alloc_page(GFP_NOFS | __GFP_NOWARN);
+	if (!hp->page) {
+		kmem_cache_free(diaryfs_hpage_cachep, hp);
+		return;
+	}
+	memcpy(page_address(hp->page), data, PAGE_SIZE);
+	hp->ino = lower_inode->i_ino;
+	hp->generation = lower_inode->i_generation;
+	hp->time = when->time;
+	hp->seq = when->seq;
+	hp->index = index;
+	hp->size = size;
+
+	spin_lock(&hc->lock);
+	if (diaryfs_hcache_find(hc, lower_inode, when, index)) {
+		/* someone else rebuilt it too */
+		spin_unlock(&hc->lock);
+		__free_page(hp->page);
+		kmem_cache_free(diaryfs_hpage_cachep, hp);
+		return;
+	}
+	hlist_add_head(&hp->hash, diaryfs_hcache_bucket(hc, hp->ino, when,
+			index));
+	list_add(&hp->lru, &hc->lru);
+	hc->nr++;
+	if (hc->nr > diaryfs_hist_cache)
+		diaryfs_hcache_trim(hc, hc->nr - diaryfs_hist_cache);
+	spin_unlock(&hc->lock);
+}
+
+/* forget everything, e.g. once retention has dropped some history */
+void diaryfs_hcache_clear(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_hcache *hc = &sbi->hcache;
+
+	spin_lock(&hc->lock);
+	diaryfs_hcache_trim(hc, hc->nr);
+	spin_unlock(&hc->lock);
+}
+
+static unsigned long diaryfs_hcache_count(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	struct diaryfs_hcache *hc =
+		container_of(shrink, struct diaryfs_hcache, shrinker);
+
+	return READ_ONCE(hc->nr);
+}
+
+static unsigned long diaryfs_hcache_scan(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	struct diaryfs_hcache *hc =
+		container_of(shrink, struct diaryfs_hcache, shrinker);
+	unsigned long freed;
+
+	spin_lock(&hc->lock);
+	freed = diaryfs_hcache_trim(hc, sc->nr_to_scan);
+	spin_unlock(&hc->lock);
+	return freed;
+}
+
+int diaryfs_hcache_init(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_hcache *hc = &sbi->hcache;
+	unsigned int i;
+	int err;
+
+	spin_lock_init(&hc->lock);
+	INIT_LIST_HEAD(&hc->lru);
+	hc->table = kmalloc_array(1 << DIARYFS_HCACHE_BITS,
+			sizeof(*hc->table), GFP_KERNEL);
+	if (!hc->table)
+		return -ENOMEM;
+	for (i = 0; i < 1 << DIARYFS_HCACHE_BITS; i++)
+		INIT_HLIST_HEAD(&hc->table[i]);
+
+	hc->shrinker.count_objects = diaryfs_hcache_count;
+	hc->shrinker.scan_objects = diaryfs_hcache_scan;
+	hc->shrinker.seeks = DEFAULT_SEEKS;
+	err = register_shrinker(&hc->shrinker);
+	if (err) {
+		kfree(hc->table);
+		hc->table = NULL;
+	}
+	return err;
+}
+
+void diaryfs_hcache_destroy(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_hcache *hc = &sbi->hcache;
+
+	if (!hc->table)
+		return;
+	unregister_shrinker(&hc->shrinker);
+	diaryfs_hcache_clear(sbi);
+	kfree(hc->table);
+	hc->table = NULL;
+}
@@ -0,0 +1,594 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+#include "diaryfs_trace.h"
+#include <linux/sort.h>
+
+/*
+ * Point-in-time reads.
+ *
+ * Version records hold what a write replaced, so an old version of a range
+ * is rebuilt backwards: start from the live bytes and undo, newest first,
+ * every write made after the point asked for.  Every record covers part of
+ * a single page, so only records that touch the pages of the requested
+ * range are ever decoded, however long the file's history is elsewhere.
+ * They are found through the file's version index (index.c), and only
+ * history older than the index by reading the log.  A page's history is
+ * checkpointed now and then (version.c); a read starts from the oldest
+ * checkpoint after its point instead of undoing everything since.
+ *
+ * The live bytes and the log are snapshotted together under i_mutex, once
+ * every write already made to the file has been versioned and flushed.
+ * Records logged after that point describe writes the snapshot doesn't
+ * hold yet and are ignored.
+ *
+ * Pages nothing has been written to since are read straight through the
+ * lower file's page cache and never copied anywhere else: only pages that
+ * had to be rebuilt go into the historical page cache (hcache.c), and a
+ * read finds the ones already there before undoing anything.
+ */
+
+/* a segment as it was when the read started */
+struct diaryfs_hist_seg {
+	u64 seq;
+	loff_t start;
+	loff_t size;
+};
+
+/*
+ * Add the record at @lsn, for the page holding @off, to @hist.  Records are
+ * added oldest first; once a page has a checkpoint, what was logged for it
+ * after that doesn't need undoing.
+ */
+int diaryfs_hist_add(struct diaryfs_hist *hist, u64 lsn, loff_t off,
+		bool ckpt)
+{
+	unsigned long page = (off - hist->lo) >> PAGE_SHIFT;
+
+	if (page < DIARYFS_HISTORY_PAGES) {
+		if (test_bit(page, hist->sealed))
+			return 0;
+		if (ckpt)
+			__set_bit(page, hist->sealed);
+		__set_bit(page, hist->changed);
+	}
+	if (hist->nr == hist->max) {
+		unsigned int max = max(2 * hist->max, 64U);
+		struct diaryfs_hist_ent *ents = krealloc(hist->ents,
+				max * sizeof(*ents), GFP_KERNEL);
+
+		if (!ents)
+			return -ENOMEM;
+		hist->ents = ents;
+		hist->max = max;
+	}
+	hist->ents[hist->nr].lsn = lsn;
+	hist->ents[hist->nr].off = off;
+	hist->nr++;
+	return 0;
+}
+
+static int diaryfs_lsn_cmp_desc(const void *a, const void *b)
+{
+	u64 x = ((const struct diaryfs_hist_ent *)a)->lsn;
+	u64 y = ((const struct diaryfs_hist_ent *)b)->lsn;
+
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* copy the summaries of every segment that may hold records after @when */
+static struct diaryfs_hist_seg *diaryfs_hist_segs(struct diaryfs_sb_info *sbi,
+		const struct diaryfs_when *when, unsigned int *nrp)
+{
+	struct diaryfs_log *log = &sbi->log;
+	struct diaryfs_hist_seg *segs;
+	struct diaryfs_seg *seg;
+	unsigned int nr = 0, max = 0;
+
+	spin_lock(&log->seg_lock);
+	list_for_each_entry(seg, &log->segs, list)
+		max++;
+	spin_unlock(&log->seg_lock);
+
+	segs = kmalloc_array(max ? max : 1, sizeof(*segs), GFP_KERNEL);
+	if (!segs)
+		return ERR_PTR(-ENOMEM);
+
+	spin_lock(&log->seg_lock);
+	list_for_each_entry(seg, &log->segs, list) {
+		if (nr == max)
+			break;
+		if (!diaryfs_hist_after(when, seg->max_time, seg->max_seq) ||
+		    seg->start >= seg->size)
+			continue;
+		segs[nr].seq = seg->seq;
+		segs[nr].start = seg->start;
+		segs[nr].size = seg->size;
+		nr++;
+	}
+	spin_unlock(&log->seg_lock);
+	*nrp = nr;
+	return segs;
+}
+
+/*
+ * Find the records of lower inode @ino, logged in [@since, @limit), for
+ * writes after @when, by reading the log.  Keeps those touching [@lo, @hi)
+ * in @hist and sizes it from the first of all of them.
+ */
+static int diaryfs_hist_scan(struct diaryfs_sb_info *sbi, unsigned long ino,
+		const struct diaryfs_when *when, u64 since, u64 limit,
+		loff_t lo, loff_t hi, struct diaryfs_hist *hist)
+{
+	struct diaryfs_hist_seg *segs;
+	struct diaryfs_cursor cur;
+	struct diaryfs_rec *rec;
+	struct file *file;
+	unsigned int i, nr;
+	loff_t pos;
+	int err = 0;
+
+	segs = diaryfs_hist_segs(sbi, when, &nr);
+	if (IS_ERR(segs))
+		return PTR_ERR(segs);
+
+	for (i = 0; i < nr && !err; i++) {
+		if (DIARYFS_LSN(segs[i].seq, segs[i].start) >= limit)
+			break;
+		if (DIARYFS_LSN(segs[i].seq, segs[i].size) <= since)
+			continue;
+		file = diaryfs_seg_open(sbi, segs[i].seq, O_RDONLY);
+		if (IS_ERR(file)) {
+			/* expired since we looked */
+			err = PTR_ERR(file) == -ENOENT ? -ENODATA :
+				PTR_ERR(file);
+			break;
+		}
+		err = diaryfs_cursor_init(&cur, file, segs[i].start,
+				segs[i].size);
+		if (err) {
+			fput(file);
+			break;
+		}
+		while ((rec = diaryfs_cursor_next(&cur, &pos)) &&
+		       !IS_ERR(rec)) {
+			u64 lsn = DIARYFS_LSN(segs[i].seq, pos);
+			loff_t off = le64_to_cpu(rec->offset);
+
+			if (lsn >= limit)
+				break;
+			if (lsn < since || le64_to_cpu(rec->ino) != ino ||
+			    !diaryfs_hist_after(when, le64_to_cpu(rec->time),
+					le64_to_cpu(rec->seq)))
+				continue;
+			if (!hist->sized) {
+				hist->size = le64_to_cpu(rec->old_size);
+				hist->sized = true;
+			}
+			if (off < hi && off + le32_to_cpu(rec->length) > lo &&
+			    diaryfs_hist_wanted(hist, le64_to_cpu(rec->time),
+					le64_to_cpu(rec->seq))) {
+				err = diaryfs_hist_add(hist, lsn, off,
+						le16_to_cpu(rec->type) ==
+						DIARYFS_REC_CKPT);
+				if (err)
+					break;
+			}
+		}
+		if (IS_ERR(rec) && !err)
+			err = PTR_ERR(rec);
+		diaryfs_cursor_release(&cur);
+		fput(file);
+		cond_resched();
+	}
+	kfree(segs);
+	return err;
+}
+
+/*
+ * Undo one record over @win, which holds file bytes [@lo, @hi).  @scratch
+ * is two pages: one for the decoded payload, one for the delta base.
+ */
+static int diaryfs_hist_undo(struct diaryfs_sb_info *sbi,
+		const struct diaryfs_rec *rec, u8 *win, loff_t lo, loff_t hi,
+		u8 *scratch)
+{
+	loff_t off = le64_to_cpu(rec->offset);
+	size_t len = le32_to_cpu(rec->length);
+	size_t raw_len = le32_to_cpu(rec->raw_len);
+	u8 *dst = win + (off - lo);
+	u8 *payload = scratch, *base = scratch + PAGE_SIZE;
+	size_t old_len = 0;
+	ssize_t tgt_len;
+	unsigned int i;
+	int err;
+
+	/* records never cross a page, so one touching the window is inside */
+	if (off < lo || off + len > hi || len > PAGE_SIZE)
+		return -EUCLEAN;
+
+	switch (le16_to_cpu(rec->type)) {
+	case DIARYFS_REC_CKPT:
+		/* start over from the page as it was then */
+	case DIARYFS_REC_DATA:
+		if (raw_len > len)
+			return -EUCLEAN;
+		err = diaryfs_rec_payload(rec, dst, len);
+		if (err)
+			return err;
+		old_len = raw_len;
+		break;
+	case DIARYFS_REC_CHUNKS: {
+		struct diaryfs_chunk_ref *refs =
+			(struct diaryfs_chunk_ref *)payload;
+
+		err = diaryfs_rec_payload(rec, payload, PAGE_SIZE);
+		if (err)
+			return err;
+		for (i = 0; i < raw_len / sizeof(*refs); i++) {
+			size_t n = le32_to_cpu(refs[i].len);
+
+			if (old_len + n > len)
+				return -EUCLEAN;
+			err = diaryfs_chunk_read(sbi, &refs[i], dst + old_len);
+			if (err)
+				return err;
+			old_len += n;
+		}
+		break;
+	}
+	case DIARYFS_REC_DELTA:
+		err = diaryfs_rec_payload(rec, payload, PAGE_SIZE);
+		if (err)
+			return err;
+		tgt_len = diaryfs_delta_target_len(payload, raw_len);
+		if (tgt_len < 0 || tgt_len > len)
+			return -EUCLEAN;
+		/* the delta is against the bytes the write left */
+		memcpy(base, dst, len);
+		err = diaryfs_delta_apply(base, len, payload, raw_len, dst, 0,
+				tgt_len);
+		if (err)
+			return err;
+		old_len = tgt_len;
+		break;
+	default:
+		return -EUCLEAN;
+	}
+
+	/* the rest of the range was past the end of the file */
+	memset(dst + old_len, 0, len - old_len);
+	return 0;
+}
+
+/*
+ * Undo the records in @hist, newest first.  Index entries are only hints,
+ * so a record that turns out to be some other file's is passed over.
+ */
+static int diaryfs_hist_replay(struct diaryfs_sb_info *sbi, unsigned long ino,
+		struct diaryfs_hist *hist, u8 *win, loff_t lo, loff_t hi)
+{
+	struct file *file = NULL;
+	u64 file_seq = 0;
+	u8 *rbuf, *scratch;
+	unsigned int i;
+	int err = 0;
+
+	rbuf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+	scratch = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+	if (!rbuf || !scratch) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	sort(hist->ents, hist->nr, sizeof(*hist->ents), diaryfs_lsn_cmp_desc,
+			NULL);
+	for (i = 0; i < hist->nr; i++) {
+		u64 seq = DIARYFS_LSN_SEQ(hist->ents[i].lsn);
+
+		if (!file || seq != file_seq) {
+			if (file)
+				fput(file);
+			file = diaryfs_seg_open(sbi, seq, O_RDONLY);
+			if (IS_ERR(file)) {
+				err = PTR_ERR(file) == -ENOENT ? -ENODATA :
+					PTR_ERR(file);
+				file = NULL;
+				goto out;
+			}
+			file_seq = seq;
+		}
+		err = diaryfs_log_read(file, DIARYFS_LSN_OFF(hist->ents[i].lsn),
+				rbuf, 2 * PAGE_SIZE);
+		if (err < 0)
+			goto out;
+		err = 0;
+		if (le64_to_cpu(((struct diaryfs_rec *)rbuf)->ino) != ino)
+			continue;
+		err = diaryfs_hist_undo(sbi, (struct diaryfs_rec *)rbuf, win,
+				lo, hi, scratch);
+		if (err)
+			goto out;
+		cond_resched();
+	}
+out:
+	if (file)
+		fput(file);
+	kfree(scratch);
+	kfree(rbuf);
+	return err;
+}
+
+/* read [@off, @off + @len) as of @when from the page cache; -ENOENT on a miss */
+static ssize_t diaryfs_hist_cached(struct diaryfs_sb_info *sbi,
+		struct inode *lower_inode, const struct diaryfs_when *when,
+		loff_t off, size_t len, u8 *buf, loff_t *sizep)
+{
+	loff_t pos = off, size = 0;
+	size_t done = 0;
+
+	while (done < len) {
+		unsigned int from = pos & ~PAGE_MASK;
+		unsigned int n = min_t(size_t, len - done, PAGE_SIZE - from);
+
+		if (!diaryfs_hcache_get(sbi, lower_inode, when,
+				pos >> PAGE_SHIFT, buf + done, from, n, &size))
+			return -ENOENT;
+		done += n;
+		pos += n;
+	}
+	*sizep = size;
+	return off < size ? min_t(loff_t, len, size - off) : 0;
+}
+
+/*
+ * Fill the changed pages of @win that are in the page cache as of @when,
+ * and drop their records from @hist: they need no undoing.  Marks the
+ * pages filled in @cached.
+ */
+static void diaryfs_hist_reuse(struct diaryfs_sb_info *sbi,
+		struct inode *lower_inode, const struct diaryfs_when *when,
+		struct diaryfs_hist *hist, u8 *win, loff_t lo, loff_t hi,
+		unsigned long *cached)
+{
+	unsigned long page, nr = (hi - lo) >> PAGE_SHIFT;
+	unsigned int i, j;
+	loff_t size;
+
+	for_each_set_bit(page, hist->changed, nr) {
+		if (diaryfs_hcache_get(sbi, lower_inode, when,
+				(lo >> PAGE_SHIFT) + page,
+				win + (page << PAGE_SHIFT), 0, PAGE_SIZE,
+				&size))
+			__set_bit(page, cached);
+	}
+	if (bitmap_empty(cached, nr))
+		return;
+
+	for (i = j = 0; i < hist->nr; i++) {
+		page = (hist->ents[i].off - lo) >> PAGE_SHIFT;
+		if (page < nr && test_bit(page, cached))
+			continue;
+		hist->ents[j++] = hist->ents[i];
+	}
+	hist->nr = j;
+}
+
+/* has retention dropped what a read at @when would need? */
+bool diaryfs_hist_expired(struct diaryfs_sb_info *sbi,
+		const struct diaryfs_when *when)
+{
+	if (when->seq || !sbi->retention)
+		return false;
+	return when->time + sbi->retention * NSEC_PER_SEC <
+		ktime_get_real_ns();
+}
+
+/*
+ * Get every write already made to @inode into the log, and return the
+ * LSN the log ends at in *@limit.  Caller holds i_mutex.
+ */
+static int diaryfs_hist_settle(struct inode *inode, u64 *limit)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(inode->i_sb);
+	int err;
+
+	inode_dio_wait(inode);
+	err = diaryfs_vq_flush_inode(inode);
+	if (!err)
+		err = diaryfs_log_flush(sbi);
+	if (!err)
+		*limit = diaryfs_log_lsn(sbi);
+	return err;
+}
+
+/* collect the records of @inode below @limit after @when, in [@lo, @hi) */
+static int diaryfs_hist_collect(struct inode *inode,
+		const struct diaryfs_when *when, u64 limit, loff_t lo, loff_t hi,
+		struct diaryfs_hist *hist)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(inode->i_sb);
+	unsigned long ino = diaryfs_lower_inode(inode)->i_ino;
+	u64 since, unindexed;
+	int err = 0;
+
+	/* records the index doesn't have, then the indexed ones */
+	unindexed = min(limit, diaryfs_index_unindexed(inode, &since));
+	if (unindexed > since)
+		err = diaryfs_hist_scan(sbi, ino, when, since, unindexed, lo,
+				hi, hist);
+	if (!err)
+		err = diaryfs_index_lookup(inode, when, limit, lo, hi, hist);
+	return err;
+}
+
+/*
+ * diaryfs_history_read - read part of a file as it was at @when
+ *
+ * @inode is the live diaryfs inode, whose writers we have to hold off for
+ * the snapshot, and @lower_file is open for reading on its lower inode.
+ * Fills @buf with up to @len bytes from @off as of @when and sets *@sizep
+ * to the file's size then; with @len 0 only the size is looked up and
+ * @lower_file may be NULL.  Returns the number of bytes read, 0 past the
+ * end of the file, or -ENODATA if retention has already dropped the
+ * history needed.  At most DIARYFS_HISTORY_MAX bytes are read at once.
+ */
+ssize_t diaryfs_history_read(struct inode *inode, struct file *lower_file,
+		const struct diaryfs_when *when, loff_t off, size_t len,
+		void *buf, loff_t *sizep)
+{
+	struct inode *lower_inode = diaryfs_lower_inode(inode);
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(inode->i_sb);
+	struct diaryfs_hist hist = { NULL };
+	DECLARE_BITMAP(cached, DIARYFS_HISTORY_PAGES);
+	u64 start = diaryfs_trace_start(diaryfs_history_read);
+	unsigned long page;
+	loff_t lo, hi, size;
+	u64 limit;
+	ssize_t ret;
+	u8 *win;
+
+	if (off < 0)
+		return -EINVAL;
+	len = min_t(size_t, len, DIARYFS_HISTORY_MAX);
+	if (diaryfs_hist_expired(sbi, when))
+		return -ENODATA;
+
+	if (len) {
+		ret = diaryfs_hist_cached(sbi, lower_inode, when, off, len,
+				buf, sizep);
+		if (ret != -ENOENT) {
+			trace_diaryfs_history_read(inode, when, off, len, 0,
+					ret, start);
+			return ret;
+		}
+	}
+
+	lo = round_down(off, PAGE_SIZE);
+	hi = round_up(off + len, PAGE_SIZE);
+	hist.lo = lo;
+	atomic_inc(&DIARYFS_I(inode)->hist_reads);
+	win = vzalloc(max_t(loff_t, hi - lo, PAGE_SIZE));
+	if (!win)
+		return -ENOMEM;
+
+	/* the live bytes, and the log up to the same point */
+	mutex_lock(&inode->i_mutex);
+	ret = diaryfs_hist_settle(inode, &limit);
+	if (ret) {
+		mutex_unlock(&inode->i_mutex);
+		goto out;
+	}
+	size = i_size_read(lower_inode);
+	if (min(size, hi) > lo)
+		ret = kernel_read(lower_file, lo, win, min(size, hi) - lo);
+	mutex_unlock(&inode->i_mutex);
+	if (ret < 0)
+		goto out;
+
+	ret = diaryfs_hist_collect(inode, when, limit, lo, hi, &hist);
+	if (ret)
+		goto out;
+	bitmap_zero(cached, DIARYFS_HISTORY_PAGES);
+	diaryfs_hist_reuse(sbi, lower_inode, when, &hist, win, lo, hi, cached);
+	ret = diaryfs_hist_replay(sbi, lower_inode->i_ino, &hist, win, lo, hi);
+	if (ret)
+		goto out;
+
+	if (hist.sized) {
+		/*
+		 * A later write is on record, so this version is final.  Keep
+		 * the pages we rebuilt; the rest are the live file's.
+		 */
+		size = hist.size;
+		for_each_set_bit(page, hist.changed, (hi - lo) >> PAGE_SHIFT) {
+			if (test_bit(page, cached))
+				continue;
+			diaryfs_hcache_put(sbi, lower_inode, when,
+					(lo >> PAGE_SHIFT) + page,
+					win + (page << PAGE_SHIFT), size);
+		}
+	}
+	*sizep = size;
+	ret = off < size ? min_t(loff_t, len, size - off) : 0;
+	memcpy(buf, win + (off - lo), ret);
+out:
+	trace_diaryfs_history_read(inode, when, off, len, hist.nr, ret, start);
+	kfree(hist.ents);
+	vfree(win);
+	return ret;
+}
+
+/*
+ * diaryfs_history_changes - what has been written to a file since @when
+ *
+ * Fills @hist with a record for every write to @inode after @when, made
+ * before the call and, if @until is given, not after it; each entry's
+ * offset says where it applies.  @hist is sized unless nothing has been
+ * written since @when.  The caller frees hist->ents.
+ */
+int diaryfs_history_changes(struct inode *inode,
+		const struct diaryfs_when *when, const struct diaryfs_when *until,
+		struct diaryfs_hist *hist)
+{
+	u64 limit;
+	int err;
+
+	if (diaryfs_hist_expired(DIARYFS_SB(inode->i_sb), when))
+		return -ENODATA;
+
+	mutex_lock(&inode->i_mutex);
+	err = diaryfs_hist_settle(inode, &limit);
+	mutex_unlock(&inode->i_mutex);
+	if (err)
+		return err;
+
+	hist->lo = 0;
+	hist->until = until;
+	return diaryfs_hist_collect(inode, when, limit, 0, LLONG_MAX, hist);
+}
+
+static int diaryfs_off_cmp(const void *a, const void *b)
+{
+	loff_t x = ((const struct diaryfs_hist_ent *)a)->off;
+	loff_t y = ((const struct diaryfs_hist_ent *)b)->off;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* order @hist by where its records apply, for diaryfs_hist_run */
+void diaryfs_hist_sort_off(struct diaryfs_hist *hist)
+{
+	sort(hist->ents, hist->nr, sizeof(*hist->ents), diaryfs_off_cmp, NULL);
+}
+
+/*
+ * The run of changed pages starting at entry @i of @hist, no longer than a
+ * history read: [*@start, *@end).  Returns the entry after it.
+ */
+unsigned int diaryfs_hist_run(const struct diaryfs_hist *hist,
+		unsigned int i, loff_t *start, loff_t *end)
+{
+	loff_t page;
+
+	*start = round_down(hist->ents[i].off, PAGE_SIZE);
+	*end = *start + PAGE_SIZE;
+	for (i++; i < hist->nr; i++) {
+		page = round_down(hist->ents[i].off, PAGE_SIZE);
+		if (page > *end || page + PAGE_SIZE - *start > DIARYFS_HISTORY_MAX)
+			break;
+		*end = max(*end, page + PAGE_SIZE);
+	}
+	return i;
+}
@@ -0,0 +1,777 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+#include <linux/kthread.h>
+
+/*
+ * Per-file version index.
+ *
+ * The log is ordered by when records were written, for every file at
+ * once, so finding the records of one file means reading all of it.  Each
+ * file therefore also gets an index of its own records: the versioning
+ * worker appends an entry for every record it logs, in write order, to a
+ * file of fixed-size pages under .diaryfs/index.  Every page carries a
+ * summary of its entries (newest write, file range covered), so a
+ * point-in-time read binary searches the pages for the first write after
+ * the time asked for and only reads the entries of later pages that touch
+ * the range it wants.
+ *
+ * Indexes only exist from the point the mount started keeping them (the
+ * LSN in the "base" file); records older than that are still found by
+ * scanning the log.  An index whose header doesn't match its lower inode
+ * belongs to a deleted file whose inode number was reused, and is started
+ * over, with what the log holds for that inode number so far disowned.
+ * A damaged one is started over too, but the log below the restart point
+ * is scanned instead, and until the restart it all is.
+ *
+ * An index goes when its file does.  Retention punches out entry pages
+ * whose records have all expired; a reader sees the hole as an empty page.
+ *
+ * Entries are written right behind their records and are only hints: a
+ * reader checks every record it is pointed at.  Indexes written to are
+ * kept on a list, with a reference, until sync(2) makes them durable along
+ * with the log, even if their inodes are evicted first.
+ */
+
+static void diaryfs_index_name(char *name, unsigned long ino)
+{
+	snprintf(name, DIARYFS_SEG_NAME_LEN, "%016lx", ino);
+}
+
+static int diaryfs_index_read_hdr(struct file *file,
+		struct diaryfs_vidx_hdr *hdr)
+{
+	int ret = kernel_read(file, 0, (char *)hdr, sizeof(*hdr));
+	u32 crc;
+
+	if (ret < 0)
+		return ret;
+	if (!ret)
+		return -ENODATA;
+	if (ret != sizeof(*hdr) || le32_to_cpu(hdr->magic) != DIARYFS_INDEX_MAGIC ||
+	    le32_to_cpu(hdr->version) != DIARYFS_INDEX_VERSION)
+		return -EUCLEAN;
+	crc = le32_to_cpu(hdr->crc);
+	hdr->crc = 0;
+	if (crc32c(~0, hdr, sizeof(*hdr)) != crc)
+		return -EUCLEAN;
+	return 0;
+}
+
+/*
+ * Start @file over as the index of @lower_inode, complete from @base on,
+ * with no records of it before @since.
+ */
+static int diaryfs_index_reset(struct file *file, struct inode *lower_inode,
+		u64 since, u64 base)
+{
+	struct diaryfs_vidx_hdr *hdr;
+	ssize_t ret;
+	int err;
+
+	err = vfs_truncate(&file->f_path, 0);
+	if (err)
+		return err;
+	hdr = kzalloc(PAGE_SIZE, GFP_NOFS);
+	if (!hdr)
+		return -ENOMEM;
+	hdr->magic = cpu_to_le32(DIARYFS_INDEX_MAGIC);
+	hdr->version = cpu_to_le32(DIARYFS_INDEX_VERSION);
+	hdr->ino = cpu_to_le64(lower_inode->i_ino);
+	hdr->generation = cpu_to_le32(lower_inode->i_generation);
+	hdr->base = cpu_to_le64(base);
+	hdr->since = cpu_to_le64(since);
+	hdr->crc = cpu_to_le32(crc32c(~0, hdr, sizeof(*hdr)));
+	ret = kernel_write(file, (char *)hdr, PAGE_SIZE, 0);
+	kfree(hdr);
+	if (ret != PAGE_SIZE)
+		return ret < 0 ? ret : -EIO;
+	return 0;
+}
+
+/*
+ * Get the index of @inode, opening it on first use.  Readers get -ENOENT
+ * if there is none, -ESTALE if it belongs to an earlier file; the writer
+ * (@create) makes or restarts it.
+ */
+static struct file *diaryfs_index_get(struct inode *inode, bool create)
+{
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(inode->i_sb);
+	struct inode *lower_inode = diaryfs_lower_inode(inode);
+	char name[DIARYFS_SEG_NAME_LEN];
+	struct diaryfs_vidx_hdr hdr;
+	struct file *file, *old;
+	int err;
+
+	file = READ_ONCE(info->vindex);
+	if (file)
+		return file;
+	if (!sbi->index_dir.dentry)
+		return ERR_PTR(-ENOENT);
+
+	diaryfs_index_name(name, lower_inode->i_ino);
+	file = diaryfs_meta_open(&sbi->index_dir, name, sbi->read_only ?
+			O_RDONLY : O_RDWR | (create ? O_CREAT : 0));
+	if (IS_ERR(file))
+		return file;
+	err = diaryfs_index_read_hdr(file, &hdr);
+	if (!err && (le64_to_cpu(hdr.ino) != lower_inode->i_ino ||
+		     le32_to_cpu(hdr.generation) != lower_inode->i_generation))
+		err = -ESTALE;
+	if (err && create) {
+		u64 lsn = diaryfs_log_lsn(sbi);
+
+		/*
+		 * A new index holds everything since indexing started.  One
+		 * left by an earlier file is started over from here, and
+		 * older records of this inode number are ignored.  A damaged
+		 * one is started over from here too, but older records are
+		 * still this file's, and get found in the log.
+		 */
+		if (err == -ENODATA)
+			err = diaryfs_index_reset(file, lower_inode, 0,
+					sbi->index_base);
+		else if (err == -ESTALE)
+			err = diaryfs_index_reset(file, lower_inode, lsn, lsn);
+		else
+			err = diaryfs_index_reset(file, lower_inode, 0, lsn);
+	} else if (err == -ENODATA) {
+		err = -ENOENT;
+	}
+	if (err) {
+		fput(file);
+		return ERR_PTR(err);
+	}
+
+	old = cmpxchg(&info->vindex, NULL, file);
+	if (old) {
+		fput(file);
+		file = old;
+	}
+	return file;
+}
+
+/* read entry page @pos, or just its summary; a torn page reads as empty */
+static int diaryfs_index_read_page(struct file *file, loff_t pos,
+		struct diaryfs_vidx_page *pg, size_t len)
+{
+	int ret = kernel_read(file, pos, (char *)pg, len);
+
+	if (ret < 0)
+		return ret;
+	if (ret != len || le32_to_cpu(pg->magic) != DIARYFS_INDEX_MAGIC ||
+	    le32_to_cpu(pg->nr) > DIARYFS_INDEX_ENTS)
+		memset(pg, 0, sizeof(*pg));
+	return 0;
+}
+
+static void diaryfs_index_init_page(struct diaryfs_vidx_page *pg)
+{
+	memset(pg, 0, PAGE_SIZE);
+	pg->magic = cpu_to_le32(DIARYFS_INDEX_MAGIC);
+	pg->min_off = cpu_to_le64(LLONG_MAX);
+}
+
+static void diaryfs_index_add(struct diaryfs_vidx_page *pg,
+		const struct diaryfs_vidx_ent *ent)
+{
+	struct diaryfs_vidx_ent *ents = (struct diaryfs_vidx_ent *)(pg + 1);
+	unsigned int nr = le32_to_cpu(pg->nr);
+	u64 off = le64_to_cpu(ent->offset);
+	u64 end = off + le32_to_cpu(ent->length);
+
+	ents[nr] = *ent;
+	pg->nr = cpu_to_le32(nr + 1);
+	if (le64_to_cpu(ent->seq) > le64_to_cpu(pg->max_seq))
+		pg->max_seq = ent->seq;
+	if (le64_to_cpu(ent->time) > le64_to_cpu(pg->max_time))
+		pg->max_time = ent->time;
+	if (off < le64_to_cpu(pg->min_off))
+		pg->min_off = ent->offset;
+	if (end > le64_to_cpu(pg->max_end))
+		pg->max_end = cpu_to_le64(end);
+}
+
+static int diaryfs_index_write_page(struct file *file, loff_t pos,
+		struct diaryfs_vidx_page *pg)
+{
+	ssize_t ret = kernel_write(file, (char *)pg, PAGE_SIZE, pos);
+
+	if (ret != PAGE_SIZE)
+		return ret < 0 ? ret : -EIO;
+	return 0;
+}
+
+/* put the index of @inode on the list of those the next sync writes out */
+static void diaryfs_index_dirty(struct inode *inode, struct file *file)
+{
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(inode->i_sb);
+	struct diaryfs_vidx_dirty *dirty;
+
+	if (READ_ONCE(info->vdirty))
+		return;
+	dirty = kmalloc(sizeof(*dirty), GFP_NOFS);
+	if (!dirty) {
+		/* no room to remember it: make it durable now */
+		vfs_fsync(file, 1);
+		return;
+	}
+	spin_lock(&sbi->index_lock);
+	if (!info->vdirty) {
+		dirty->file = get_file(file);
+		dirty->info = info;
+		info->vdirty = dirty;
+		list_add_tail(&dirty->list, &sbi->index_dirty);
+		dirty = NULL;
+	}
+	spin_unlock(&sbi->index_lock);
+	kfree(dirty);
+}
+
+/*
+ * diaryfs_index_sync - make every index written to so far durable
+ *
+ * Called by sync_fs once the queue has drained, and at unmount.  Returns
+ * the first error; the index that hit it isn't retried.
+ */
+int diaryfs_index_sync(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_vidx_dirty *dirty;
+	int err = 0, ret;
+
+	for (;;) {
+		spin_lock(&sbi->index_lock);
+		dirty = list_first_entry_or_null(&sbi->index_dirty,
+				struct diaryfs_vidx_dirty, list);
+		if (dirty) {
+			list_del(&dirty->list);
+			if (dirty->info)
+				dirty->info->vdirty = NULL;
+		}
+		spin_unlock(&sbi->index_lock);
+		if (!dirty)
+			break;
+
+		ret = vfs_fsync(dirty->file, 1);
+		if (ret && !err)
+			err = ret;
+		fput(dirty->file);
+		kfree(dirty);
+		cond_resched();
+	}
+	return err;
+}
+
+/*
+ * diaryfs_index_append - index the records just logged for a write
+ *
+ * Called by the versioning worker, which is the only writer of an inode's
+ * index.  A failure costs the entries, not the records; reads of that
+ * history will miss them.
+ */
+void diaryfs_index_append(struct inode *inode,
+		const struct diaryfs_vidx_ent *ents, unsigned int nr)
+{
+	struct diaryfs_vidx_page *pg = NULL;
+	struct file *file;
+	unsigned int i;
+	loff_t pos;
+	int err;
+
+	file = diaryfs_index_get(inode, true);
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto out;
+	}
+	pg = kmalloc(PAGE_SIZE, GFP_NOFS);
+	if (!pg) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* fill up the last page before starting a new one */
+	pos = round_down(i_size_read(file_inode(file)), PAGE_SIZE);
+	if (pos > PAGE_SIZE) {
+		pos -= PAGE_SIZE;
+		err = diaryfs_index_read_page(file, pos, pg, PAGE_SIZE);
+		if (err)
+			goto out;
+		if (!pg->magic || le32_to_cpu(pg->nr) == DIARYFS_INDEX_ENTS) {
+			pos += PAGE_SIZE;
+			diaryfs_index_init_page(pg);
+		}
+	} else {
+		pos = PAGE_SIZE;
+		diaryfs_index_init_page(pg);
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (le32_to_cpu(pg->nr) == DIARYFS_INDEX_ENTS) {
+			err = diaryfs_index_write_page(file, pos, pg);
+			if (err)
+				goto out;
+			pos += PAGE_SIZE;
+			diaryfs_index_init_page(pg);
+		}
+		diaryfs_index_add(pg, &ents[i]);
+	}
+	err = diaryfs_index_write_page(file, pos, pg);
+	if (!err)
+		diaryfs_index_dirty(inode, file);
+out:
+	if (err)
+		printk_ratelimited(KERN_ERR "diaryfs: lost index entries of "
+				"ino %lu: %d\n", inode->i_ino, err);
+	kfree(pg);
+}
+
+/*
+ * The log LSNs [*@since, returned) may hold records of @inode that its
+ * index doesn't: ones from before indexing started, or from before a
+ * damaged index was started over.  There are none if the two are equal.
+ */
+u64 diaryfs_index_unindexed(struct inode *inode, u64 *since)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(inode->i_sb);
+	struct diaryfs_vidx_hdr hdr;
+	struct file *file;
+
+	*since = 0;
+	file = diaryfs_index_get(inode, false);
+	if (IS_ERR(file)) {
+		switch (PTR_ERR(file)) {
+		case -ESTALE:
+			/* not written since: all there is is an earlier file's */
+			return 0;
+		case -ENOENT:
+			return sbi->index_base;
+		default:
+			/* can't be trusted: the log is all there is */
+			return U64_MAX;
+		}
+	}
+	if (diaryfs_index_read_hdr(file, &hdr))
+		return U64_MAX;
+	*since = le64_to_cpu(hdr.since);
+	return le64_to_cpu(hdr.base);
+}
+
+/*
+ * diaryfs_index_lookup - find the indexed records of @inode after @when
+ *
+ * Adds every record logged before @limit that touches [@lo, @hi) to @hist,
+ * and sizes @hist from the oldest of all of them unless it already is.
+ */
+int diaryfs_index_lookup(struct inode *inode, const struct diaryfs_when *when,
+		u64 limit, loff_t lo, loff_t hi, struct diaryfs_hist *hist)
+{
+	struct diaryfs_vidx_page *pg;
+	struct diaryfs_vidx_ent *ents;
+	struct file *file;
+	unsigned long first, last, mid, p;
+	unsigned int i;
+	int err = 0;
+
+	/* anything without a usable index is found in the log instead */
+	file = diaryfs_index_get(inode, false);
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		return err == -ENOENT || err == -ESTALE || err == -EUCLEAN ?
+			0 : err;
+	}
+	last = round_down(i_size_read(file_inode(file)), PAGE_SIZE) >> PAGE_SHIFT;
+	if (last <= 1)
+		return 0;
+	pg = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!pg)
+		return -ENOMEM;
+	ents = (struct diaryfs_vidx_ent *)(pg + 1);
+
+	/* the first page with a write after @when: summaries only */
+	first = 1;
+	while (first < last) {
+		mid = first + (last - first) / 2;
+		err = diaryfs_index_read_page(file, (loff_t)mid << PAGE_SHIFT,
+				pg, sizeof(*pg));
+		if (err)
+			goto out;
+		if (diaryfs_hist_after(when, le64_to_cpu(pg->max_time),
+				le64_to_cpu(pg->max_seq)))
+			last = mid;
+		else
+			first = mid + 1;
+	}
+
+	last = round_down(i_size_read(file_inode(file)), PAGE_SIZE) >> PAGE_SHIFT;
+	for (p = first; p < last; p++) {
+		loff_t pos = (loff_t)p << PAGE_SHIFT;
+
+		err = diaryfs_index_read_page(file, pos, pg, sizeof(*pg));
+		if (err)
+			goto out;
+		if (hist->sized && (le64_to_cpu(pg->min_off) >= hi ||
+				    le64_to_cpu(pg->max_end) <= lo))
+			continue;
+		err = diaryfs_index_read_page(file, pos, pg, PAGE_SIZE);
+		if (err)
+			goto out;
+
+		for (i = 0; i < le32_to_cpu(pg->nr); i++) {
+			u64 off = le64_to_cpu(ents[i].offset);
+
+			if (le64_to_cpu(ents[i].lsn) >= limit ||
+			    !diaryfs_hist_after(when, le64_to_cpu(ents[i].time),
+					le64_to_cpu(ents[i].seq)))
+				continue;
+			if (!hist->sized) {
+				hist->size = le64_to_cpu(ents[i].old_size);
+				hist->sized = true;
+			}
+			if (off < hi && off + le32_to_cpu(ents[i].length) > lo &&
+			    diaryfs_hist_wanted(hist, le64_to_cpu(ents[i].time),
+					le64_to_cpu(ents[i].seq))) {
+				err = diaryfs_hist_add(hist,
+						le64_to_cpu(ents[i].lsn), off,
+						le32_to_cpu(ents[i].flags) &
+						(DIARYFS_VIDX_CKPT |
+						 DIARYFS_VIDX_WHOLE));
+				if (err)
+					goto out;
+			}
+		}
+		cond_resched();
+	}
+out:
+	kfree(pg);
+	return err;
+}
+
+/*
+ * Walk the writes indexed in the first @last pages of @file, oldest first.
+ * Once past the first @skip, fill @out with up to @max of them.  Returns
+ * how many there were.
+ */
+static long diaryfs_index_list(struct file *file, unsigned long last,
+		struct diaryfs_vidx_page *pg, struct diaryfs_version *out,
+		unsigned long skip, unsigned long max)
+{
+	struct diaryfs_vidx_ent *ents = (struct diaryfs_vidx_ent *)(pg + 1);
+	struct diaryfs_version *cur = NULL;
+	unsigned long p, nr = 0;
+	unsigned int i;
+	u64 seq = 0;
+	int err;
+
+	for (p = 1; p < last; p++) {
+		err = diaryfs_index_read_page(file, (loff_t)p << PAGE_SHIFT,
+				pg, PAGE_SIZE);
+		if (err)
+			return err;
+		for (i = 0; i < le32_to_cpu(pg->nr); i++) {
+			if (le32_to_cpu(ents[i].flags) & DIARYFS_VIDX_CKPT)
+				continue;
+			/* a write's entries are next to each other */
+			if (le64_to_cpu(ents[i].seq) != seq) {
+				seq = le64_to_cpu(ents[i].seq);
+				nr++;
+				cur = NULL;
+				if (out && nr > skip && nr - skip <= max) {
+					cur = &out[nr - skip - 1];
+					cur->version = seq;
+					cur->time = le64_to_cpu(ents[i].time);
+					cur->bytes = 0;
+				}
+			}
+			if (cur)
+				cur->bytes += le32_to_cpu(ents[i].length);
+		}
+		cond_resched();
+	}
+	return nr;
+}
+
+/*
+ * diaryfs_index_versions - the DIARYFS_XATTR_VERSIONS value of @inode
+ *
+ * Lists the newest versions that fit in an xattr, straight from the index;
+ * writes still waiting to be versioned aren't there yet.  With @size 0,
+ * returns the size the value needs.
+ */
+ssize_t diaryfs_index_versions(struct inode *inode, void *buf, size_t size)
+{
+	const unsigned long max = XATTR_SIZE_MAX / sizeof(struct diaryfs_version);
+	struct diaryfs_vidx_page *pg;
+	unsigned long last;
+	struct file *file;
+	long nr, skip;
+	ssize_t ret;
+
+	file = diaryfs_index_get(inode, false);
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		return ret == -ENOENT || ret == -ESTALE || ret == -EUCLEAN ?
+			0 : ret;
+	}
+	pg = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!pg)
+		return -ENOMEM;
+
+	/* count, then fill in; writes indexed in between aren't listed */
+	last = round_down(i_size_read(file_inode(file)), PAGE_SIZE) >> PAGE_SHIFT;
+	ret = nr = diaryfs_index_list(file, last, pg, NULL, 0, 0);
+	if (nr <= 0)
+		goto out;
+	skip = nr > max ? nr - max : 0;
+	ret = (nr - skip) * sizeof(struct diaryfs_version);
+	if (!size)
+		goto out;
+	if (size < ret) {
+		ret = -ERANGE;
+		goto out;
+	}
+	nr = diaryfs_index_list(file, last, pg, buf, skip, nr - skip);
+	if (nr < 0)
+		ret = nr;
+out:
+	kfree(pg);
+	return ret;
+}
+
+/*
+ * The live inode is going away; so does its open index.  If it still needs
+ * syncing, the dirty list keeps a reference of its own.  Once the lower
+ * file is deleted, its history can't be rebuilt any more, and the index is
+ * unlinked.
+ */
+void diaryfs_index_release(struct inode *inode)
+{
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(inode->i_sb);
+	struct inode *lower_inode = diaryfs_lower_inode(inode);
+	char name[DIARYFS_SEG_NAME_LEN];
+	int err;
+
+	if (info->vdirty) {
+		spin_lock(&sbi->index_lock);
+		if (info->vdirty) {
+			info->vdirty->info = NULL;
+			info->vdirty = NULL;
+		}
+		spin_unlock(&sbi->index_lock);
+	}
+	if (info->vindex) {
+		fput(info->vindex);
+		info->vindex = NULL;
+	}
+
+	if (!S_ISREG(inode->i_mode) || info->snap_time || !lower_inode ||
+	    lower_inode->i_nlink || !sbi->index_dir.dentry || sbi->read_only)
+		return;
+	/* the lower inode, and so its number, is still ours */
+	diaryfs_index_name(name, lower_inode->i_ino);
+	err = diaryfs_meta_unlink(&sbi->index_dir, name);
+	if (err && err != -ENOENT)
+		printk_ratelimited(KERN_WARNING "diaryfs: cannot remove index "
+				"of ino %lu: %d\n", lower_inode->i_ino, err);
+}
+
+/* collects the inode numbers of index files, a batch at a time */
+struct diaryfs_index_scan {
+	struct dir_context ctx;
+	unsigned long inos[64];
+	unsigned int nr;
+};
+
+static int diaryfs_index_scan_actor(struct dir_context *ctx, const char *name,
+		int namelen, loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct diaryfs_index_scan *scan =
+		container_of(ctx, struct diaryfs_index_scan, ctx);
+	char buf[DIARYFS_SEG_NAME_LEN];
+	unsigned long nr;
+
+	/* stop short of this entry; the next batch starts with it */
+	if (scan->nr == ARRAY_SIZE(scan->inos))
+		return -ENOSPC;
+	if (namelen != DIARYFS_SEG_NAME_LEN - 1)
+		return 0;
+	memcpy(buf, name, namelen);
+	buf[namelen] = '\0';
+	if (!kstrtoul(buf, 16, &nr))
+		scan->inos[scan->nr++] = nr;
+	return 0;
+}
+
+/* punch out the entry pages of index @ino that only point below @oldest */
+static int diaryfs_index_prune_one(struct diaryfs_sb_info *sbi,
+		unsigned long ino, u64 oldest, struct diaryfs_vidx_page *pg)
+{
+	struct diaryfs_vidx_ent *ents = (struct diaryfs_vidx_ent *)(pg + 1);
+	char name[DIARYFS_SEG_NAME_LEN];
+	struct file *file;
+	loff_t start, pos, last;
+	unsigned int nr;
+	int err = 0;
+
+	diaryfs_index_name(name, ino);
+	file = diaryfs_meta_open(&sbi->index_dir, name, O_RDWR);
+	if (IS_ERR(file))
+		return PTR_ERR(file) == -ENOENT ? 0 : PTR_ERR(file);
+
+	/* the last page is still being filled, so it always stays */
+	last = round_down(i_size_read(file_inode(file)), PAGE_SIZE) - PAGE_SIZE;
+	/* and what was punched before needn't be read again */
+	start = vfs_llseek(file, PAGE_SIZE, SEEK_DATA);
+	start = start < PAGE_SIZE ? PAGE_SIZE : round_down(start, PAGE_SIZE);
+
+	for (pos = start; pos < last; pos += PAGE_SIZE) {
+		err = diaryfs_index_read_page(file, pos, pg, PAGE_SIZE);
+		if (err)
+			break;
+		/* entries are in log order, so the last one is the newest */
+		nr = le32_to_cpu(pg->nr);
+		if (nr && le64_to_cpu(ents[nr - 1].lsn) >= oldest)
+			break;
+		cond_resched();
+	}
+	if (!err && pos > start)
+		err = vfs_fallocate(file, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, start, pos - start);
+	fput(file);
+	return err;
+}
+
+/*
+ * diaryfs_index_prune - drop the index entries of expired records
+ *
+ * @oldest is the first LSN the log still holds.  Called by the retention
+ * thread once it has dropped something; returns the first error, but
+ * goes on with the other indexes.
+ */
+int diaryfs_index_prune(struct diaryfs_sb_info *sbi, u64 oldest)
+{
+	struct diaryfs_index_scan *scan;
+	struct diaryfs_vidx_page *pg;
+	struct file *dir = NULL;
+	unsigned int i;
+	int err = 0, ret;
+
+	if (!sbi->index_dir.dentry)
+		return 0;
+	scan = kzalloc(sizeof(*scan), GFP_KERNEL);
+	pg = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!scan || !pg) {
+		err = -ENOMEM;
+		goto out;
+	}
+	scan->ctx.actor = diaryfs_index_scan_actor;
+	dir = dentry_open(&sbi->index_dir, O_RDONLY | O_DIRECTORY,
+			current_cred());
+	if (IS_ERR(dir)) {
+		err = PTR_ERR(dir);
+		dir = NULL;
+		goto out;
+	}
+
+	do {
+		scan->nr = 0;
+		ret = iterate_dir(dir, &scan->ctx);
+		/* a full batch stopped the walk on purpose */
+		if (ret && scan->nr < ARRAY_SIZE(scan->inos)) {
+			err = ret;
+			break;
+		}
+		for (i = 0; i < scan->nr; i++) {
+			ret = diaryfs_index_prune_one(sbi, scan->inos[i],
+					oldest, pg);
+			if (ret && !err)
+				err = ret;
+		}
+	} while (scan->nr == ARRAY_SIZE(scan->inos) && !kthread_should_stop());
+out:
+	if (dir)
+		fput(dir);
+	kfree(pg);
+	kfree(scan);
+	return err;
+}
+
+int diaryfs_index_open(struct diaryfs_sb_info *sbi)
+{
+	struct file *file;
+	__le64 base;
+	ssize_t ret;
+	int err = 0;
+
+	spin_lock_init(&sbi->index_lock);
+	INIT_LIST_HEAD(&sbi->index_dirty);
+
+	/* without indexes, a read-only mount finds everything in the log */
+	sbi->index_base = diaryfs_log_lsn(sbi);
+	if (!sbi->meta_path.dentry)
+		return 0;
+	err = diaryfs_meta_mkdir(&sbi->meta_path, DIARYFS_INDEX_DIR,
+			!sbi->read_only, &sbi->index_dir);
+	if (err == -ENOENT && sbi->read_only)
+		return 0;
+	if (err)
+		return err;
+	file = diaryfs_meta_open(&sbi->index_dir, DIARYFS_INDEX_BASE,
+			sbi->read_only ? O_RDONLY : O_RDWR | O_CREAT);
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		if (err == -ENOENT && sbi->read_only) {
+			diaryfs_index_close(sbi);
+			return 0;
+		}
+		goto out_err;
+	}
+
+	ret = kernel_read(file, 0, (char *)&base, sizeof(base));
+	if (ret == sizeof(base)) {
+		sbi->index_base = le64_to_cpu(base);
+	} else if (sbi->read_only) {
+		/* never got written: nothing is indexed */
+		err = ret < 0 ? ret : 0;
+	} else {
+		/* indexing starts now; what's in the log already isn't indexed */
+		sbi->index_base = diaryfs_log_lsn(sbi);
+		base = cpu_to_le64(sbi->index_base);
+		ret = kernel_write(file, (char *)&base, sizeof(base), 0);
+		if (ret == sizeof(base))
+			err = vfs_fsync(file, 0);
+		else
+			err = ret < 0 ? ret : -EIO;
+	}
+	fput(file);
+	if (err)
+		goto out_err;
+	return 0;
+
+out_err:
+	diaryfs_index_close(sbi);
+	return err;
+}
+
+void diaryfs_index_close(struct diaryfs_sb_info *sbi)
+{
+	diaryfs_index_sync(sbi);
+	if (sbi->index_dir.dentry) {
+		path_put(&sbi->index_dir);
+		sbi->index_dir.dentry = NULL;
+		sbi->index_dir.mnt = NULL;
+	}
+}
@@ -363,9 +363,9 @@ static int diaryfs_setattr(struct dentry * dentry, struct iattr * attr) {
 	 */
 	err = inode_change_ok(inode, attr);
 	if (err) 
-		goto out_err;
+		goto out;
 
-	diaryfs_get_lower_path(dentry, &lower_path);
+	diaryfs_peek_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_inode = diaryfs_lower_inode(inode); 
 
@@ -386,7 +386,14 @@ static int diaryfs_setattr(struct dentry * dentry, struct iattr * attr) {
 		err = inode_newsize_ok(inode, attr->ia_size);
 		if (err)
 			goto out;
+		/* what the truncate cuts off is history too */
+		if (S_ISREG(inode->i_mode)) {
+			err = diaryfs_version_truncate(dentry, attr->ia_size);
+			if (err)
+				goto out;
+		}
 		truncate_setsize(inode, attr->ia_size);
+		diaryfs_hash_invalidate(inode, attr->ia_size, LLONG_MAX);
 	}
 
 	/*
@@ -411,8 +418,6 @@ static int diaryfs_setattr(struct dentry * dentry, struct iattr * attr) {
 	fsstack_copy_attr_all(inode, lower_inode);
 
 out:
-	diaryfs_put_lower_path(dentry, &lower_path);
-out_err:
 	return err;
 }
 
@@ -421,7 +426,7 @@ static int diaryfs_getattr(struct vfsmount *mnt, struct dentry * dentry, struct
 	struct kstat lower_stat;
 	struct path lower_path;
 
-	diaryfs_get_lower_path(dentry, &lower_path); 
+	diaryfs_peek_lower_path(dentry, &lower_path);
 	err = vfs_getattr(&lower_path, &lower_stat);
 	if (err) 
 		goto out;
@@ -429,16 +434,24 @@ static int diaryfs_getattr(struct vfsmount *mnt, struct dentry * dentry, struct
 	generic_fillattr(dentry->d_inode, stat);
 	stat->blocks = lower_stat.blocks;
 out:
-	diaryfs_put_lower_path(dentry, &lower_path);
 	return err;
 }
 
+/* names diaryfs answers itself rather than passing down */
+static bool diaryfs_xattr_reserved(struct dentry * dentry, const char * name) {
+	return S_ISREG(dentry->d_inode->i_mode) &&
+		!strcmp(name, DIARYFS_XATTR_VERSIONS);
+}
+
 static int diaryfs_setxattr(struct dentry * dentry, const char * name, const void * value, size_t size, int flags) {
 	int err;
 	struct dentry * lower_dentry;
 	struct path lower_path;
 
-	diaryfs_get_lower_path(dentry, &lower_path);
+	if (diaryfs_xattr_reserved(dentry, name))
+		return -EPERM;
+
+	diaryfs_peek_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	if (!lower_dentry->d_inode->i_op->setxattr) {
 		err = -EOPNOTSUPP;
@@ -449,7 +462,6 @@ static int diaryfs_setxattr(struct dentry * dentry, const char * name, const voi
 		goto out;
 	fsstack_copy_attr_all(dentry->d_inode, lower_path.dentry->d_inode);
 out:
-	diaryfs_put_lower_path(dentry, &lower_path); 
 	return err;
 }
 
@@ -458,7 +470,10 @@ static ssize_t diaryfs_getxattr(struct dentry *dentry, const char * name, void *
 	struct dentry * lower_dentry;
 	struct path lower_path; 
 
-	diaryfs_get_lower_path(dentry, &lower_path); 
+	if (diaryfs_xattr_reserved(dentry, name))
+		return diaryfs_index_versions(dentry->d_inode, buffer, size);
+
+	diaryfs_peek_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	if (!lower_dentry->d_inode->i_op->getxattr) {
 		err = -EOPNOTSUPP;
@@ -470,7 +485,6 @@ static ssize_t diaryfs_getxattr(struct dentry *dentry, const char * name, void *
 	fsstack_copy_attr_atime(dentry->d_inode, lower_path.dentry->d_inode);
 
 out:
-	diaryfs_put_lower_path(dentry, &lower_path);
 	return err;
 }
 
@@ -479,7 +493,7 @@ static ssize_t diaryfs_listxattr(struct dentry * dentry, char * buffer, size_t b
 	struct dentry * lower_dentry;
 	struct path lower_path; 
 
-	diaryfs_get_lower_path(dentry, &lower_path);
+	diaryfs_peek_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	if (!lower_dentry->d_inode->i_op->listxattr) {
 		err = -EOPNOTSUPP;
@@ -490,7 +504,6 @@ static ssize_t diaryfs_listxattr(struct dentry * dentry, char * buffer, size_t b
 		goto out;
 	fsstack_copy_attr_atime(dentry->d_inode, lower_path.dentry->d_inode);
 out:
-	diaryfs_put_lower_path(dentry, &lower_path);
 	return err;
 }
 
@@ -498,7 +511,11 @@ static int diaryfs_removexattr(struct dentry * dentry, const char * name) {
 	int err;
 	struct dentry * lower_dentry;
 	struct path lower_path;
-	diaryfs_get_lower_path(dentry, &lower_path); 
+
+	if (diaryfs_xattr_reserved(dentry, name))
+		return -EPERM;
+
+	diaryfs_peek_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	if (!lower_dentry->d_inode->i_op ||
 		!lower_dentry->d_inode->i_op->removexattr) {
@@ -510,7 +527,6 @@ static int diaryfs_removexattr(struct dentry * dentry, const char * name) {
 		goto out;
 	fsstack_copy_attr_all(dentry->d_inode, lower_path.dentry->d_inode);
 out:
-	diaryfs_put_lower_path(dentry, &lower_path);
 	return err;
 }
 
@@ -0,0 +1,847 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+#include "diaryfs_trace.h"
+
+/*
+ * The version log.
+ *
+ * Each mount has one log-structured journal: a series of fixed-size
+ * segment files, named by sequence number, in a hidden directory in the
+ * lower root.  Version records (struct diaryfs_rec, see diaryfs.h) for
+ * every file on the mount are appended to the active segment and tagged
+ * with the lower inode number; a record is addressed by its LSN, the
+ * segment sequence number and offset combined.
+ *
+ * Records are not written one by one: they are packed back to back into a
+ * batch of pages in memory, and a batch goes to the segment with a single
+ * vectored write when it fills up, when the versioning queue runs dry, or
+ * on sync.  Every batch starts on a page boundary; the unused tail of its
+ * last page is covered by a PAD record, or zeroes.  The first page of a
+ * segment holds its header, which is rewritten with the final time range
+ * when the segment is sealed.
+ */
+
+/*
+ * Return the lower directory @name under @parent.  With @create it is
+ * created if it does not exist yet; without, that is -ENOENT.
+ */
+int diaryfs_meta_mkdir(const struct path *parent, const char *name,
+		bool create, struct path *path)
+{
+	struct dentry *dir = parent->dentry;
+	struct dentry *dentry;
+	int err = 0;
+
+	mutex_lock_nested(&dir->d_inode->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, dir, strlen(name));
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+		goto out;
+	}
+	if (!dentry->d_inode)
+		err = create ? vfs_mkdir(dir->d_inode, dentry, 0700) : -ENOENT;
+	if (!err && !d_is_dir(dentry))
+		err = -ENOTDIR;
+	if (err) {
+		dput(dentry);
+		goto out;
+	}
+	path->dentry = dentry;
+	path->mnt = mntget(parent->mnt);
+out:
+	mutex_unlock(&dir->d_inode->i_mutex);
+	return err;
+}
+
+/*
+ * Open the lower file @name in directory @dir.  With O_CREAT it is created
+ * if it does not exist yet.
+ */
+struct file *diaryfs_meta_open(const struct path *dir, const char *name,
+		int flags)
+{
+	struct dentry *dentry;
+	struct path path;
+	struct file *file;
+	int err = 0;
+
+	mutex_lock_nested(&dir->dentry->d_inode->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, dir->dentry, strlen(name));
+	if (IS_ERR(dentry)) {
+		mutex_unlock(&dir->dentry->d_inode->i_mutex);
+		return ERR_CAST(dentry);
+	}
+	if (!dentry->d_inode) {
+		if (flags & O_CREAT)
+			err = vfs_create(dir->dentry->d_inode, dentry,
+					S_IFREG | 0600, true);
+		else
+			err = -ENOENT;
+	}
+	mutex_unlock(&dir->dentry->d_inode->i_mutex);
+	if (err) {
+		dput(dentry);
+		return ERR_PTR(err);
+	}
+
+	path.dentry = dentry;
+	path.mnt = dir->mnt;
+	file = dentry_open(&path, (flags & ~(O_CREAT | O_EXCL)) | O_LARGEFILE,
+			current_cred());
+	dput(dentry);
+	return file;
+}
+
+/* copy @len bytes into the batch at its current fill level */
+static void diaryfs_log_copy(struct diaryfs_log *log, const void *src,
+		size_t len)
+{
+	while (len) {
+		struct page *page = log->batch[log->used >> PAGE_SHIFT];
+		size_t off = log->used & (PAGE_SIZE - 1);
+		size_t n = min_t(size_t, len, PAGE_SIZE - off);
+		void *addr = kmap_atomic(page);
+
+		if (src) {
+			memcpy(addr + off, src, n);
+			src += n;
+		} else {
+			memset(addr + off, 0, n);
+		}
+		kunmap_atomic(addr);
+		log->used += n;
+		len -= n;
+	}
+}
+
+/* remove the lower file @name in directory @dir */
+int diaryfs_meta_unlink(const struct path *dir, const char *name)
+{
+	struct inode *dir_inode = dir->dentry->d_inode;
+	struct dentry *dentry;
+	int err;
+
+	mutex_lock_nested(&dir_inode->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, dir->dentry, strlen(name));
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+		goto out;
+	}
+	err = dentry->d_inode ? vfs_unlink(dir_inode, dentry, NULL) : -ENOENT;
+	dput(dentry);
+out:
+	mutex_unlock(&dir_inode->i_mutex);
+	return err;
+}
+
+void diaryfs_seg_name(char *name, u64 seq)
+{
+	snprintf(name, DIARYFS_SEG_NAME_LEN, "%016llx", seq);
+}
+
+/* open segment @seq of the journal; readers pass O_RDONLY */
+struct file *diaryfs_seg_open(struct diaryfs_sb_info *sbi, u64 seq, int flags)
+{
+	char name[DIARYFS_SEG_NAME_LEN];
+
+	diaryfs_seg_name(name, seq);
+	return diaryfs_meta_open(&sbi->log.dir, name, flags);
+}
+
+static int diaryfs_seg_read_hdr(struct file *file, struct diaryfs_seg_hdr *hdr)
+{
+	int ret = kernel_read(file, 0, (char *)hdr, sizeof(*hdr));
+	u32 crc;
+
+	if (ret < 0)
+		return ret;
+	if (ret != sizeof(*hdr) || le32_to_cpu(hdr->magic) != DIARYFS_SEG_MAGIC)
+		return -EUCLEAN;
+	crc = le32_to_cpu(hdr->crc);
+	hdr->crc = 0;
+	if (crc32c(~0, hdr, sizeof(*hdr)) != crc)
+		return -EUCLEAN;
+	return 0;
+}
+
+int diaryfs_seg_write_hdr(struct file *file, struct diaryfs_seg *seg)
+{
+	struct diaryfs_seg_hdr hdr;
+	loff_t pos = 0;
+	ssize_t ret;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = cpu_to_le32(DIARYFS_SEG_MAGIC);
+	hdr.version = cpu_to_le32(DIARYFS_SEG_VERSION);
+	hdr.seq = cpu_to_le64(seg->seq);
+	hdr.created = cpu_to_le64(seg->created);
+	hdr.min_time = cpu_to_le64(seg->min_time);
+	hdr.max_time = cpu_to_le64(seg->max_time);
+	hdr.max_seq = cpu_to_le64(seg->max_seq);
+	hdr.size = cpu_to_le64(seg->size);
+	hdr.start = cpu_to_le64(seg->start);
+	hdr.flags = cpu_to_le32(seg->flags);
+	hdr.crc = cpu_to_le32(crc32c(~0, &hdr, sizeof(hdr)));
+
+	ret = kernel_write(file, (char *)&hdr, sizeof(hdr), pos);
+	return ret == sizeof(hdr) ? 0 : (ret < 0 ? ret : -EIO);
+}
+
+/*
+ * Write out the current batch; caller holds log->lock.  The records in it
+ * already have their LSNs, so if the write fails the batch is kept as it
+ * was and the next flush writes it to the same place again.
+ */
+static int __diaryfs_log_flush(struct diaryfs_log *log)
+{
+	struct kvec vec[DIARYFS_LOG_BATCH_PAGES];
+	struct iov_iter iter;
+	size_t used = log->used;
+	size_t pad = PAGE_ALIGN(used) - used;
+	size_t len;
+	unsigned int i, nr;
+	loff_t pos;
+	ssize_t ret;
+
+	if (!log->used)
+		return 0;
+
+	/* index slots for the chunks these records use go first */
+	diaryfs_chunk_flush(container_of(log, struct diaryfs_sb_info, log));
+
+	/* cover the rest of the last page */
+	if (pad >= sizeof(struct diaryfs_rec)) {
+		struct diaryfs_rec rec;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.magic = cpu_to_le32(DIARYFS_REC_MAGIC);
+		rec.type = cpu_to_le16(DIARYFS_REC_PAD);
+		rec.rec_len = cpu_to_le32(pad);
+		rec.crc = cpu_to_le32(crc32c(~0, &rec, sizeof(rec)));
+		diaryfs_log_copy(log, &rec, sizeof(rec));
+		pad -= sizeof(rec);
+	}
+	diaryfs_log_copy(log, NULL, pad);
+
+	len = log->used;
+	nr = len >> PAGE_SHIFT;
+	for (i = 0; i < nr; i++) {
+		vec[i].iov_base = kmap(log->batch[i]);
+		vec[i].iov_len = PAGE_SIZE;
+	}
+	iov_iter_kvec(&iter, ITER_KVEC | WRITE, vec, nr, len);
+
+	pos = log->tail;
+	file_start_write(log->file);
+	ret = vfs_iter_write(log->file, &iter, &pos);
+	file_end_write(log->file);
+
+	for (i = 0; i < nr; i++)
+		kunmap(log->batch[i]);
+
+	if (ret != len) {
+		printk_ratelimited(KERN_ERR "diaryfs: log write failed: %zd\n",
+				ret);
+		/* drop the padding again, it is redone on the retry */
+		log->used = used;
+		return ret < 0 ? ret : -EIO;
+	}
+	log->used = 0;
+	log->tail += len;
+	log->active->size = log->tail;
+	return 0;
+}
+
+/*
+ * Start segment @seq as the active one; caller holds log->lock (or is
+ * mounting).  The header page is written up front so records start on
+ * the second page.
+ */
+static int diaryfs_seg_start(struct diaryfs_log *log, u64 seq)
+{
+	struct diaryfs_sb_info *sbi = container_of(log, struct diaryfs_sb_info, log);
+	struct diaryfs_seg *seg;
+	struct file *file;
+	char *zero;
+	int err;
+
+	seg = kzalloc(sizeof(*seg), GFP_NOFS);
+	zero = kzalloc(PAGE_SIZE, GFP_NOFS);
+	if (!seg || !zero) {
+		err = -ENOMEM;
+		goto out;
+	}
+	seg->seq = seq;
+	seg->created = ktime_get_real_ns();
+	/* so the write count survives even if retention drops all else */
+	seg->max_seq = atomic64_read(&sbi->wseq);
+	seg->size = PAGE_SIZE;
+	seg->start = PAGE_SIZE;
+
+	file = diaryfs_seg_open(sbi, seq, O_RDWR | O_CREAT);
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto out;
+	}
+	err = kernel_write(file, zero, PAGE_SIZE, 0);
+	err = err == PAGE_SIZE ? diaryfs_seg_write_hdr(file, seg) :
+		(err < 0 ? err : -EIO);
+	if (err) {
+		fput(file);
+		goto out;
+	}
+
+	log->file = file;
+	log->active = seg;
+	log->tail = PAGE_SIZE;
+	spin_lock(&log->seg_lock);
+	list_add_tail(&seg->list, &log->segs);
+	spin_unlock(&log->seg_lock);
+	seg = NULL;
+out:
+	kfree(zero);
+	kfree(seg);
+	return err;
+}
+
+/* seal the active segment and move on to the next one */
+static int diaryfs_seg_rotate(struct diaryfs_log *log)
+{
+	struct diaryfs_seg *seg = log->active;
+	int err;
+
+	err = __diaryfs_log_flush(log);
+	if (err)
+		return err;
+
+	spin_lock(&log->seg_lock);
+	seg->flags |= DIARYFS_SEG_SEALED;
+	spin_unlock(&log->seg_lock);
+	err = diaryfs_seg_write_hdr(log->file, seg);
+	if (!err)
+		err = vfs_fsync(log->file, 1);
+	if (err)
+		return err;
+
+	fput(log->file);
+	log->file = NULL;
+	log->active = NULL;
+	err = diaryfs_seg_start(log, seg->seq + 1);
+	if (err) {
+		printk(KERN_ERR "diaryfs: cannot start log segment %llu, "
+		       "versioning stopped: %d\n", seg->seq + 1, err);
+		log->err = err;
+	}
+	return err;
+}
+
+int diaryfs_log_flush(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_log *log = &sbi->log;
+	int err;
+
+	mutex_lock(&log->lock);
+	err = log->file ? __diaryfs_log_flush(log) : 0;
+	mutex_unlock(&log->lock);
+	return err;
+}
+
+/* the LSN the next record will get; everything before it is in the log */
+u64 diaryfs_log_lsn(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_log *log = &sbi->log;
+	u64 lsn = 0;
+
+	mutex_lock(&log->lock);
+	if (log->active)
+		lsn = DIARYFS_LSN(log->active->seq, log->tail + log->used);
+	mutex_unlock(&log->lock);
+	return lsn;
+}
+
+/* flush the batch and make the log durable */
+int diaryfs_log_sync(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_log *log = &sbi->log;
+	int err = 0;
+
+	mutex_lock(&log->lock);
+	if (log->file) {
+		err = __diaryfs_log_flush(log);
+		if (!err)
+			err = diaryfs_chunk_sync(sbi);
+		if (!err)
+			err = vfs_fsync(log->file, 1);
+	}
+	mutex_unlock(&log->lock);
+	return err;
+}
+
+/*
+ * diaryfs_log_append - add a record to the journal
+ *
+ * The caller fills in everything in @rec that describes the change; the
+ * framing fields (magic, codec, lengths, checksum) are set here.
+ * @payload_len bytes of @payload follow the header, compressed with the
+ * mount's codec when that pays off.  The record's LSN is returned in @lsn
+ * if it is not NULL.
+ */
+int diaryfs_log_append(struct diaryfs_sb_info *sbi, struct diaryfs_rec *rec,
+		const void *payload, size_t payload_len, u64 *lsn)
+{
+	struct diaryfs_log *log = &sbi->log;
+	struct diaryfs_zstrm *zstrm = NULL;
+	unsigned int codec = sbi->codec;
+	u64 time = le64_to_cpu(rec->time);
+	u64 start = ktime_get_ns();
+	u64 at = 0;
+	size_t rec_len;
+	u32 crc;
+	int err = 0;
+
+	rec->codec = DIARYFS_CODEC_NONE;
+	rec->raw_len = cpu_to_le32(payload_len);
+
+	/* compress outside the log lock, it is the slow part */
+	if (codec != DIARYFS_CODEC_NONE && payload_len >= DIARYFS_COMP_MIN) {
+		zstrm = diaryfs_zstrm_get(codec);
+		if (IS_ERR(zstrm)) {
+			zstrm = NULL;
+		} else {
+			unsigned int clen;
+
+			clen = diaryfs_compress(zstrm, payload, payload_len);
+			if (clen) {
+				rec->codec = codec;
+				payload = zstrm->buf;
+				payload_len = clen;
+			}
+		}
+	}
+
+	rec_len = ALIGN(sizeof(*rec) + payload_len, 8);
+	if (rec_len > DIARYFS_LOG_BATCH_PAGES * PAGE_SIZE) {
+		err = -E2BIG;
+		goto out_put;
+	}
+
+	rec->magic = cpu_to_le32(DIARYFS_REC_MAGIC);
+	rec->rec_len = cpu_to_le32(rec_len);
+	rec->payload_len = cpu_to_le32(payload_len);
+	rec->crc = 0;
+	crc = crc32c(~0, rec, sizeof(*rec));
+	crc = crc32c(crc, payload, payload_len);
+	rec->crc = cpu_to_le32(crc);
+
+	mutex_lock(&log->lock);
+	if (!log->file) {
+		err = log->err ?: -EROFS;
+		goto out;
+	}
+	/*
+	 * Segments cover a bounded stretch of time too, so that retention
+	 * can drop them whole.
+	 */
+	if (log->tail + PAGE_ALIGN(log->used + rec_len) > DIARYFS_SEG_SIZE ||
+	    (log->active->min_time &&
+	     time > log->active->min_time + sbi->seg_span)) {
+		err = diaryfs_seg_rotate(log);
+		if (err)
+			goto out;
+	} else if (log->used + rec_len > DIARYFS_LOG_BATCH_PAGES * PAGE_SIZE) {
+		err = __diaryfs_log_flush(log);
+		if (err)
+			goto out;
+	}
+
+	at = DIARYFS_LSN(log->active->seq, log->tail + log->used);
+	if (lsn)
+		*lsn = at;
+	diaryfs_log_copy(log, rec, sizeof(*rec));
+	diaryfs_log_copy(log, payload, payload_len);
+	diaryfs_log_copy(log, NULL, rec_len - sizeof(*rec) - payload_len);
+
+	spin_lock(&log->seg_lock);
+	if (!log->active->min_time || time < log->active->min_time)
+		log->active->min_time = time;
+	if (time > log->active->max_time)
+		log->active->max_time = time;
+	if (le64_to_cpu(rec->seq) > log->active->max_seq)
+		log->active->max_seq = le64_to_cpu(rec->seq);
+	if (le16_to_cpu(rec->type) == DIARYFS_REC_CHUNKS)
+		log->active->flags |= DIARYFS_SEG_CHUNKS;
+	spin_unlock(&log->seg_lock);
+out:
+	mutex_unlock(&log->lock);
+out_put:
+	if (zstrm)
+		diaryfs_zstrm_put(codec, zstrm);
+	if (!err)
+		diaryfs_stat_add(sbi, DIARYFS_STAT_LOGGED, rec_len);
+	diaryfs_stat_lat(sbi, DIARYFS_LAT_APPEND, start);
+	trace_diaryfs_log_append(sbi->lower_sb, rec, at, err, start);
+	return err;
+}
+
+/*
+ * Read the whole record at @pos of segment @file into @buf, @len bytes
+ * long, and check it.  Returns the record length.
+ */
+int diaryfs_log_read(struct file *file, loff_t pos, void *buf, size_t len)
+{
+	struct diaryfs_rec *rec = buf;
+	size_t rec_len;
+	u32 crc;
+	int ret;
+
+	ret = kernel_read(file, pos, buf, sizeof(*rec));
+	if (ret < 0)
+		return ret;
+	if (ret != sizeof(*rec) || le32_to_cpu(rec->magic) != DIARYFS_REC_MAGIC)
+		return -EUCLEAN;
+	rec_len = le32_to_cpu(rec->rec_len);
+	if (rec_len < sizeof(*rec) ||
+	    sizeof(*rec) + le32_to_cpu(rec->payload_len) > rec_len)
+		return -EUCLEAN;
+	if (rec_len > len)
+		return -E2BIG;
+	ret = kernel_read(file, pos, buf, rec_len);
+	if (ret < 0)
+		return ret;
+	if (ret != rec_len)
+		return -EUCLEAN;
+
+	crc = le32_to_cpu(rec->crc);
+	rec->crc = 0;
+	if (crc32c(crc32c(~0, rec, sizeof(*rec)), rec + 1,
+		   le32_to_cpu(rec->payload_len)) != crc)
+		return -EUCLEAN;
+	rec->crc = cpu_to_le32(crc);
+	return rec_len;
+}
+
+/*
+ * Record cursor.  Walks the records of one segment file in order, skipping
+ * padding and anything that does not check out (a batch torn by a crash).
+ * Returned records point into the cursor's buffer and are valid until the
+ * next call.
+ */
+int diaryfs_cursor_init(struct diaryfs_cursor *cur, struct file *file,
+		loff_t pos, loff_t end)
+{
+	cur->file = file;
+	cur->pos = pos;
+	cur->end = end;
+	cur->buf_pos = 0;
+	cur->buf_len = 0;
+	cur->buf = vmalloc(DIARYFS_CURSOR_BUF);
+	return cur->buf ? 0 : -ENOMEM;
+}
+
+void diaryfs_cursor_release(struct diaryfs_cursor *cur)
+{
+	vfree(cur->buf);
+	cur->buf = NULL;
+}
+
+/* make [pos, pos + len) of the file available in the buffer */
+static int diaryfs_cursor_fill(struct diaryfs_cursor *cur, loff_t pos,
+		size_t len)
+{
+	loff_t start = round_down(pos, PAGE_SIZE);
+	int ret;
+
+	if (pos >= cur->buf_pos && pos + len <= cur->buf_pos + cur->buf_len)
+		return 0;
+
+	ret = kernel_read(cur->file, start, cur->buf, DIARYFS_CURSOR_BUF);
+	if (ret < 0)
+		return ret;
+	cur->buf_pos = start;
+	cur->buf_len = ret;
+	return pos + len <= start + ret ? 0 : -ENODATA;
+}
+
+struct diaryfs_rec *diaryfs_cursor_next(struct diaryfs_cursor *cur,
+		loff_t *rec_pos)
+{
+	struct diaryfs_rec *rec;
+	size_t rec_len;
+	u32 crc;
+	int err;
+
+	while (cur->pos + sizeof(*rec) <= cur->end) {
+		err = diaryfs_cursor_fill(cur, cur->pos, sizeof(*rec));
+		if (err == -ENODATA)
+			break;
+		if (err)
+			return ERR_PTR(err);
+		rec = (struct diaryfs_rec *)(cur->buf + cur->pos - cur->buf_pos);
+		rec_len = le32_to_cpu(rec->rec_len);
+
+		if (le32_to_cpu(rec->magic) != DIARYFS_REC_MAGIC ||
+		    rec_len < sizeof(*rec) ||
+		    rec_len > DIARYFS_LOG_BATCH_PAGES * PAGE_SIZE)
+			goto skip;
+		err = diaryfs_cursor_fill(cur, cur->pos, rec_len);
+		if (err == -ENODATA)
+			break;
+		if (err)
+			return ERR_PTR(err);
+		rec = (struct diaryfs_rec *)(cur->buf + cur->pos - cur->buf_pos);
+
+		crc = le32_to_cpu(rec->crc);
+		rec->crc = 0;
+		if (crc32c(crc32c(~0, rec, sizeof(*rec)), rec + 1,
+			   le32_to_cpu(rec->payload_len)) != crc)
+			goto skip;
+		rec->crc = cpu_to_le32(crc);
+
+		*rec_pos = cur->pos;
+		cur->pos += rec_len;
+		if (le16_to_cpu(rec->type) == DIARYFS_REC_PAD)
+			continue;
+		return rec;
+skip:
+		/* zero fill or garbage: resume at the next page */
+		cur->pos = round_down(cur->pos, PAGE_SIZE) + PAGE_SIZE;
+	}
+	return NULL;
+}
+
+/* collects segment sequence numbers while scanning the journal directory */
+struct diaryfs_seg_scan {
+	struct dir_context ctx;
+	struct list_head *segs;
+	int err;
+};
+
+static int diaryfs_seg_scan_actor(struct dir_context *ctx, const char *name,
+		int namelen, loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct diaryfs_seg_scan *scan =
+		container_of(ctx, struct diaryfs_seg_scan, ctx);
+	char buf[DIARYFS_SEG_NAME_LEN];
+	struct diaryfs_seg *seg, *pos;
+	u64 seq;
+
+	if (namelen != DIARYFS_SEG_NAME_LEN - 1)
+		return 0;
+	memcpy(buf, name, namelen);
+	buf[namelen] = '\0';
+	if (kstrtou64(buf, 16, &seq))
+		return 0;
+
+	seg = kzalloc(sizeof(*seg), GFP_KERNEL);
+	if (!seg) {
+		scan->err = -ENOMEM;
+		return -ENOMEM;
+	}
+	seg->seq = seq;
+
+	/* keep the list sorted, oldest segment first */
+	list_for_each_entry_reverse(pos, scan->segs, list)
+		if (pos->seq < seq)
+			break;
+	list_add(&seg->list, &pos->list);
+	return 0;
+}
+
+/* recover the time range and size of a segment that was never sealed */
+static int diaryfs_seg_recover(struct diaryfs_seg *seg, struct file *file)
+{
+	struct diaryfs_cursor cur;
+	struct diaryfs_rec *rec;
+	loff_t pos, end = seg->start;
+	int err;
+
+	err = diaryfs_cursor_init(&cur, file, seg->start,
+			i_size_read(file_inode(file)));
+	if (err)
+		return err;
+	while ((rec = diaryfs_cursor_next(&cur, &pos)) && !IS_ERR(rec)) {
+		u64 time = le64_to_cpu(rec->time);
+
+		if (!seg->min_time || time < seg->min_time)
+			seg->min_time = time;
+		if (time > seg->max_time)
+			seg->max_time = time;
+		if (le64_to_cpu(rec->seq) > seg->max_seq)
+			seg->max_seq = le64_to_cpu(rec->seq);
+		if (le16_to_cpu(rec->type) == DIARYFS_REC_CHUNKS)
+			seg->flags |= DIARYFS_SEG_CHUNKS;
+		end = pos + le32_to_cpu(rec->rec_len);
+	}
+	diaryfs_cursor_release(&cur);
+	if (IS_ERR(rec))
+		return PTR_ERR(rec);
+	seg->size = PAGE_ALIGN(end);
+	return 0;
+}
+
+/* read the headers of all segments and pick up the last one for appends */
+static int diaryfs_log_load(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_log *log = &sbi->log;
+	struct diaryfs_seg_scan scan = {
+		.ctx.actor = diaryfs_seg_scan_actor,
+		.segs = &log->segs,
+	};
+	struct diaryfs_seg *seg, *n, *last = NULL;
+	struct diaryfs_seg_hdr hdr;
+	struct file *dir, *file;
+	int err;
+
+	dir = dentry_open(&log->dir, O_RDONLY | O_DIRECTORY, current_cred());
+	if (IS_ERR(dir))
+		return PTR_ERR(dir);
+	err = iterate_dir(dir, &scan.ctx);
+	fput(dir);
+	if (!err)
+		err = scan.err;
+	if (err)
+		return err;
+
+	list_for_each_entry_safe(seg, n, &log->segs, list) {
+		file = diaryfs_seg_open(sbi, seg->seq, O_RDONLY);
+		if (IS_ERR(file))
+			return PTR_ERR(file);
+		err = diaryfs_seg_read_hdr(file, &hdr);
+		if (!err) {
+			seg->created = le64_to_cpu(hdr.created);
+			seg->min_time = le64_to_cpu(hdr.min_time);
+			seg->max_time = le64_to_cpu(hdr.max_time);
+			seg->max_seq = le64_to_cpu(hdr.max_seq);
+			seg->size = le64_to_cpu(hdr.size);
+			seg->start = max_t(loff_t, le64_to_cpu(hdr.start),
+					PAGE_SIZE);
+			seg->flags = le32_to_cpu(hdr.flags);
+			if (!(seg->flags & DIARYFS_SEG_SEALED))
+				err = diaryfs_seg_recover(seg, file);
+		}
+		fput(file);
+		if (err == -EUCLEAN) {
+			printk(KERN_WARNING "diaryfs: ignoring damaged segment "
+					"%016llx\n", seg->seq);
+			list_del(&seg->list);
+			kfree(seg);
+			continue;
+		}
+		if (err)
+			return err;
+		if (seg->max_seq > atomic64_read(&sbi->wseq))
+			atomic64_set(&sbi->wseq, seg->max_seq);
+		last = seg;
+	}
+
+	/* read-only: the log ends where the newest segment does */
+	if (sbi->read_only) {
+		log->active = last;
+		log->tail = last ? last->size : 0;
+		return 0;
+	}
+
+	/* resume the newest segment if it still has room */
+	if (last && !(last->flags & DIARYFS_SEG_SEALED) &&
+	    last->size < DIARYFS_SEG_SIZE) {
+		file = diaryfs_seg_open(sbi, last->seq, O_RDWR);
+		if (IS_ERR(file))
+			return PTR_ERR(file);
+		log->file = file;
+		log->active = last;
+		log->tail = last->size;
+		return 0;
+	}
+	return diaryfs_seg_start(log, last ? last->seq + 1 : 1);
+}
+
+/*
+ * Open (creating if needed) the journal under the lower root @lower_root.
+ * Appends resume on the first page boundary past the last good record, so
+ * a batch torn by a crash is never written into.  A read-only mount only
+ * opens what is already there, for reading; with no journal at all it has
+ * no history.
+ */
+int diaryfs_log_open(struct diaryfs_sb_info *sbi, const struct path *lower_root)
+{
+	struct diaryfs_log *log = &sbi->log;
+	unsigned int i;
+	int err;
+
+	mutex_init(&log->lock);
+	spin_lock_init(&log->seg_lock);
+	INIT_LIST_HEAD(&log->segs);
+
+	err = diaryfs_meta_mkdir(lower_root, DIARYFS_META_DIR, !sbi->read_only,
+			&sbi->meta_path);
+	if (err)
+		return err == -ENOENT && sbi->read_only ? 0 : err;
+	err = diaryfs_meta_mkdir(&sbi->meta_path, DIARYFS_JOURNAL_DIR,
+			!sbi->read_only, &log->dir);
+	if (err == -ENOENT && sbi->read_only)
+		return 0;
+	if (err)
+		goto out_err;
+
+	for (i = 0; i < DIARYFS_LOG_BATCH_PAGES; i++) {
+		log->batch[i] = alloc_page(GFP_KERNEL);
+		if (!log->batch[i]) {
+			err = -ENOMEM;
+			goto out_err;
+		}
+	}
+
+	err = diaryfs_log_load(sbi);
+	if (err)
+		goto out_err;
+	return 0;
+
+out_err:
+	diaryfs_log_close(sbi);
+	return err;
+}
+
+void diaryfs_log_close(struct diaryfs_sb_info *sbi)
+{
+	struct diaryfs_log *log = &sbi->log;
+	struct diaryfs_seg *seg, *n;
+	unsigned int i;
+
+	if (log->file) {
+		diaryfs_log_sync(sbi);
+		/* leave the summary as of now; a remount still rescans the tail */
+		diaryfs_seg_write_hdr(log->file, log->active);
+		fput(log->file);
+		log->file = NULL;
+		log->active = NULL;
+	}
+	list_for_each_entry_safe(seg, n, &log->segs, list) {
+		list_del(&seg->list);
+		kfree(seg);
+	}
+	for (i = 0; i < DIARYFS_LOG_BATCH_PAGES; i++) {
+		if (log->batch[i])
+			__free_page(log->batch[i]);
+		log->batch[i] = NULL;
+	}
+	if (log->dir.dentry) {
+		path_put(&log->dir);
+		log->dir.dentry = NULL;
+	}
+	if (sbi->meta_path.dentry) {
+		path_put(&sbi->meta_path);
+		sbi->meta_path.dentry = NULL;
+	}
+}
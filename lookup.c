@@ -12,6 +12,7 @@
  */ 
 
 #include "diaryfs.h"
+#include "diaryfs_trace.h"
 
 /* The dentry cache is just so we have properly sized dentries */
 static struct kmem_cache *diaryfs_dentry_cachep;
@@ -28,16 +29,32 @@ int diaryfs_init_dentry_cache(void)
 
 void diaryfs_destroy_dentry_cache(void)
 {
-	if (diaryfs_dentry_cachep)
+	if (diaryfs_dentry_cachep) {
+		/* wait for private data still on its way out */
+		rcu_barrier();
 		kmem_cache_destroy(diaryfs_dentry_cachep);
+	}
+}
+
+static void diaryfs_free_dentry_info(struct rcu_head *head)
+{
+	kmem_cache_free(diaryfs_dentry_cachep,
+			container_of(head, struct diaryfs_dentry_info, rcu));
 }
 
+/*
+ * Private data outlives the dentry by a grace period, as the dentry itself
+ * does, since d_revalidate in RCU-walk reads it without a reference.
+ */
 void free_dentry_private_data(struct dentry *dentry)
 {
+	struct diaryfs_dentry_info *info;
+
 	if (!dentry || !dentry->d_fsdata)
 		return;
-	kmem_cache_free(diaryfs_dentry_cachep, dentry->d_fsdata);
-	dentry->d_fsdata = NULL;
+	info = dentry->d_fsdata;
+	WRITE_ONCE(dentry->d_fsdata, NULL);
+	call_rcu(&info->rcu, diaryfs_free_dentry_info);
 }
 
 /* allocate new dentry private data */
@@ -51,6 +68,7 @@ int new_dentry_private_data(struct dentry *dentry)
 		return -ENOMEM;
 
 	spin_lock_init(&info->lock);
+	seqcount_init(&info->seq);
 	dentry->d_fsdata = info;
 
 	return 0;
@@ -59,7 +77,9 @@ int new_dentry_private_data(struct dentry *dentry)
 static int diaryfs_inode_test(struct inode *inode, void *candidate_lower_inode)
 {
 	struct inode *current_lower_inode = diaryfs_lower_inode(inode);
-	if (current_lower_inode == (struct inode *)candidate_lower_inode)
+	/* snapshot inodes share the lower inode, but never match */
+	if (current_lower_inode == (struct inode *)candidate_lower_inode &&
+	    !DIARYFS_I(inode)->snap_time)
 		return 1; /* found a match */
 	else
 		return 0; /* no match */
@@ -214,6 +234,18 @@ static struct dentry *__diaryfs_lookup(struct dentry *dentry,
 
 	name = dentry->d_name.name;
 
+	/* our own metadata is not part of the namespace */
+	if (diaryfs_is_meta_name(dentry->d_parent, name, dentry->d_name.len)) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	/* the snapshot namespace shadows anything the lower root has there */
+	if (diaryfs_is_snap_name(dentry->d_parent, name, dentry->d_name.len)) {
+		err = diaryfs_snap_lookup_top(dentry, lower_parent_path);
+		goto out;
+	}
+
 	/* now start the actual lookup procedure */
 	lower_dir_dentry = lower_parent_path->dentry;
 	lower_dir_mnt = lower_parent_path->mnt;
@@ -276,6 +308,7 @@ struct dentry *diaryfs_lookup(struct inode *dir, struct dentry *dentry,
 	int err;
 	struct dentry *ret, *parent;
 	struct path lower_parent_path;
+	u64 start = diaryfs_trace_start(diaryfs_lookup);
 
 	parent = dget_parent(dentry);
 
@@ -300,6 +333,9 @@ struct dentry *diaryfs_lookup(struct inode *dir, struct dentry *dentry,
 				diaryfs_lower_inode(parent->d_inode));
 
 out:
+	trace_diaryfs_lookup(dir, dentry, PTR_ERR_OR_ZERO(ret), start);
+	diaryfs_debug("lookup %pd in dir %lu: %d\n", dentry, dir->i_ino,
+			PTR_ERR_OR_ZERO(ret));
 	diaryfs_put_lower_path(parent, &lower_parent_path);
 	dput(parent);
 	return ret;
@@ -14,6 +14,128 @@
 #include "diaryfs.h"
 #include <linux/module.h>
 
+#define CREATE_TRACE_POINTS
+#include "diaryfs_trace.h"
+
+DEFINE_STATIC_KEY_FALSE(diaryfs_debug_key);
+
+static bool diaryfs_debug_on;
+
+static int diaryfs_debug_set(const char *val, const struct kernel_param *kp)
+{
+	int err = param_set_bool(val, kp);
+
+	if (err)
+		return err;
+	/* writes to a parameter are serialised, so this can't race itself */
+	if (diaryfs_debug_on && !static_key_enabled(&diaryfs_debug_key))
+		static_branch_enable(&diaryfs_debug_key);
+	else if (!diaryfs_debug_on && static_key_enabled(&diaryfs_debug_key))
+		static_branch_disable(&diaryfs_debug_key);
+	return 0;
+}
+
+static const struct kernel_param_ops diaryfs_debug_ops = {
+	.set	= diaryfs_debug_set,
+	.get	= param_get_bool,
+};
+module_param_cb(debug, &diaryfs_debug_ops, &diaryfs_debug_on, 0644);
+MODULE_PARM_DESC(debug, "Log every read, write and lookup at KERN_DEBUG");
+
+/* captured pages the versioning queue may hold before writers wait */
+unsigned int diaryfs_queue_depth = 1024;
+module_param_named(queue_depth, diaryfs_queue_depth, uint, 0644);
+MODULE_PARM_DESC(queue_depth, "Max pages waiting to be versioned per mount");
+
+/* chunk index entries kept in memory per mount */
+unsigned int diaryfs_chunk_cache = 65536;
+module_param_named(chunk_cache, diaryfs_chunk_cache, uint, 0644);
+MODULE_PARM_DESC(chunk_cache, "Chunk index entries cached in memory per mount");
+
+/* rebuilt historical pages kept in memory per mount */
+unsigned int diaryfs_hist_cache = 8192;
+module_param_named(hist_cache, diaryfs_hist_cache, uint, 0644);
+MODULE_PARM_DESC(hist_cache, "Rebuilt historical pages cached in memory per mount");
+
+/* most version records of a page between two checkpoints of it */
+unsigned int diaryfs_ckpt_chain = 64;
+module_param_named(ckpt_chain, diaryfs_ckpt_chain, uint, 0644);
+MODULE_PARM_DESC(ckpt_chain, "Max records per page between checkpoints, 0 for none");
+
+enum {
+	Opt_compress,
+	Opt_retention,
+	Opt_err,
+};
+
+static const match_table_t diaryfs_tokens = {
+	{Opt_compress, "compress=%s"},
+	{Opt_retention, "retention=%u"},
+	{Opt_err, NULL},
+};
+
+static int diaryfs_parse_options(struct diaryfs_sb_info *sbi, char *options)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p, *name;
+	unsigned int codec;
+	int err, n;
+
+	/* defaults */
+	sbi->codec = DIARYFS_CODEC_LZ4;
+	sbi->retention = DIARYFS_RETENTION_DEFAULT;
+
+	while (options && (p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, diaryfs_tokens, args)) {
+		case Opt_compress:
+			name = match_strdup(&args[0]);
+			if (!name)
+				return -ENOMEM;
+			for (codec = 0; codec < DIARYFS_CODEC_MAX; codec++)
+				if (!strcmp(name, diaryfs_codec_name(codec)))
+					break;
+			kfree(name);
+			if (codec == DIARYFS_CODEC_MAX) {
+				printk(KERN_ERR "diaryfs: unknown codec in "
+				       "'%s'\n", p);
+				return -EINVAL;
+			}
+			sbi->codec = codec;
+			break;
+		case Opt_retention:
+			if (match_int(&args[0], &n) || n < 0) {
+				printk(KERN_ERR "diaryfs: bad value in '%s'\n", p);
+				return -EINVAL;
+			}
+			sbi->retention = n;
+			break;
+		default:
+			printk(KERN_ERR "diaryfs: unrecognized option '%s'\n", p);
+			return -EINVAL;
+		}
+	}
+
+	/* about 32 segments to the window, so expiry is fine grained */
+	sbi->seg_span = sbi->retention ?
+		max_t(u64, sbi->retention * NSEC_PER_SEC / 32,
+		      DIARYFS_SEG_SPAN_MIN) : U64_MAX / 2;
+
+	err = diaryfs_codec_probe(sbi->codec);
+	/* the crypto API only has zstd from 4.19 on */
+	if (err && sbi->codec == DIARYFS_CODEC_ZSTD) {
+		printk(KERN_WARNING "diaryfs: codec zstd unavailable: %d, "
+		       "using lz4\n", err);
+		sbi->codec = DIARYFS_CODEC_LZ4;
+		err = diaryfs_codec_probe(sbi->codec);
+	}
+	if (err)
+		printk(KERN_ERR "diaryfs: codec %s unavailable: %d\n",
+		       diaryfs_codec_name(sbi->codec), err);
+	return err;
+}
+
 /*
  * There is no need to lock the diaryfs_super_info's rwsem as there is no
  * way anyone can have a reference to the superblock at this point in time.
@@ -23,7 +145,8 @@ static int diaryfs_read_super(struct super_block *sb, void *raw_data, int silent
 	int err = 0;
 	struct super_block *lower_sb;
 	struct path lower_path;
-	char *dev_name = (char *) raw_data;
+	struct diaryfs_mount_data *md = raw_data;
+	const char *dev_name = md->dev_name;
 	struct inode *inode;
 
 	if (!dev_name) {
@@ -50,6 +173,64 @@ static int diaryfs_read_super(struct super_block *sb, void *raw_data, int silent
 		goto out_free;
 	}
 
+	err = diaryfs_parse_options(DIARYFS_SB(sb), md->options);
+	if (err)
+		goto out_free_sbi;
+
+	/* nothing can be versioned over a read-only lower, so be read-only too */
+	if (__mnt_is_readonly(lower_path.mnt))
+		sb->s_flags |= MS_RDONLY;
+	DIARYFS_SB(sb)->read_only = sb->s_flags & MS_RDONLY;
+
+	err = diaryfs_stats_init(DIARYFS_SB(sb));
+	if (err) {
+		printk(KERN_CRIT "diaryfs: read_super: out of memory\n");
+		goto out_free_sbi;
+	}
+
+	/* start the versioning workers */
+	err = diaryfs_vq_init(DIARYFS_SB(sb));
+	if (err) {
+		printk(KERN_CRIT "diaryfs: read_super: out of memory\n");
+		goto out_free_stats;
+	}
+
+	/* open the version log in the lower root */
+	err = diaryfs_log_open(DIARYFS_SB(sb), &lower_path);
+	if (err) {
+		printk(KERN_ERR "diaryfs: cannot open version log: %d\n", err);
+		goto out_free_vq;
+	}
+
+	/* and the chunk store next to it */
+	err = diaryfs_chunk_open(DIARYFS_SB(sb));
+	if (err) {
+		printk(KERN_ERR "diaryfs: cannot open chunk store: %d\n", err);
+		goto out_close_log;
+	}
+
+	/* and the per-file indexes of what is in the log */
+	err = diaryfs_index_open(DIARYFS_SB(sb));
+	if (err) {
+		printk(KERN_ERR "diaryfs: cannot open version index: %d\n", err);
+		goto out_close_chunks;
+	}
+
+	/* history older than the retention window is dropped in the background */
+	err = diaryfs_gc_start(DIARYFS_SB(sb));
+	if (err)
+		goto out_close_index;
+
+	/* and old pages, once rebuilt, are kept around */
+	err = diaryfs_hcache_init(DIARYFS_SB(sb));
+	if (err)
+		goto out_stop_gc;
+
+	/* and what it all costs is published in sysfs */
+	err = diaryfs_sysfs_register(sb);
+	if (err)
+		goto out_destroy_hcache;
+
 	/* set the lower superblock field of upper superblock */
 	lower_sb = lower_path.dentry->d_sb;
 	atomic_inc(&lower_sb->s_active);
@@ -96,6 +277,7 @@ static int diaryfs_read_super(struct super_block *sb, void *raw_data, int silent
 	 * d_rehash it.
 	 */
 	d_rehash(sb->s_root);
+	save_mount_options(sb, md->options_orig);
 	if (!silent)
 		printk(KERN_INFO
 		       "diaryfs: mounted on top of %s type %s\n",
@@ -110,6 +292,22 @@ out_iput:
 out_sput:
 	/* drop refs we took earlier */
 	atomic_dec(&lower_sb->s_active);
+	diaryfs_sysfs_unregister(sb);
+out_destroy_hcache:
+	diaryfs_hcache_destroy(DIARYFS_SB(sb));
+out_stop_gc:
+	diaryfs_gc_stop(DIARYFS_SB(sb));
+out_close_index:
+	diaryfs_index_close(DIARYFS_SB(sb));
+out_close_chunks:
+	diaryfs_chunk_close(DIARYFS_SB(sb));
+out_close_log:
+	diaryfs_log_close(DIARYFS_SB(sb));
+out_free_vq:
+	diaryfs_vq_destroy(DIARYFS_SB(sb));
+out_free_stats:
+	diaryfs_stats_destroy(DIARYFS_SB(sb));
+out_free_sbi:
 	kfree(DIARYFS_SB(sb));
 	sb->s_fs_info = NULL;
 out_free:
@@ -122,10 +320,19 @@ out:
 struct dentry *diaryfs_mount(struct file_system_type *fs_type, int flags,
 			    const char *dev_name, void *raw_data)
 {
-	void *lower_path_name = (void *) dev_name;
+	struct diaryfs_mount_data md = {
+		.dev_name = dev_name,
+		.options = raw_data,
+	};
+	struct dentry *root;
 
-	return mount_nodev(fs_type, flags, lower_path_name,
-			   diaryfs_read_super);
+	/* option parsing chops up the string; keep a copy for show_options */
+	md.options_orig = kstrdup(raw_data, GFP_KERNEL);
+	if (raw_data && !md.options_orig)
+		return ERR_PTR(-ENOMEM);
+	root = mount_nodev(fs_type, flags, &md, diaryfs_read_super);
+	kfree(md.options_orig);
+	return root;
 }
 
 static struct file_system_type diaryfs_fs_type = {
@@ -143,10 +350,23 @@ static int __init init_diaryfs_fs(void)
 
 	printk("Registering diaryfs v.0.1");
 
+	/* can't fail, and the error path below tears the pools down */
+	diaryfs_init_codecs();
+	diaryfs_init_gear();
+
 	err = diaryfs_init_inode_cache();
 	if (err)
 		goto out;
 	err = diaryfs_init_dentry_cache();
+	if (err)
+		goto out;
+	err = diaryfs_init_hash_cache();
+	if (err)
+		goto out;
+	err = diaryfs_init_hpage_cache();
+	if (err)
+		goto out;
+	err = diaryfs_init_sysfs();
 	if (err)
 		goto out;
 	err = register_filesystem(&diaryfs_fs_type);
@@ -155,6 +375,10 @@ out:
 		printk("diaryfs: error\n");
 		diaryfs_destroy_inode_cache();
 		diaryfs_destroy_dentry_cache();
+		diaryfs_destroy_hash_cache();
+		diaryfs_destroy_hpage_cache();
+		diaryfs_destroy_sysfs();
+		diaryfs_destroy_codecs();
 	}
 	return err;
 }
@@ -163,7 +387,11 @@ static void __exit exit_diaryfs_fs(void)
 {
 	diaryfs_destroy_inode_cache();
 	diaryfs_destroy_dentry_cache();
+	diaryfs_destroy_hash_cache();
+	diaryfs_destroy_hpage_cache();
+	diaryfs_destroy_codecs();
 	unregister_filesystem(&diaryfs_fs_type);
+	diaryfs_destroy_sysfs();
 	printk("Completed diaryfs module unload\n");
 }
 
@@ -13,65 +13,108 @@
 
 #include "diaryfs.h"
 
+/*
+ * Our vmas have the lower file as vm_file, so the lower vm_ops can be handed
+ * the vma as it is; the upper file rides along in vm_private_data, with a
+ * reference of its own.
+ */
+static void diaryfs_vm_open(struct vm_area_struct *vma)
+{
+	struct file *file = vma->vm_private_data;
+	const struct vm_operations_struct *lower_vm_ops;
+
+	lower_vm_ops = DIARYFS_F(file)->lower_vm_ops;
+	get_file(file);
+	if (lower_vm_ops->open)
+		lower_vm_ops->open(vma);
+}
+
+static void diaryfs_vm_close(struct vm_area_struct *vma)
+{
+	struct file *file = vma->vm_private_data;
+	const struct vm_operations_struct *lower_vm_ops;
+
+	lower_vm_ops = DIARYFS_F(file)->lower_vm_ops;
+	if (lower_vm_ops->close)
+		lower_vm_ops->close(vma);
+	fput(file);
+}
+
 static int diaryfs_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
-	int err;
-	struct file *file, *lower_file;
+	struct file *file = vma->vm_private_data;
 	const struct vm_operations_struct *lower_vm_ops;
-	struct vm_area_struct lower_vma;
 
-	memcpy(&lower_vma, vma, sizeof(struct vm_area_struct));
-	file = lower_vma.vm_file;
 	lower_vm_ops = DIARYFS_F(file)->lower_vm_ops;
 	BUG_ON(!lower_vm_ops);
+	return lower_vm_ops->fault(vma, vmf);
+}
 
-	lower_file = diaryfs_lower_file(file);
-	/*
-	 * XXX: vm_ops->fault may be called in parallel.  Because we have to
-	 * resort to temporarily changing the vma->vm_file to point to the
-	 * lower file, a concurrent invocation of diaryfs_fault could see a
-	 * different value.  In this workaround, we keep a different copy of
-	 * the vma structure in our stack, so we never expose a different
-	 * value of the vma->vm_file called to us, even temporarily.  A
-	 * better fix would be to change the calling semantics of ->fault to
-	 * take an explicit file pointer.
-	 */
-	lower_vma.vm_file = lower_file;
-	err = lower_vm_ops->fault(&lower_vma, vmf);
-	return err;
+static void diaryfs_map_pages(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct file *file = vma->vm_private_data;
+	const struct vm_operations_struct *lower_vm_ops;
+
+	/* without it, fault-around falls back to ->fault */
+	lower_vm_ops = DIARYFS_F(file)->lower_vm_ops;
+	if (lower_vm_ops->map_pages)
+		lower_vm_ops->map_pages(vma, vmf);
 }
 
+/*
+ * A clean page of a shared mapping is about to be written.  Keep what it
+ * holds now, as a version of its own, before anything lands in it; it
+ * stays writable until writeback cleans it, so this happens once per
+ * round of stores rather than once per store.
+ *
+ * write(2) takes i_mutex before mmap_sem, and we are called with mmap_sem
+ * held, so i_mutex can't be taken here.  The capture is ordered with
+ * write(2) by the inode's vlock instead.  Writers only hold it while they
+ * number and queue a write they have captured, never across a copy from
+ * user memory; a write queued before this fault is versioned before it,
+ * even if it is still landing.  Nothing else is waited for with mmap_sem
+ * held: a fault doesn't wait for room in the queue, which only overshoots
+ * by the one page.
+ */
 static int diaryfs_page_mkwrite(struct vm_area_struct *vma,
 			       struct vm_fault *vmf)
 {
-	int err = 0;
-	struct file *file, *lower_file;
+	struct file *file = vma->vm_private_data;
+	struct inode *inode = file_inode(file);
+	struct page *page = vmf->page;
 	const struct vm_operations_struct *lower_vm_ops;
-	struct vm_area_struct lower_vma;
+	int ret = 0;
+	int err;
 
-	memcpy(&lower_vma, vma, sizeof(struct vm_area_struct));
-	file = lower_vma.vm_file;
 	lower_vm_ops = DIARYFS_F(file)->lower_vm_ops;
 	BUG_ON(!lower_vm_ops);
-	if (!lower_vm_ops->page_mkwrite)
-		goto out;
 
-	lower_file = diaryfs_lower_file(file);
-	/*
-	 * XXX: vm_ops->page_mkwrite may be called in parallel.
-	 * Because we have to resort to temporarily changing the
-	 * vma->vm_file to point to the lower file, a concurrent
-	 * invocation of diaryfs_page_mkwrite could see a different
-	 * value.  In this workaround, we keep a different copy of the
-	 * vma structure in our stack, so we never expose a different
-	 * value of the vma->vm_file called to us, even temporarily.
-	 * A better fix would be to change the calling semantics of
-	 * ->page_mkwrite to take an explicit file pointer.
-	 */
-	lower_vma.vm_file = lower_file;
-	err = lower_vm_ops->page_mkwrite(&lower_vma, vmf);
+	/* taken before the page lock, as the truncate capture does */
+	mutex_lock(&DIARYFS_I(inode)->vlock);
+	if (lower_vm_ops->page_mkwrite) {
+		ret = lower_vm_ops->page_mkwrite(vma, vmf);
+		if (ret & (VM_FAULT_ERROR | VM_FAULT_NOPAGE))
+			goto out;
+	}
+	if (!(ret & VM_FAULT_LOCKED)) {
+		lock_page(page);
+		if (page->mapping != file_inode(vma->vm_file)->i_mapping) {
+			/* truncated meanwhile */
+			unlock_page(page);
+			ret = VM_FAULT_NOPAGE;
+			goto out;
+		}
+		ret |= VM_FAULT_LOCKED;
+	}
+
+	err = diaryfs_version_mkwrite(inode, page);
+	if (err) {
+		unlock_page(page);
+		ret = err == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+	}
 out:
-	return err;
+	mutex_unlock(&DIARYFS_I(inode)->vlock);
+	return ret;
 }
 
 static ssize_t diaryfs_direct_IO(struct kiocb *iocb,
@@ -90,6 +133,9 @@ const struct address_space_operations diaryfs_aops = {
 };
 
 const struct vm_operations_struct diaryfs_vm_ops = {
+	.open		= diaryfs_vm_open,
+	.close		= diaryfs_vm_close,
 	.fault		= diaryfs_fault,
+	.map_pages	= diaryfs_map_pages,
 	.page_mkwrite	= diaryfs_page_mkwrite,
 };
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+#include "diaryfs_trace.h"
+
+/*
+ * Per-inode page-hash index.
+ *
+ * For every page we have written through diaryfs we remember the hash of
+ * the last range written into it and, when the whole page is known, the
+ * hash of the entire page.  That is enough to recognise a write that does
+ * not change anything without reading the old data back from the lower
+ * file.  The hashes are short, so a match is only a hint: the write path
+ * confirms it against the lower page cache before it passes a write over.
+ * The index is filled lazily by the write path and thrown away whenever
+ * the lower file changes behind our back.
+ */
+
+static struct kmem_cache *diaryfs_hash_cachep;
+
+int diaryfs_init_hash_cache(void)
+{
+	diaryfs_hash_cachep =
+		kmem_cache_create("diaryfs_page_hash",
+				  sizeof(struct diaryfs_page_hash),
+				  0, SLAB_RECLAIM_ACCOUNT, NULL);
+
+	return diaryfs_hash_cachep ? 0 : -ENOMEM;
+}
+
+void diaryfs_destroy_hash_cache(void)
+{
+	if (diaryfs_hash_cachep)
+		kmem_cache_destroy(diaryfs_hash_cachep);
+}
+
+void diaryfs_hash_init(struct diaryfs_inode_info *info)
+{
+	spin_lock_init(&info->hash_lock);
+	INIT_RADIX_TREE(&info->page_hashes, GFP_ATOMIC);
+	info->nr_hashes = 0;
+}
+
+/* drop entries for pages [start, end); caller holds hash_lock */
+static void __diaryfs_hash_drop(struct diaryfs_inode_info *info,
+		pgoff_t start, pgoff_t end)
+{
+	struct diaryfs_page_hash *batch[16];
+	unsigned int i, n;
+
+	while (start < end) {
+		n = radix_tree_gang_lookup(&info->page_hashes, (void **)batch,
+				start, ARRAY_SIZE(batch));
+		if (!n)
+			break;
+		for (i = 0; i < n; i++) {
+			start = batch[i]->index + 1;
+			if (batch[i]->index >= end)
+				return;
+			radix_tree_delete(&info->page_hashes, batch[i]->index);
+			kmem_cache_free(diaryfs_hash_cachep, batch[i]);
+			info->nr_hashes--;
+		}
+	}
+}
+
+/* forget pages covering bytes [start, end) of @inode */
+void diaryfs_hash_invalidate(struct inode *inode, loff_t start, loff_t end)
+{
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+
+	if (end <= start)
+		return;
+	spin_lock(&info->hash_lock);
+	__diaryfs_hash_drop(info, start >> PAGE_SHIFT,
+			((end - 1) >> PAGE_SHIFT) + 1);
+	spin_unlock(&info->hash_lock);
+}
+
+void diaryfs_hash_clear(struct inode *inode)
+{
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+
+	spin_lock(&info->hash_lock);
+	__diaryfs_hash_drop(info, 0, ULONG_MAX);
+	spin_unlock(&info->hash_lock);
+}
+
+/*
+ * Remember the lower mtime and size after one of our own writes, so that
+ * the change is not mistaken for a foreign one.
+ */
+void diaryfs_hash_stamp(struct inode *inode)
+{
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+	struct inode *lower_inode = diaryfs_lower_inode(inode);
+
+	spin_lock(&info->hash_lock);
+	info->hash_mtime = lower_inode->i_mtime;
+	info->hash_size = i_size_read(lower_inode);
+	spin_unlock(&info->hash_lock);
+}
+
+/*
+ * The index is only good while we are the only one modifying the lower
+ * file.  If its mtime or size moved since our last write, start over.
+ */
+static void diaryfs_hash_check_lower(struct inode *inode)
+{
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+	struct inode *lower_inode = diaryfs_lower_inode(inode);
+
+	spin_lock(&info->hash_lock);
+	if (!timespec_equal(&info->hash_mtime, &lower_inode->i_mtime) ||
+	    info->hash_size != i_size_read(lower_inode)) {
+		__diaryfs_hash_drop(info, 0, ULONG_MAX);
+		info->hash_mtime = lower_inode->i_mtime;
+		info->hash_size = i_size_read(lower_inode);
+	}
+	spin_unlock(&info->hash_lock);
+}
+
+/*
+ * diaryfs_hash_unchanged - would writing @len bytes hashing to @hash at
+ * @off within page @index leave the page as it is?
+ *
+ * Returns true when the index says so, which the caller still has to
+ * confirm; false means "changed or unknown", and the caller has to look at
+ * the old data.
+ */
+bool diaryfs_hash_unchanged(struct inode *inode, pgoff_t index,
+		unsigned int off, unsigned int len, u32 hash)
+{
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+	struct diaryfs_page_hash *ph;
+	bool same = false;
+
+	diaryfs_hash_check_lower(inode);
+
+	spin_lock(&info->hash_lock);
+	ph = radix_tree_lookup(&info->page_hashes, index);
+	if (!ph)
+		goto out;
+	if ((ph->flags & DIARYFS_PH_FULL) && off == 0 && len == PAGE_SIZE)
+		same = ph->page_hash == hash;
+	else if ((ph->flags & DIARYFS_PH_SUB) && ph->sub_off == off &&
+		 ph->sub_len == len)
+		same = ph->sub_hash == hash;
+out:
+	spin_unlock(&info->hash_lock);
+	diaryfs_stat_add(DIARYFS_SB(inode->i_sb), same ?
+			DIARYFS_STAT_HASH_HITS : DIARYFS_STAT_HASH_MISSES, 1);
+	trace_diaryfs_hash(inode, index, off, len, same);
+	return same;
+}
+
+/*
+ * diaryfs_hash_update - record write @seq into page @index
+ *
+ * @hash covers the @len bytes written at @off.  This runs in the write path
+ * before the write is versioned, so unless the write covered the whole page
+ * the whole-page hash is dropped here; the versioning worker puts it back
+ * with diaryfs_hash_fill once it has seen the page.  Callers follow up with
+ * diaryfs_hash_stamp once the lower write is done.
+ */
+void diaryfs_hash_update(struct inode *inode, pgoff_t index,
+		unsigned int off, unsigned int len, u32 hash, u64 seq)
+{
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+	struct diaryfs_page_hash *ph, *new = NULL;
+
+	spin_lock(&info->hash_lock);
+	ph = radix_tree_lookup(&info->page_hashes, index);
+	if (ph || info->nr_hashes >= DIARYFS_HASH_MAX_PAGES)
+		goto fill;
+	spin_unlock(&info->hash_lock);
+
+	new = kmem_cache_zalloc(diaryfs_hash_cachep, GFP_NOFS);
+	if (!new || radix_tree_preload(GFP_NOFS))
+		goto out_free;
+
+	spin_lock(&info->hash_lock);
+	ph = radix_tree_lookup(&info->page_hashes, index);
+	if (!ph && !radix_tree_insert(&info->page_hashes, index, new)) {
+		new->index = index;
+		ph = new;
+		new = NULL;
+		info->nr_hashes++;
+	}
+	radix_tree_preload_end();
+fill:
+	if (ph) {
+		ph->seq = seq;
+		ph->sub_off = off;
+		ph->sub_len = len;
+		ph->sub_hash = hash;
+		ph->flags = DIARYFS_PH_SUB;
+		if (off == 0 && len == PAGE_SIZE) {
+			ph->page_hash = hash;
+			ph->flags |= DIARYFS_PH_FULL;
+		}
+	}
+	spin_unlock(&info->hash_lock);
+out_free:
+	if (new)
+		kmem_cache_free(diaryfs_hash_cachep, new);
+}
+
+/*
+ * diaryfs_hash_fill - the full contents of page @index after write @seq
+ * are @page.  Ignored if the page has been written again since.
+ */
+void diaryfs_hash_fill(struct inode *inode, pgoff_t index, u64 seq,
+		const void *page)
+{
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+	struct diaryfs_page_hash *ph;
+	u32 page_hash = jhash(page, PAGE_SIZE, 0);
+
+	spin_lock(&info->hash_lock);
+	ph = radix_tree_lookup(&info->page_hashes, index);
+	if (ph && ph->seq == seq) {
+		ph->page_hash = page_hash;
+		ph->flags |= DIARYFS_PH_FULL;
+	}
+	spin_unlock(&info->hash_lock);
+}
+
+/*
+ * diaryfs_hash_chain - count a record of @bytes logged for page @index
+ *
+ * Returns the records and payload bytes logged for the page since its last
+ * checkpoint, this one included, or false for a page the index doesn't
+ * track.
+ */
+bool diaryfs_hash_chain(struct inode *inode, pgoff_t index, u32 bytes,
+		u32 *chain, u32 *chain_bytes)
+{
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+	struct diaryfs_page_hash *ph;
+
+	spin_lock(&info->hash_lock);
+	ph = radix_tree_lookup(&info->page_hashes, index);
+	if (ph) {
+		*chain = ++ph->chain;
+		ph->chain_bytes += bytes;
+		*chain_bytes = ph->chain_bytes;
+	}
+	spin_unlock(&info->hash_lock);
+	return ph != NULL;
+}
+
+/* page @index has just been checkpointed */
+void diaryfs_hash_chain_reset(struct inode *inode, pgoff_t index)
+{
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+	struct diaryfs_page_hash *ph;
+
+	spin_lock(&info->hash_lock);
+	ph = radix_tree_lookup(&info->page_hashes, index);
+	if (ph) {
+		ph->chain = 0;
+		ph->chain_bytes = 0;
+	}
+	spin_unlock(&info->hash_lock);
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+
+/*
+ * Asynchronous versioning queue, one per superblock.
+ *
+ * The write path only captures pages (version.c); diffing them and writing
+ * the records to the log happens here, off the writer's back.  Captured writes are
+ * spread over a small set of lanes by inode number.  Each lane is drained
+ * by a single work item, so the writes of one inode are versioned in the
+ * order they happened while different inodes proceed in parallel.
+ *
+ * A write takes its place in the queue when it is captured, before it
+ * reaches the lower file (diaryfs_vq_reserve), so that whatever a page
+ * fault captures after it lands is versioned after it.  Until the write
+ * is done (diaryfs_vq_ready), its lane waits for it.
+ *
+ * The queue is bounded by the number of captured pages it holds; writers
+ * wait in diaryfs_vq_throttle while it is full.
+ */
+
+static void diaryfs_vq_work(struct work_struct *work)
+{
+	struct diaryfs_lane *lane = container_of(work, struct diaryfs_lane, work);
+	struct diaryfs_sb_info *sbi = lane->sbi;
+	struct diaryfs_inode_info *info;
+	struct diaryfs_wver *wver;
+	unsigned int nr;
+
+	for (;;) {
+		spin_lock(&lane->lock);
+		wver = list_first_entry_or_null(&lane->queue,
+				struct diaryfs_wver, list);
+		/* diaryfs_vq_ready gets us going again */
+		if (wver && wver->busy)
+			wver = NULL;
+		if (wver)
+			list_del(&wver->list);
+		spin_unlock(&lane->lock);
+		if (!wver)
+			break;
+
+		info = DIARYFS_I(wver->inode);
+		nr = wver->nr_pages;
+		diaryfs_version_process(wver);
+		/* the capture still pins the inode */
+		if (atomic_dec_and_test(&info->vq_pending))
+			wake_up_all(&info->vq_wait);
+		diaryfs_version_free(wver);
+		atomic_sub(nr, &sbi->vq_depth);
+		wake_up_all(&sbi->vq_wait);
+		cond_resched();
+	}
+
+	/* the queue ran dry: don't leave records sitting in the batch */
+	if (!atomic_read(&sbi->vq_depth))
+		diaryfs_log_flush(sbi);
+}
+
+static struct diaryfs_lane *diaryfs_vq_lane(struct diaryfs_wver *wver)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(wver->inode->i_sb);
+
+	return &sbi->lanes[hash_long(wver->inode->i_ino, 32) % sbi->nr_lanes];
+}
+
+static void __diaryfs_vq_queue(struct diaryfs_wver *wver, bool busy)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(wver->inode->i_sb);
+	struct diaryfs_lane *lane = diaryfs_vq_lane(wver);
+
+	atomic_add(wver->nr_pages, &sbi->vq_depth);
+	atomic_inc(&DIARYFS_I(wver->inode)->vq_pending);
+
+	spin_lock(&lane->lock);
+	wver->busy = busy;
+	list_add_tail(&wver->list, &lane->queue);
+	spin_unlock(&lane->lock);
+	if (!busy)
+		queue_work(sbi->vq_wq, &lane->work);
+}
+
+/*
+ * Queue @wver for versioning.  The caller holds the inode's vlock, so the
+ * queue is in sequence order for the inode.
+ */
+void diaryfs_vq_queue(struct diaryfs_wver *wver)
+{
+	__diaryfs_vq_queue(wver, false);
+}
+
+/* as diaryfs_vq_queue, for a write still to land; see diaryfs_vq_ready */
+void diaryfs_vq_reserve(struct diaryfs_wver *wver)
+{
+	__diaryfs_vq_queue(wver, true);
+}
+
+/* the write @wver was reserved for is done; let its lane go on */
+void diaryfs_vq_ready(struct diaryfs_wver *wver)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(wver->inode->i_sb);
+	struct diaryfs_lane *lane = diaryfs_vq_lane(wver);
+
+	spin_lock(&lane->lock);
+	wver->busy = false;
+	spin_unlock(&lane->lock);
+	queue_work(sbi->vq_wq, &lane->work);
+}
+
+/* wait for room in the queue; only a fatal signal gets out early */
+int diaryfs_vq_throttle(struct diaryfs_sb_info *sbi)
+{
+	return wait_event_killable(sbi->vq_wait,
+			atomic_read(&sbi->vq_depth) < diaryfs_queue_depth);
+}
+
+/* wait until everything queued so far has been versioned */
+void diaryfs_vq_flush(struct diaryfs_sb_info *sbi)
+{
+	wait_event(sbi->vq_wait, !atomic_read(&sbi->vq_depth));
+}
+
+/*
+ * Wait until what has been queued for @inode so far has been versioned.
+ * Unlike diaryfs_vq_flush, other inodes' writes are not waited for.
+ */
+int diaryfs_vq_flush_inode(struct inode *inode)
+{
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+
+	return wait_event_killable(info->vq_wait,
+			!atomic_read(&info->vq_pending));
+}
+
+int diaryfs_vq_init(struct diaryfs_sb_info *sbi)
+{
+	unsigned int i;
+
+	atomic_set(&sbi->vq_depth, 0);
+	init_waitqueue_head(&sbi->vq_wait);
+
+	sbi->nr_lanes = min_t(unsigned int, num_online_cpus(),
+			DIARYFS_MAX_LANES);
+	sbi->page_pool = mempool_create_page_pool(DIARYFS_POOL_PAGES, 0);
+	if (!sbi->page_pool)
+		return -ENOMEM;
+
+	sbi->lanes = kcalloc(sbi->nr_lanes, sizeof(*sbi->lanes), GFP_KERNEL);
+	if (!sbi->lanes)
+		goto out_pool;
+	for (i = 0; i < sbi->nr_lanes; i++) {
+		spin_lock_init(&sbi->lanes[i].lock);
+		INIT_LIST_HEAD(&sbi->lanes[i].queue);
+		INIT_WORK(&sbi->lanes[i].work, diaryfs_vq_work);
+		sbi->lanes[i].sbi = sbi;
+	}
+
+	sbi->vq_wq = alloc_workqueue("diaryfs", WQ_UNBOUND | WQ_MEM_RECLAIM,
+			sbi->nr_lanes);
+	if (!sbi->vq_wq) {
+		kfree(sbi->lanes);
+		sbi->lanes = NULL;
+		goto out_pool;
+	}
+	return 0;
+
+out_pool:
+	mempool_destroy(sbi->page_pool);
+	sbi->page_pool = NULL;
+	return -ENOMEM;
+}
+
+void diaryfs_vq_destroy(struct diaryfs_sb_info *sbi)
+{
+	if (sbi->vq_wq) {
+		diaryfs_vq_flush(sbi);
+		destroy_workqueue(sbi->vq_wq);
+		sbi->vq_wq = NULL;
+	}
+	kfree(sbi->lanes);
+	sbi->lanes = NULL;
+	if (sbi->page_pool) {
+		mempool_destroy(sbi->page_pool);
+		sbi->page_pool = NULL;
+	}
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+
+/*
+ * Rolling a file back in place.
+ *
+ * Only pages written since the point rolled back to can differ from how
+ * they were then, and the version records say which those are.  So only
+ * they are rebuilt (see history.c) and written back, through diaryfs like
+ * any other write: the rollback is versioned itself and can be undone.
+ * The rest of the file is left alone however big it is, and the size is
+ * set last, by a truncate through diaryfs, which setattr versions as well
+ * (see diaryfs_version_truncate).
+ *
+ * Writers aren't held off for the whole rollback; a write that lands in
+ * the middle of one is kept where the rollback didn't touch.
+ */
+
+/*
+ * diaryfs_rollback - make @file what it was at @when
+ *
+ * @file is open for reading and writing.  Returns -ENODATA if retention has
+ * dropped the history needed.
+ */
+int diaryfs_rollback(struct file *file, const struct diaryfs_when *when)
+{
+	struct inode *inode = file_inode(file);
+	struct diaryfs_hist hist = { NULL };
+	loff_t start, end, size;
+	unsigned int i;
+	ssize_t ret;
+	size_t n;
+	void *buf = NULL;
+	int err;
+
+	err = diaryfs_history_changes(inode, when, NULL, &hist);
+	/* nothing written since, nothing to do */
+	if (err || !hist.sized)
+		goto out;
+
+	buf = vmalloc(DIARYFS_HISTORY_MAX);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	diaryfs_hist_sort_off(&hist);
+	for (i = 0; i < hist.nr; ) {
+		i = diaryfs_hist_run(&hist, i, &start, &end);
+		/* beyond the old size, the truncate below takes care of it */
+		if (start >= hist.size)
+			break;
+		end = min(end, hist.size);
+
+		ret = diaryfs_history_read(inode, diaryfs_lower_file(file),
+				when, start, end - start, buf, &size);
+		if (ret > 0) {
+			n = ret;
+			ret = kernel_write(file, buf, n, start);
+			if (ret >= 0 && ret != n)
+				ret = -EIO;
+		}
+		if (ret < 0) {
+			err = ret;
+			goto out;
+		}
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			goto out;
+		}
+		cond_resched();
+	}
+
+	/* our setattr keeps what this cuts off, so it can be undone too */
+	if (i_size_read(inode) != hist.size)
+		err = vfs_truncate(&file->f_path, hist.size);
+out:
+	vfree(buf);
+	kfree(hist.ents);
+	return err;
+}
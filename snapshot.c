@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+
+/*
+ * The snapshot namespace.
+ *
+ * DIARYFS_SNAP_DIR in the root is a synthetic directory, never listed, in
+ * which every name of the form @<seconds since the epoch> is a read-only
+ * view of the whole mount as it was then.  Nothing is built ahead of
+ * time: snapshot dentries and inodes are made on lookup, stacked on the
+ * same lower objects as the live ones, and file pages are rebuilt from
+ * the version log (see history.c) only when they are read.  read(2)
+ * doesn't go through the snapshot file's own page cache, which would hold
+ * a second copy of every unchanged page; only mmap does.  Snapshot
+ * inodes are told apart from live ones, and from each other, by the time
+ * they show; it is also mixed into their inode numbers so tools walking
+ * a snapshot don't mistake it for the live tree.
+ *
+ * Only file contents are versioned.  The names a snapshot directory holds
+ * are the ones the lower directory holds now; a file created after the
+ * snapshot time shows up empty.
+ */
+
+/* what a snapshot inode is looked up by */
+struct diaryfs_snap_key {
+	struct inode *lower_inode;
+	u64 when;
+};
+
+static const struct inode_operations diaryfs_snap_top_iops;
+static const struct inode_operations diaryfs_snap_dir_iops;
+static const struct inode_operations diaryfs_snap_iops;
+static const struct file_operations diaryfs_snap_top_fops;
+static const struct file_operations diaryfs_snap_fops;
+static const struct address_space_operations diaryfs_snap_aops;
+
+static inline unsigned long diaryfs_snap_ino(unsigned long ino, u64 when)
+{
+	/* never zero, so never the live inode's number */
+	unsigned long mix = hash_64(when, 15) << 1 | 1;
+
+	return ino ^ (mix << (BITS_PER_LONG - 16));
+}
+
+static int diaryfs_snap_test(struct inode *inode, void *data)
+{
+	struct diaryfs_snap_key *key = data;
+
+	return diaryfs_lower_inode(inode) == key->lower_inode &&
+		DIARYFS_I(inode)->snap_time == key->when;
+}
+
+static int diaryfs_snap_set(struct inode *inode, void *data)
+{
+	struct diaryfs_snap_key *key = data;
+
+	/* set here, so racing lookups can match before we're done */
+	diaryfs_set_lower_inode(inode, key->lower_inode);
+	DIARYFS_I(inode)->snap_time = key->when;
+	return 0;
+}
+
+/* the size regular file @lower_inode had at @when */
+static int diaryfs_snap_size(struct super_block *sb,
+		struct inode *lower_inode, u64 when, loff_t *sizep)
+{
+	struct diaryfs_when w = { .time = when };
+	struct inode *live;
+	ssize_t ret;
+
+	live = diaryfs_iget(sb, lower_inode);
+	if (IS_ERR(live))
+		return PTR_ERR(live);
+	ret = diaryfs_history_read(live, NULL, &w, 0, 0, NULL, sizep);
+	iput(live);
+	/* past the retention window, the snapshot is gone */
+	return ret == -ENODATA ? -ENOENT : ret;
+}
+
+static struct inode *diaryfs_snap_iget(struct super_block *sb,
+		struct inode *lower_inode, u64 when)
+{
+	struct diaryfs_snap_key key = { lower_inode, when };
+	struct inode *inode;
+	loff_t size;
+	int err;
+
+	inode = iget5_locked(sb, diaryfs_snap_ino(lower_inode->i_ino, when),
+			diaryfs_snap_test, diaryfs_snap_set, &key);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	if (!(inode->i_state & I_NEW))
+		return inode;
+
+	if (!igrab(lower_inode)) {
+		diaryfs_set_lower_inode(inode, NULL);
+		err = -ESTALE;
+		goto out_failed;
+	}
+	inode->i_ino = diaryfs_snap_ino(lower_inode->i_ino, when);
+	inode->i_version++;
+	fsstack_copy_attr_all(inode, lower_inode);
+
+	if (when == DIARYFS_SNAP_TOP) {
+		inode->i_op = &diaryfs_snap_top_iops;
+		inode->i_fop = &diaryfs_snap_top_fops;
+	} else if (S_ISDIR(lower_inode->i_mode)) {
+		inode->i_op = &diaryfs_snap_dir_iops;
+		inode->i_fop = &diaryfs_dir_fops;
+		fsstack_copy_inode_size(inode, lower_inode);
+	} else if (S_ISREG(lower_inode->i_mode)) {
+		inode->i_op = &diaryfs_snap_iops;
+		inode->i_fop = &diaryfs_snap_fops;
+		inode->i_mapping->a_ops = &diaryfs_snap_aops;
+		err = diaryfs_snap_size(sb, lower_inode, when, &size);
+		if (err)
+			goto out_failed;
+		i_size_write(inode, size);
+	} else {
+		inode->i_op = &diaryfs_snap_iops;
+		if (S_ISBLK(lower_inode->i_mode) ||
+		    S_ISCHR(lower_inode->i_mode) ||
+		    S_ISFIFO(lower_inode->i_mode) ||
+		    S_ISSOCK(lower_inode->i_mode))
+			init_special_inode(inode, lower_inode->i_mode,
+					lower_inode->i_rdev);
+	}
+
+	unlock_new_inode(inode);
+	return inode;
+
+out_failed:
+	/* evict drops the lower reference, if we got one */
+	iget_failed(inode);
+	return ERR_PTR(err);
+}
+
+/* DIARYFS_SNAP_DIR itself, looked up in the root by __diaryfs_lookup */
+int diaryfs_snap_lookup_top(struct dentry *dentry,
+		struct path *lower_parent_path)
+{
+	struct inode *inode;
+
+	inode = diaryfs_snap_iget(dentry->d_sb,
+			lower_parent_path->dentry->d_inode, DIARYFS_SNAP_TOP);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	path_get(lower_parent_path);
+	diaryfs_set_lower_path(dentry, lower_parent_path);
+	d_add(dentry, inode);
+	return 0;
+}
+
+/* turn @<seconds> into a time, if it is one in the past */
+static int diaryfs_snap_parse(const char *name, u64 *when)
+{
+	u64 sec;
+
+	if (name[0] != '@' || kstrtou64(name + 1, 10, &sec) || !sec ||
+	    sec > div_u64(ktime_get_real_ns(), NSEC_PER_SEC))
+		return -ENOENT;
+	*when = sec * NSEC_PER_SEC;
+	return 0;
+}
+
+static struct dentry *diaryfs_snap_lookup(struct inode *dir,
+		struct dentry *dentry, unsigned int flags)
+{
+	const char *name = dentry->d_name.name;
+	u64 when = DIARYFS_I(dir)->snap_time;
+	struct path lower_parent_path, lower_path;
+	struct dentry *parent;
+	struct inode *inode;
+	int err;
+
+	parent = dget_parent(dentry);
+	diaryfs_get_lower_path(parent, &lower_parent_path);
+
+	/* allocate dentry private data.  We free it in ->d_release */
+	err = new_dentry_private_data(dentry);
+	if (err)
+		goto out;
+	d_set_d_op(dentry, &diaryfs_dops);
+
+	if (when == DIARYFS_SNAP_TOP) {
+		/* a snapshot's root is the lower root, as of then */
+		err = diaryfs_snap_parse(name, &when);
+		if (err)
+			goto out;
+		pathcpy(&lower_path, &lower_parent_path);
+		path_get(&lower_path);
+	} else {
+		if (diaryfs_is_lower_root(dir->i_sb, lower_parent_path.dentry) &&
+		    dentry->d_name.len == sizeof(DIARYFS_META_DIR) - 1 &&
+		    !memcmp(name, DIARYFS_META_DIR, dentry->d_name.len)) {
+			err = -ENOENT;
+			goto out;
+		}
+		err = vfs_path_lookup(lower_parent_path.dentry,
+				lower_parent_path.mnt, name, 0, &lower_path);
+		if (err)
+			goto out;
+	}
+
+	/* check that the lower file system didn't cross a mount point */
+	if (lower_path.dentry->d_inode->i_sb != diaryfs_lower_super(dir->i_sb)) {
+		err = -EXDEV;
+		goto out_put;
+	}
+	inode = diaryfs_snap_iget(dir->i_sb, lower_path.dentry->d_inode, when);
+	if (IS_ERR(inode)) {
+		err = PTR_ERR(inode);
+		goto out_put;
+	}
+	diaryfs_set_lower_path(dentry, &lower_path);
+	d_add(dentry, inode);
+	goto out;
+
+out_put:
+	path_put(&lower_path);
+out:
+	diaryfs_put_lower_path(parent, &lower_parent_path);
+	dput(parent);
+	return ERR_PTR(err);
+}
+
+static int diaryfs_snap_permission(struct inode *inode, int mask)
+{
+	if (mask & MAY_WRITE)
+		return -EROFS;
+	return inode_permission(diaryfs_lower_inode(inode), mask);
+}
+
+static int diaryfs_snap_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	return -EROFS;
+}
+
+/* a snapshot's attributes are fixed when its inode is made */
+static int diaryfs_snap_getattr(struct vfsmount *mnt, struct dentry *dentry,
+		struct kstat *stat)
+{
+	struct inode *inode = dentry->d_inode;
+
+	generic_fillattr(inode, stat);
+	if (S_ISREG(inode->i_mode))
+		stat->blocks = DIV_ROUND_UP(i_size_read(inode), 512);
+	return 0;
+}
+
+/* snapshots are made up on lookup; there is nothing to list */
+static int diaryfs_snap_top_readdir(struct file *file, struct dir_context *ctx)
+{
+	dir_emit_dots(file, ctx);
+	return 0;
+}
+
+static int diaryfs_snap_open(struct inode *inode, struct file *file)
+{
+	if (file->f_mode & FMODE_WRITE)
+		return -EROFS;
+	return diaryfs_open(inode, file);
+}
+
+/* rebuild one page of a snapshot file from the live file and the log */
+static int diaryfs_snap_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct diaryfs_when when = { .time = DIARYFS_I(inode)->snap_time };
+	struct inode *live;
+	loff_t size;
+	ssize_t ret;
+	void *addr;
+
+	live = diaryfs_iget(inode->i_sb, diaryfs_lower_inode(inode));
+	if (IS_ERR(live)) {
+		ret = PTR_ERR(live);
+		goto out;
+	}
+	addr = kmap(page);
+	ret = diaryfs_history_read(live, diaryfs_lower_file(file), &when,
+			page_offset(page), PAGE_SIZE, addr, &size);
+	if (ret >= 0)
+		memset(addr + ret, 0, PAGE_SIZE - ret);
+	kunmap(page);
+	iput(live);
+out:
+	if (ret >= 0) {
+		flush_dcache_page(page);
+		SetPageUptodate(page);
+		ret = 0;
+	} else {
+		SetPageError(page);
+	}
+	unlock_page(page);
+	return ret;
+}
+
+/*
+ * Read a snapshot file without caching it: unchanged pages come from the
+ * lower file's page cache, rebuilt ones from the historical page cache.
+ */
+static ssize_t diaryfs_snap_read_iter(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct diaryfs_when when = { .time = DIARYFS_I(inode)->snap_time };
+	struct inode *live;
+	size_t len, copied;
+	ssize_t ret = 0, done = 0;
+	loff_t size;
+	void *buf;
+
+	if (!iov_iter_count(iter))
+		return 0;
+	live = diaryfs_iget(inode->i_sb, diaryfs_lower_inode(inode));
+	if (IS_ERR(live))
+		return PTR_ERR(live);
+	len = min_t(size_t, iov_iter_count(iter), DIARYFS_HISTORY_MAX);
+	buf = vmalloc(len);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (iov_iter_count(iter)) {
+		len = min_t(size_t, iov_iter_count(iter), DIARYFS_HISTORY_MAX);
+		ret = diaryfs_history_read(live, diaryfs_lower_file(file),
+				&when, iocb->ki_pos, len, buf, &size);
+		if (ret <= 0)
+			break;
+		copied = copy_to_iter(buf, ret, iter);
+		iocb->ki_pos += copied;
+		done += copied;
+		if (copied != ret) {
+			ret = -EFAULT;
+			break;
+		}
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	vfree(buf);
+	file_accessed(file);
+out:
+	iput(live);
+	return done ? done : ret;
+}
+
+static const struct inode_operations diaryfs_snap_top_iops = {
+	.lookup		= diaryfs_snap_lookup,
+	.permission	= diaryfs_snap_permission,
+	.setattr	= diaryfs_snap_setattr,
+	.getattr	= diaryfs_snap_getattr,
+};
+
+static const struct inode_operations diaryfs_snap_dir_iops = {
+	.lookup		= diaryfs_snap_lookup,
+	.permission	= diaryfs_snap_permission,
+	.setattr	= diaryfs_snap_setattr,
+	.getattr	= diaryfs_snap_getattr,
+};
+
+static const struct inode_operations diaryfs_snap_iops = {
+	.permission	= diaryfs_snap_permission,
+	.setattr	= diaryfs_snap_setattr,
+	.getattr	= diaryfs_snap_getattr,
+};
+
+static const struct file_operations diaryfs_snap_top_fops = {
+	.llseek		= generic_file_llseek,
+	.read		= generic_read_dir,
+	.iterate	= diaryfs_snap_top_readdir,
+};
+
+static const struct file_operations diaryfs_snap_fops = {
+	.llseek		= generic_file_llseek,
+	.read_iter	= diaryfs_snap_read_iter,
+	.mmap		= generic_file_readonly_mmap,
+	.open		= diaryfs_snap_open,
+	.release	= diaryfs_file_release,
+};
+
+static const struct address_space_operations diaryfs_snap_aops = {
+	.readpage	= diaryfs_snap_readpage,
+};
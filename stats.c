@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+
+/*
+ * Per-mount statistics.
+ *
+ * Counters are bumped per CPU on the hot paths, without locks or shared
+ * cache lines, and only summed when someone reads them.  Every mount gets
+ * a directory /sys/fs/diaryfs/<major>:<minor>/, named after the mount's
+ * device number as shown in /proc/self/mountinfo, holding one file per
+ * counter.  Latency histograms list, for each power of two of ns that
+ * anything took, how many operations took that long.
+ */
+
+static struct kset *diaryfs_kset;
+
+struct diaryfs_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct diaryfs_sb_info *sbi, int arg, char *buf);
+	int arg;
+};
+
+static u64 diaryfs_stat_sum(struct diaryfs_sb_info *sbi, int stat)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(sbi->stats, cpu)->count[stat];
+	return sum;
+}
+
+static ssize_t diaryfs_stat_show(struct diaryfs_sb_info *sbi, int stat,
+		char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu\n",
+			diaryfs_stat_sum(sbi, stat));
+}
+
+/* record bytes logged per 100 bytes changed */
+static ssize_t diaryfs_ratio_show(struct diaryfs_sb_info *sbi, int arg,
+		char *buf)
+{
+	u64 versioned = diaryfs_stat_sum(sbi, DIARYFS_STAT_VERSIONED);
+	u64 logged = diaryfs_stat_sum(sbi, DIARYFS_STAT_LOGGED);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n",
+			versioned ? div64_u64(logged * 100, versioned) : 0);
+}
+
+static ssize_t diaryfs_queue_show(struct diaryfs_sb_info *sbi, int arg,
+		char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%d\n",
+			atomic_read(&sbi->vq_depth));
+}
+
+static ssize_t diaryfs_hcache_show(struct diaryfs_sb_info *sbi, int hits,
+		char *buf)
+{
+	u64 n;
+
+	spin_lock(&sbi->hcache.lock);
+	n = hits ? sbi->hcache.hits : sbi->hcache.misses;
+	spin_unlock(&sbi->hcache.lock);
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", n);
+}
+
+/* one "<ns> <count>" line per non-empty bucket, <ns> its lower bound */
+static ssize_t diaryfs_lat_show(struct diaryfs_sb_info *sbi, int lat,
+		char *buf)
+{
+	ssize_t len = 0;
+	u64 sum;
+	int i, cpu;
+
+	for (i = 0; i < DIARYFS_LAT_BUCKETS; i++) {
+		sum = 0;
+		for_each_possible_cpu(cpu)
+			sum += per_cpu_ptr(sbi->stats, cpu)->lat[lat][i];
+		if (sum)
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					"%llu %llu\n", 1ULL << i, sum);
+	}
+	return len;
+}
+
+#define DIARYFS_ATTR(_name, _show, _arg)				\
+static struct diaryfs_attr diaryfs_attr_##_name = {			\
+	.attr = { .name = __stringify(_name), .mode = S_IRUGO },	\
+	.show = _show,							\
+	.arg = _arg,							\
+}
+
+DIARYFS_ATTR(bytes_written, diaryfs_stat_show, DIARYFS_STAT_WRITTEN);
+DIARYFS_ATTR(bytes_versioned, diaryfs_stat_show, DIARYFS_STAT_VERSIONED);
+DIARYFS_ATTR(bytes_logged, diaryfs_stat_show, DIARYFS_STAT_LOGGED);
+DIARYFS_ATTR(log_ratio, diaryfs_ratio_show, 0);
+DIARYFS_ATTR(hash_hits, diaryfs_stat_show, DIARYFS_STAT_HASH_HITS);
+DIARYFS_ATTR(hash_misses, diaryfs_stat_show, DIARYFS_STAT_HASH_MISSES);
+DIARYFS_ATTR(hist_cache_hits, diaryfs_hcache_show, 1);
+DIARYFS_ATTR(hist_cache_misses, diaryfs_hcache_show, 0);
+DIARYFS_ATTR(queue_depth, diaryfs_queue_show, 0);
+DIARYFS_ATTR(read_latency, diaryfs_lat_show, DIARYFS_LAT_READ);
+DIARYFS_ATTR(write_latency, diaryfs_lat_show, DIARYFS_LAT_WRITE);
+DIARYFS_ATTR(append_latency, diaryfs_lat_show, DIARYFS_LAT_APPEND);
+
+static struct attribute *diaryfs_attrs[] = {
+	&diaryfs_attr_bytes_written.attr,
+	&diaryfs_attr_bytes_versioned.attr,
+	&diaryfs_attr_bytes_logged.attr,
+	&diaryfs_attr_log_ratio.attr,
+	&diaryfs_attr_hash_hits.attr,
+	&diaryfs_attr_hash_misses.attr,
+	&diaryfs_attr_hist_cache_hits.attr,
+	&diaryfs_attr_hist_cache_misses.attr,
+	&diaryfs_attr_queue_depth.attr,
+	&diaryfs_attr_read_latency.attr,
+	&diaryfs_attr_write_latency.attr,
+	&diaryfs_attr_append_latency.attr,
+	NULL,
+};
+
+static ssize_t diaryfs_attr_show(struct kobject *kobj,
+		struct attribute *attr, char *buf)
+{
+	struct diaryfs_sb_info *sbi =
+		container_of(kobj, struct diaryfs_sb_info, kobj);
+	struct diaryfs_attr *a = container_of(attr, struct diaryfs_attr, attr);
+
+	return a->show(sbi, a->arg, buf);
+}
+
+static const struct sysfs_ops diaryfs_sysfs_ops = {
+	.show	= diaryfs_attr_show,
+};
+
+static void diaryfs_sb_release(struct kobject *kobj)
+{
+	struct diaryfs_sb_info *sbi =
+		container_of(kobj, struct diaryfs_sb_info, kobj);
+
+	complete(&sbi->kobj_unregister);
+}
+
+static struct kobj_type diaryfs_sb_ktype = {
+	.default_attrs	= diaryfs_attrs,
+	.sysfs_ops	= &diaryfs_sysfs_ops,
+	.release	= diaryfs_sb_release,
+};
+
+int diaryfs_stats_init(struct diaryfs_sb_info *sbi)
+{
+	sbi->stats = alloc_percpu(struct diaryfs_stats);
+	return sbi->stats ? 0 : -ENOMEM;
+}
+
+void diaryfs_stats_destroy(struct diaryfs_sb_info *sbi)
+{
+	free_percpu(sbi->stats);
+	sbi->stats = NULL;
+}
+
+/* publish the statistics of mount @sb */
+int diaryfs_sysfs_register(struct super_block *sb)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(sb);
+	int err;
+
+	sbi->kobj.kset = diaryfs_kset;
+	init_completion(&sbi->kobj_unregister);
+	err = kobject_init_and_add(&sbi->kobj, &diaryfs_sb_ktype, NULL,
+			"%u:%u", MAJOR(sb->s_dev), MINOR(sb->s_dev));
+	if (err) {
+		kobject_put(&sbi->kobj);
+		wait_for_completion(&sbi->kobj_unregister);
+	}
+	return err;
+}
+
+/* and take them down again; readers still in a show are waited for */
+void diaryfs_sysfs_unregister(struct super_block *sb)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(sb);
+
+	kobject_del(&sbi->kobj);
+	kobject_put(&sbi->kobj);
+	wait_for_completion(&sbi->kobj_unregister);
+}
+
+int diaryfs_init_sysfs(void)
+{
+	diaryfs_kset = kset_create_and_add(DIARYFS_NAME, NULL, fs_kobj);
+	return diaryfs_kset ? 0 : -ENOMEM;
+}
+
+void diaryfs_destroy_sysfs(void)
+{
+	if (diaryfs_kset)
+		kset_unregister(diaryfs_kset);
+	diaryfs_kset = NULL;
+}
@@ -30,6 +30,17 @@ static void diaryfs_put_super(struct super_block *sb) {
 		return;
 	}
 
+	diaryfs_sysfs_unregister(sb);
+	diaryfs_gc_stop(spd);
+	diaryfs_hcache_destroy(spd);
+
+	/* nothing can be queued any more; let the workers finish */
+	diaryfs_vq_destroy(spd);
+	diaryfs_log_close(spd);
+	diaryfs_chunk_close(spd);
+	diaryfs_index_close(spd);
+	diaryfs_stats_destroy(spd);
+
 	/* decrement lower super references */
 	s = diaryfs_lower_super(sb);
 	diaryfs_set_lower_super(sb, NULL);
@@ -39,13 +50,28 @@ static void diaryfs_put_super(struct super_block *sb) {
 	sb->s_fs_info = NULL;
 }
 
+/*
+ * Versioning runs behind the writers; make sync(2) (and unmount, which
+ * syncs before it evicts our inodes) wait for it, and for the log and the
+ * indexes it wrote to reach the disk.
+ */
+static int diaryfs_sync_fs(struct super_block *sb, int wait) {
+	int err, ret;
+
+	if (!wait)
+		return diaryfs_log_flush(DIARYFS_SB(sb));
+	diaryfs_vq_flush(DIARYFS_SB(sb));
+	err = diaryfs_log_sync(DIARYFS_SB(sb));
+	ret = diaryfs_index_sync(DIARYFS_SB(sb));
+	return err ? err : ret;
+}
+
 static int diaryfs_statfs(struct dentry *dentry, struct kstatfs *buf) {
 	int err;
 	struct path lower_path;
 
-	diaryfs_get_lower_path(dentry, &lower_path);
+	diaryfs_peek_lower_path(dentry, &lower_path);
 	err = vfs_statfs(&lower_path, buf);
-	diaryfs_put_lower_path(dentry, &lower_path);
 
 	/* set return buf to our f/s to avoid confusing user-level utils */
 	buf->f_type = DIARYFS_SUPER_MAGIC;
@@ -68,6 +94,12 @@ static int diaryfs_remount_fs(struct super_block *sb, int *flags, char *options)
 				"wrapfs: remount flags 0x%x unsupported\n", *flags);
 		err = -EINVAL;
 	}
+	/* the metadata was only opened for reading */
+	if (!err && DIARYFS_SB(sb)->read_only && !(*flags & MS_RDONLY)) {
+		printk(KERN_ERR "diaryfs: mounted read-only, cannot remount "
+				"read-write\n");
+		err = -EROFS;
+	}
 	return err;
 }
 
@@ -82,6 +114,8 @@ static void diaryfs_evict_inode(struct inode *inode) {
 
 	truncate_inode_pages(&inode->i_data, 0);
 	clear_inode(inode);
+	diaryfs_hash_clear(inode);
+	diaryfs_index_release(inode);
 
 	/* Decrement a refernece to a lower_inode, which was incremented by 
 	 * the read_inode when it was created initially
@@ -99,6 +133,9 @@ static struct inode *diaryfs_alloc_inode(struct super_block *sb) {
 
 	/* memset everything upto the inode to 0  */
 	memset(inode, 0, offsetof(struct diaryfs_inode_info, vfs_inode));
+	diaryfs_hash_init(inode);
+	mutex_init(&inode->vlock);
+	init_waitqueue_head(&inode->vq_wait);
 
 	inode->vfs_inode.i_version = 1; 
 	return &inode->vfs_inode;
@@ -148,6 +185,7 @@ static void diaryfs_umount_begin(struct super_block *sb) {
 
 const struct super_operations diaryfs_sops = {
 	.put_super	    = diaryfs_put_super,
+	.sync_fs		= diaryfs_sync_fs,
 	.statfs			= diaryfs_statfs,
 	.remount_fs		= diaryfs_remount_fs,
 	.evict_inode	= diaryfs_evict_inode,
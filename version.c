@@ -0,0 +1,690 @@
+/*
+ * Copyright (c) 2016 James Whang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation
+ *
+ * THANKSTO:
+ * The wrapfs team @ Stony Brook University
+ *  - Erez Zadok
+ * 	- Shrikar Archak
+ */
+
+#include "diaryfs.h"
+#include "diaryfs_trace.h"
+
+/*
+ * The versioning pipeline.
+ *
+ * Every write that goes through diaryfs_write_iter is bracketed by
+ * diaryfs_version_begin and diaryfs_version_end, a window at a time for
+ * large writes.  begin runs before the
+ * data reaches the lower file: it walks a copy of the iov_iter page by page
+ * and, for every page the page-hash index cannot prove unchanged, keeps the
+ * new bytes and the old contents of the page, then numbers the write and
+ * takes its place in the per-superblock queue (queue.c).  end runs once
+ * the lower write has completed (inline, or from AIO completion), trims
+ * the capture to the bytes actually written and lets the queue have it.  The expensive part, diaryfs_version_process, runs later on a
+ * queue worker.
+ *
+ * Writes through shared mappings never come by here.  Instead,
+ * diaryfs_version_mkwrite captures a page as it was each time it is made
+ * writable, which happens once every time it goes from clean to dirty.
+ * What is then written into it isn't known, so the page is recorded
+ * whole, with no new bytes to diff against.  Truncates are captured the
+ * same way, by diaryfs_version_truncate.
+ */
+
+static void diaryfs_vpage_free(struct diaryfs_sb_info *sbi,
+		struct diaryfs_vpage *vp)
+{
+	if (vp->old)
+		mempool_free(vp->old, sbi->page_pool);
+	if (vp->new)
+		mempool_free(vp->new, sbi->page_pool);
+	kfree(vp);
+}
+
+void diaryfs_version_free(struct diaryfs_wver *wver)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(wver->inode->i_sb);
+	struct diaryfs_vpage *vp, *n;
+
+	list_for_each_entry_safe(vp, n, &wver->pages, list) {
+		list_del(&vp->list);
+		diaryfs_vpage_free(sbi, vp);
+	}
+	iput(wver->inode);
+	kfree(wver);
+}
+
+/* read the whole of page @vp->index from @lower_file, as it is now */
+static int diaryfs_version_read_old(struct diaryfs_sb_info *sbi,
+		struct file *lower_file, struct diaryfs_vpage *vp)
+{
+	void *addr;
+
+	vp->old = mempool_alloc(sbi->page_pool, GFP_NOFS);
+	if (!vp->old)
+		return -ENOMEM;
+	addr = kmap(vp->old);
+	vp->old_len = kernel_read(lower_file, (loff_t)vp->index << PAGE_SHIFT,
+			addr, PAGE_SIZE);
+	if (vp->old_len < 0)
+		vp->old_len = 0;
+	/* past EOF the file reads as zeroes; the pool page holds anything */
+	memset(addr + vp->old_len, 0, PAGE_SIZE - vp->old_len);
+	kunmap(vp->old);
+	return 0;
+}
+
+/*
+ * The page hashes say writing @vp leaves its page as it is.  A 32-bit hash
+ * can collide, so that is only taken as a hint: the write is passed over
+ * only if the lower page cache holds the page and its bytes are the same.
+ * A write past EOF still changes the size, and never is.
+ */
+static bool diaryfs_version_same(struct file *lower_file,
+		struct diaryfs_vpage *vp)
+{
+	struct inode *lower_inode = file_inode(lower_file);
+	loff_t start = ((loff_t)vp->index << PAGE_SHIFT) + vp->off;
+	struct page *page;
+	u8 *old, *new;
+	bool same = false;
+
+	if (start + vp->len > i_size_read(lower_inode))
+		return false;
+	page = find_get_page(lower_inode->i_mapping, vp->index);
+	if (!page)
+		return false;
+	if (PageUptodate(page)) {
+		old = kmap(page);
+		new = kmap(vp->new);
+		same = !memcmp(old + vp->off, new + vp->off, vp->len);
+		kunmap(vp->new);
+		kunmap(page);
+	}
+	page_cache_release(page);
+	return same;
+}
+
+/*
+ * Capture one page worth of the write: @len bytes at @off within the page
+ * at @pos.  Returns NULL without error if the page is provably unchanged.
+ */
+static struct diaryfs_vpage *diaryfs_version_capture(struct file *file,
+		loff_t pos, unsigned int off, unsigned int len,
+		struct iov_iter *from)
+{
+	struct inode *inode = file_inode(file);
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(inode->i_sb);
+	struct diaryfs_vpage *vp;
+	void *addr;
+	size_t copied;
+
+	vp = kzalloc(sizeof(*vp), GFP_NOFS);
+	if (!vp)
+		return ERR_PTR(-ENOMEM);
+	vp->index = pos >> PAGE_SHIFT;
+	vp->off = off;
+	vp->len = len;
+
+	vp->new = mempool_alloc(sbi->page_pool, GFP_NOFS);
+	if (!vp->new)
+		goto out_nomem;
+	addr = kmap(vp->new);
+	copied = copy_from_iter(addr + off, len, from);
+	vp->hash = jhash(addr + off, copied, 0);
+	kunmap(vp->new);
+	if (copied != len) {
+		diaryfs_vpage_free(sbi, vp);
+		return ERR_PTR(-EFAULT);
+	}
+
+	/*
+	 * Stores through a shared mapping don't update the hashes, so while
+	 * the file is mapped writable they prove nothing.
+	 */
+	if (!mapping_writably_mapped(diaryfs_lower_inode(inode)->i_mapping) &&
+	    diaryfs_hash_unchanged(inode, vp->index, off, len, vp->hash) &&
+	    diaryfs_version_same(diaryfs_lower_file(file), vp)) {
+		diaryfs_vpage_free(sbi, vp);
+		return NULL;
+	}
+
+	/* read the whole page, so the index learns its full contents */
+	if (diaryfs_version_read_old(sbi, diaryfs_lower_file(file), vp))
+		goto out_nomem;
+	return vp;
+
+out_nomem:
+	diaryfs_vpage_free(sbi, vp);
+	return ERR_PTR(-ENOMEM);
+}
+
+/*
+ * diaryfs_version_begin - capture what a write at @pos is about to replace
+ *
+ * @iter is left untouched for the lower write.  The caller holds the upper
+ * i_mutex and passes the result to diaryfs_version_end once the lower
+ * write has finished, whatever its outcome.
+ *
+ * The write is numbered and queued here, under the inode's vlock, so a
+ * page fault that captures a page once the write has landed in it is
+ * numbered and versioned after the write.  A write done in windows is
+ * still one version: @seq, if not NULL, holds the sequence number its
+ * windows share, 0 until the first one is numbered.
+ */
+int diaryfs_version_begin(struct file *file, loff_t pos,
+		struct iov_iter *iter, struct diaryfs_wver **wverp, u64 *seq)
+{
+	struct inode *inode = file_inode(file);
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(inode->i_sb);
+	struct iov_iter from = *iter;
+	struct diaryfs_wver *wver;
+	int err;
+
+	*wverp = NULL;
+	if (!iov_iter_count(iter))
+		return 0;
+
+	/* don't capture more while the workers are behind */
+	err = diaryfs_vq_throttle(sbi);
+	if (err)
+		return err;
+
+	wver = kzalloc(sizeof(*wver), GFP_NOFS);
+	if (!wver)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&wver->pages);
+	wver->inode = inode;
+	ihold(inode);
+	wver->pos = pos;
+	wver->count = iov_iter_count(iter);
+	wver->old_size = i_size_read(diaryfs_lower_inode(inode));
+	wver->time = current_kernel_time();
+
+	while (iov_iter_count(&from)) {
+		unsigned int off = pos & (PAGE_SIZE - 1);
+		unsigned int len = min_t(size_t, PAGE_SIZE - off,
+				iov_iter_count(&from));
+		struct diaryfs_vpage *vp;
+
+		vp = diaryfs_version_capture(file, pos, off, len, &from);
+		if (IS_ERR(vp)) {
+			/* a fault here will fault the lower write too */
+			if (PTR_ERR(vp) == -EFAULT)
+				break;
+			diaryfs_version_free(wver);
+			return PTR_ERR(vp);
+		}
+		if (vp) {
+			list_add_tail(&vp->list, &wver->pages);
+			wver->nr_pages++;
+		}
+		pos += len;
+	}
+
+	if (wver->nr_pages) {
+		mutex_lock(&DIARYFS_I(inode)->vlock);
+		if (!seq || !*seq)
+			wver->seq = atomic64_inc_return(&sbi->wseq);
+		else
+			wver->seq = *seq;
+		if (seq)
+			*seq = wver->seq;
+		diaryfs_vq_reserve(wver);
+		mutex_unlock(&DIARYFS_I(inode)->vlock);
+	}
+
+	*wverp = wver;
+	return 0;
+}
+
+/*
+ * diaryfs_version_mkwrite - record page @page of @inode before a shared
+ * mapping writes to it
+ *
+ * @page is the locked lower page cache page.  The caller holds the inode's
+ * vlock, so this is numbered and queued in order with write(2), after
+ * every write that may already be in the page.
+ * The copy is all that is done here; the rest happens on the versioning
+ * queue.
+ */
+int diaryfs_version_mkwrite(struct inode *inode, struct page *page)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(inode->i_sb);
+	loff_t size = i_size_read(diaryfs_lower_inode(inode));
+	loff_t pos = page_offset(page);
+	struct diaryfs_wver *wver;
+	struct diaryfs_vpage *vp;
+
+	/* truncated away: the fault finds out and gives up */
+	if (pos >= size)
+		return 0;
+
+	wver = kzalloc(sizeof(*wver), GFP_NOFS);
+	if (!wver)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&wver->pages);
+	wver->inode = inode;
+	ihold(inode);
+
+	vp = kzalloc(sizeof(*vp), GFP_NOFS);
+	if (!vp)
+		goto out_nomem;
+	list_add_tail(&vp->list, &wver->pages);
+	wver->nr_pages = 1;
+	vp->old = mempool_alloc(sbi->page_pool, GFP_NOFS);
+	if (!vp->old)
+		goto out_nomem;
+	copy_highpage(vp->old, page);
+	vp->index = page->index;
+	vp->len = PAGE_SIZE;
+	vp->old_len = min_t(loff_t, PAGE_SIZE, size - pos);
+
+	wver->pos = pos;
+	wver->count = PAGE_SIZE;
+	wver->old_size = size;
+	wver->time = current_kernel_time();
+	wver->seq = atomic64_inc_return(&sbi->wseq);
+
+	/* the index can't know what the page will hold */
+	diaryfs_hash_invalidate(inode, pos, pos + PAGE_SIZE);
+	diaryfs_vq_queue(wver);
+	return 0;
+
+out_nomem:
+	diaryfs_version_free(wver);
+	return -ENOMEM;
+}
+
+/*
+ * Capture up to a window of the bytes [*@pos, @end) a truncate changes,
+ * advancing *@pos past them.  There are no new bytes: undoing the records
+ * puts back what the truncate cut off, or takes away what it added.
+ */
+static struct diaryfs_wver *diaryfs_version_cut(struct inode *inode,
+		struct file *lower_file, loff_t *pos, loff_t end)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(inode->i_sb);
+	struct diaryfs_wver *wver;
+	struct diaryfs_vpage *vp;
+
+	wver = kzalloc(sizeof(*wver), GFP_NOFS);
+	if (!wver)
+		return ERR_PTR(-ENOMEM);
+	INIT_LIST_HEAD(&wver->pages);
+	wver->inode = inode;
+	ihold(inode);
+	wver->pos = *pos;
+
+	while (*pos < end && wver->nr_pages < DIARYFS_WINDOW_PAGES) {
+		unsigned int off = *pos & (PAGE_SIZE - 1);
+
+		vp = kzalloc(sizeof(*vp), GFP_NOFS);
+		if (!vp)
+			goto out_nomem;
+		list_add_tail(&vp->list, &wver->pages);
+		wver->nr_pages++;
+		vp->index = *pos >> PAGE_SHIFT;
+		vp->off = off;
+		vp->len = min_t(loff_t, PAGE_SIZE - off, end - *pos);
+		if (diaryfs_version_read_old(sbi, lower_file, vp))
+			goto out_nomem;
+		*pos += vp->len;
+	}
+	wver->count = *pos - wver->pos;
+	return wver;
+
+out_nomem:
+	diaryfs_version_free(wver);
+	return ERR_PTR(-ENOMEM);
+}
+
+/*
+ * diaryfs_version_truncate - record what truncating @dentry to @size is
+ * about to change
+ *
+ * Called from setattr with the upper i_mutex held, before the lower file
+ * is truncated.  Shrinking keeps the bytes cut off; growing records the
+ * first page of the new range, which held nothing.  Either way the records
+ * carry the old size, which is what reads from before the truncate go by.
+ * The capture is queued a window at a time, all of it under one sequence
+ * number.
+ */
+int diaryfs_version_truncate(struct dentry *dentry, loff_t size)
+{
+	struct inode *inode = d_inode(dentry);
+	struct diaryfs_inode_info *info = DIARYFS_I(inode);
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(inode->i_sb);
+	struct timespec time = current_kernel_time();
+	struct diaryfs_wver *wver;
+	struct file *lower_file;
+	struct path lower_path;
+	loff_t old_size, pos, end;
+	u64 seq = 0;
+	int err = 0;
+
+	inode_dio_wait(inode);
+	old_size = i_size_read(diaryfs_lower_inode(inode));
+	if (size == old_size)
+		return 0;
+	if (size < old_size) {
+		pos = size;
+		end = old_size;
+	} else {
+		pos = old_size;
+		end = min_t(loff_t, size, (old_size | (PAGE_SIZE - 1)) + 1);
+	}
+
+	/* the caller's file, if any, may not be open for reading */
+	diaryfs_get_lower_path(dentry, &lower_path);
+	lower_file = dentry_open(&lower_path, O_RDONLY | O_LARGEFILE,
+			current_cred());
+	diaryfs_put_lower_path(dentry, &lower_path);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+
+	while (pos < end) {
+		err = diaryfs_vq_throttle(sbi);
+		if (err)
+			break;
+		/* a page fault can't capture these pages in between */
+		mutex_lock(&info->vlock);
+		wver = diaryfs_version_cut(inode, lower_file, &pos, end);
+		if (IS_ERR(wver)) {
+			mutex_unlock(&info->vlock);
+			err = PTR_ERR(wver);
+			break;
+		}
+		wver->old_size = old_size;
+		wver->time = time;
+		if (!seq)
+			seq = atomic64_inc_return(&sbi->wseq);
+		wver->seq = seq;
+		diaryfs_hash_invalidate(inode, wver->pos, pos);
+		diaryfs_vq_queue(wver);
+		mutex_unlock(&info->vlock);
+	}
+	fput(lower_file);
+	return err;
+}
+
+/*
+ * Log old bytes that have to be kept as they are.  Anything big enough is
+ * put in the chunk store, so copies of the same content are kept once, and
+ * the record only refers to the chunks.  Small pieces, or anything the
+ * store can't take, go inline.
+ */
+static int diaryfs_version_data(struct diaryfs_sb_info *sbi,
+		struct diaryfs_rec *rec, const u8 *data, size_t len, u64 *lsn)
+{
+	struct diaryfs_chunk_ref refs[DIARYFS_VERSION_REFS];
+	int nr, err;
+
+	if (len >= DIARYFS_CHUNK_MIN) {
+		nr = diaryfs_chunk_store(sbi, data, len, refs, ARRAY_SIZE(refs));
+		if (nr > 0) {
+			rec->type = cpu_to_le16(DIARYFS_REC_CHUNKS);
+			err = diaryfs_log_append(sbi, rec, refs,
+					nr * sizeof(refs[0]), lsn);
+			if (!err)
+				return 0;
+			while (nr--)
+				diaryfs_chunk_put(sbi, &refs[nr]);
+		}
+	}
+
+	rec->type = cpu_to_le16(DIARYFS_REC_DATA);
+	return diaryfs_log_append(sbi, rec, data, len, lsn);
+}
+
+/* the index entry for @rec, logged at @lsn */
+static void diaryfs_version_ent(struct diaryfs_vidx_ent *ent,
+		const struct diaryfs_rec *rec, u64 lsn, u32 flags)
+{
+	memset(ent, 0, sizeof(*ent));
+	ent->lsn = cpu_to_le64(lsn);
+	ent->seq = rec->seq;
+	ent->time = rec->time;
+	ent->offset = rec->offset;
+	ent->old_size = rec->old_size;
+	ent->length = rec->length;
+	ent->flags = cpu_to_le32(flags);
+}
+
+/*
+ * Should page @index get a checkpoint, @chain records and @bytes of payload
+ * after its last one?  Rebuilding the page from before them means reading
+ * and undoing every one, newest first; a checkpoint costs a page of log
+ * and lets readers start from it instead.  Take one once the chain hits
+ * the cap, or once undoing it, weighed by how often the file's history
+ * gets read, outgrows the space a checkpoint takes.
+ */
+static bool diaryfs_ckpt_due(struct inode *inode, u32 chain, u32 bytes)
+{
+	unsigned int reads = atomic_read(&DIARYFS_I(inode)->hist_reads);
+	u64 work;
+
+	if (!diaryfs_ckpt_chain)
+		return false;
+	if (chain >= diaryfs_ckpt_chain)
+		return true;
+	work = (u64)chain * DIARYFS_CKPT_REC_COST + bytes;
+	return work * (1 + ilog2(reads + 1)) >= DIARYFS_CKPT_SPACE * PAGE_SIZE;
+}
+
+/* log page @vp whole, @page being what write @wver left in it */
+static int diaryfs_version_ckpt(struct diaryfs_wver *wver,
+		struct diaryfs_vpage *vp, const u8 *page,
+		struct diaryfs_vidx_ent *ent)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(wver->inode->i_sb);
+	size_t len = max_t(int, vp->old_len, vp->off + vp->len);
+	struct diaryfs_rec rec;
+	u64 lsn;
+	int err;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = cpu_to_le16(DIARYFS_REC_CKPT);
+	rec.ino = cpu_to_le64(diaryfs_lower_inode(wver->inode)->i_ino);
+	rec.seq = cpu_to_le64(wver->seq);
+	rec.time = cpu_to_le64(timespec_to_ns(&wver->time));
+	rec.offset = cpu_to_le64((loff_t)vp->index << PAGE_SHIFT);
+	rec.length = cpu_to_le32(PAGE_SIZE);
+	rec.old_size = cpu_to_le64(wver->old_size);
+
+	err = diaryfs_log_append(sbi, &rec, page, len, &lsn);
+	if (err)
+		return err;
+	diaryfs_hash_chain_reset(wver->inode, vp->index);
+	diaryfs_version_ent(ent, &rec, lsn, DIARYFS_VIDX_CKPT);
+	return 0;
+}
+
+/*
+ * Turn one captured page into a version record and log it, followed by a
+ * checkpoint of the page if one is due.  Returns how many records were
+ * logged, with their index entries in @ents.
+ */
+static unsigned int diaryfs_version_page(struct diaryfs_wver *wver,
+		struct diaryfs_vpage *vp, u8 *delta, struct diaryfs_vidx_ent *ents)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(wver->inode->i_sb);
+	u8 *old = kmap(vp->old);
+	u8 *new = vp->new ? kmap(vp->new) : NULL;
+	int old_sub = clamp_t(int, vp->old_len - (int)vp->off, 0, vp->len);
+	struct diaryfs_rec rec;
+	unsigned int nr = 0;
+	u32 bytes = 0, chain, chain_bytes;
+	u64 start = diaryfs_trace_start(diaryfs_diff);
+	ssize_t delta_len;
+	u64 lsn;
+	int err;
+
+	/* rewritten with what it already held: nothing to record */
+	if (new && old_sub == vp->len &&
+	    !memcmp(old + vp->off, new + vp->off, vp->len))
+		goto fill;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.ino = cpu_to_le64(diaryfs_lower_inode(wver->inode)->i_ino);
+	rec.seq = cpu_to_le64(wver->seq);
+	rec.time = cpu_to_le64(timespec_to_ns(&wver->time));
+	rec.offset = cpu_to_le64(((loff_t)vp->index << PAGE_SHIFT) + vp->off);
+	rec.length = cpu_to_le32(vp->len);
+	rec.old_size = cpu_to_le64(wver->old_size);
+
+	/*
+	 * Describe the old contents in terms of the new ones, so history can
+	 * be rebuilt backwards from the live file.  A delta that is no smaller
+	 * than the old bytes themselves comes back as -E2BIG, and we store the
+	 * bytes instead, as we do when there are no new ones.
+	 */
+	delta_len = new ? diaryfs_delta_encode(new + vp->off, vp->len,
+			old + vp->off, old_sub, delta, old_sub) : 0;
+	if (delta_len > 0) {
+		rec.type = cpu_to_le16(DIARYFS_REC_DELTA);
+		err = diaryfs_log_append(sbi, &rec, delta, delta_len, &lsn);
+		bytes = delta_len;
+	} else {
+		err = diaryfs_version_data(sbi, &rec, old + vp->off, old_sub,
+				&lsn);
+		bytes = old_sub;
+	}
+	if (err) {
+		printk_ratelimited(KERN_ERR "diaryfs: lost version of ino %lu "
+				"at %llu: %d\n", wver->inode->i_ino,
+				le64_to_cpu(rec.offset), err);
+	} else {
+		diaryfs_version_ent(&ents[nr++], &rec, lsn,
+				new || vp->off ? 0 : DIARYFS_VIDX_WHOLE);
+		diaryfs_stat_add(sbi, DIARYFS_STAT_VERSIONED, vp->len);
+	}
+
+fill:
+	trace_diaryfs_diff(wver->inode, wver->seq, vp->index, vp->off, vp->len,
+			nr ? le16_to_cpu(rec.type) : 0, bytes, start);
+	if (!new) {
+		/* undoing the record restores the whole page, like a checkpoint */
+		if (nr && !vp->off)
+			diaryfs_hash_chain_reset(wver->inode, vp->index);
+		goto out;
+	}
+
+	/* the page as it is now that the write has landed */
+	memcpy(old + vp->off, new + vp->off, vp->len);
+	if (max_t(int, vp->old_len, vp->off + vp->len) == PAGE_SIZE)
+		diaryfs_hash_fill(wver->inode, vp->index, wver->seq, old);
+
+	if (nr && diaryfs_hash_chain(wver->inode, vp->index, bytes, &chain,
+			&chain_bytes) &&
+	    diaryfs_ckpt_due(wver->inode, chain, chain_bytes)) {
+		/* without it, readers just go on undoing the chain */
+		if (!diaryfs_version_ckpt(wver, vp, old, &ents[nr]))
+			nr++;
+	}
+	kunmap(vp->new);
+out:
+	kunmap(vp->old);
+	return nr;
+}
+
+/*
+ * diaryfs_version_process - diff and record a captured write
+ *
+ * Runs on a queue worker, in per-inode write order.  The worker frees
+ * @wver afterwards.
+ */
+void diaryfs_version_process(struct diaryfs_wver *wver)
+{
+	struct diaryfs_sb_info *sbi = DIARYFS_SB(wver->inode->i_sb);
+	struct diaryfs_vidx_ent *ents, ent[2];
+	struct diaryfs_vpage *vp;
+	unsigned int i, n, nr = 0, lost = 0;
+	struct page *delta;
+	u8 *buf;
+
+	/* if this fails the records are still logged, just not indexed */
+	ents = kmalloc_array(2 * wver->nr_pages, sizeof(*ents), GFP_NOFS);
+
+	/* scratch for the encoded delta, from the same pool as the capture */
+	delta = mempool_alloc(sbi->page_pool, GFP_NOFS);
+	buf = kmap(delta);
+	list_for_each_entry(vp, &wver->pages, list) {
+		n = diaryfs_version_page(wver, vp, buf, ent);
+		for (i = 0; i < n; i++) {
+			if (ents)
+				ents[nr++] = ent[i];
+			else
+				lost++;
+		}
+	}
+	kunmap(delta);
+	mempool_free(delta, sbi->page_pool);
+
+	if (nr)
+		diaryfs_index_append(wver->inode, ents, nr);
+	if (lost)
+		printk_ratelimited(KERN_ERR "diaryfs: lost index entries of "
+				"ino %lu: %d\n", wver->inode->i_ino, -ENOMEM);
+	kfree(ents);
+}
+
+/*
+ * diaryfs_version_end - hand over what a write actually replaced
+ *
+ * @written is the result of the lower write.  Only pages (or the leading
+ * part of a page) that were really written are kept; the index is told to
+ * forget anything else the write may have touched.  Called with the upper
+ * i_mutex held, or from AIO completion while inode_dio_wait holds off the
+ * next writer.
+ */
+void diaryfs_version_end(struct diaryfs_wver *wver, ssize_t written)
+{
+	struct diaryfs_sb_info *sbi;
+	struct diaryfs_vpage *vp, *n;
+	unsigned int dropped = 0;
+	loff_t end;
+
+	if (!wver)
+		return;
+	sbi = DIARYFS_SB(wver->inode->i_sb);
+	end = wver->pos + max_t(ssize_t, written, 0);
+
+	list_for_each_entry_safe(vp, n, &wver->pages, list) {
+		loff_t start = ((loff_t)vp->index << PAGE_SHIFT) + vp->off;
+
+		if (start + vp->len <= end) {
+			diaryfs_hash_update(wver->inode, vp->index, vp->off,
+					vp->len, vp->hash, wver->seq);
+			continue;
+		}
+		/* short write: we don't have a hash for what did land */
+		diaryfs_hash_invalidate(wver->inode, start, start + vp->len);
+		if (start < end) {
+			vp->len = end - start;
+			continue;
+		}
+		list_del(&vp->list);
+		diaryfs_vpage_free(sbi, vp);
+		wver->nr_pages--;
+		dropped++;
+	}
+	if (written > 0)
+		diaryfs_hash_stamp(wver->inode);
+
+	/* only a write with something captured took a place in the queue */
+	if (!wver->busy) {
+		diaryfs_version_free(wver);
+		return;
+	}
+	if (dropped) {
+		atomic_sub(dropped, &sbi->vq_depth);
+		wake_up_all(&sbi->vq_wait);
+	}
+	diaryfs_vq_ready(wver);
+}